@@ -0,0 +1,55 @@
+/*
+ * What the sections' allocator costs: one VM per request, built, loaded with
+ * the PoliCTF ciphertext and thrown away without running, with its sections
+ * coming from the heap or from a monotonic buffer released after every
+ * request. Then the same for a bare VMAddrSpace, where the allocations are
+ * most of the work.
+ *
+ *   pasticciotto-bench-alloc.elf [requests]
+ */
+#include "../vm/vm.h"
+#include "../tests/vm/programs.h"
+#include <chrono>
+#include <memory_resource>
+#include <stdio.h>
+#include <stdlib.h>
+
+template<typename request_t>
+static double perRequest(uint32_t count, std::pmr::monotonic_buffer_resource *arena, request_t request) {
+    uint32_t i;
+
+    auto start = std::chrono::steady_clock::now();
+    for (i = 0; i < count; i++) {
+        request(arena);
+        if (arena) {
+            arena->release();
+        }
+    }
+    std::chrono::duration<double, std::nano> took = std::chrono::steady_clock::now() - start;
+    return took.count() / count;
+}
+
+static void vmRequest(std::pmr::memory_resource *resource) {
+    VM vm(PROGRAMS_KEY, DECRYPT_PSTC, DECRYPT_PSTC_LEN, ENGINE_HANDLERS, 0, resource);
+
+    vm.addressSpace()->insData(EN_DATASECTION, EN_DATASECTION_LEN);
+}
+
+static void asRequest(std::pmr::memory_resource *resource) {
+    VMAddrSpace as(DEFAULT_STACKSIZE, DEFAULT_CODESIZE, DEFAULT_DATASIZE, 0, resource);
+
+    as.insData(EN_DATASECTION, EN_DATASECTION_LEN);
+}
+
+int main(int argc, char *argv[]) {
+    static uint8_t buffer[0x1000];
+    uint32_t count = argc > 1 ? atoi(argv[1]) : 1000000;
+    std::pmr::monotonic_buffer_resource arena(buffer, sizeof(buffer), std::pmr::null_memory_resource());
+
+    printf("%u requests, nanoseconds per request\n", count);
+    printf("%-16s%10.1f\n", "VM heap", perRequest(count, NULL, vmRequest));
+    printf("%-16s%10.1f\n", "VM monotonic", perRequest(count, &arena, vmRequest));
+    printf("%-16s%10.1f\n", "VMAS heap", perRequest(count, NULL, asRequest));
+    printf("%-16s%10.1f\n", "VMAS monotonic", perRequest(count, &arena, asRequest));
+    return 0;
+}
@@ -0,0 +1,57 @@
+/*
+ * What a variant costs when many of them go on from a common prefix: a VM
+ * on wide segments whose whole data section was written, then one VM per
+ * variant writing a few bytes of its own. Either every variant gets a full
+ * copy of the prefix, or it is forked from a single snapshot and only
+ * copies the pages it writes to.
+ *
+ *   pasticciotto-bench-fork.elf [variants]
+ */
+#include "../vm/vm.h"
+#include "../tests/vm/programs.h"
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+template<typename variant_t>
+static double perVariant(uint32_t count, variant_t variant) {
+    uint32_t i;
+
+    auto start = std::chrono::steady_clock::now();
+    for (i = 0; i < count; i++) {
+        variant(i);
+    }
+    std::chrono::duration<double, std::nano> took = std::chrono::steady_clock::now() - start;
+    return took.count() / count;
+}
+
+int main(int argc, char *argv[]) {
+    uint32_t count = argc > 1 ? atoi(argv[1]) : 10000, i;
+    std::vector<uint8_t> prefix(WIDE_SEGMENT);
+    VM vm(PROGRAMS_KEY, DECRYPT_PSTC, DECRYPT_PSTC_LEN, ENGINE_HANDLERS, AS_WIDE);
+
+    for (i = 0; i < prefix.size(); i++) {
+        prefix[i] = i * 0x47;
+    }
+    vm.addressSpace()->insData(prefix.data(), prefix.size());
+    std::shared_ptr<const VMSnapshot> snapshot = vm.snapshot();
+    if (!snapshot) {
+        fprintf(stderr, "No snapshots without mmap.\n");
+        return 1;
+    }
+
+    printf("%u variants, nanoseconds per variant\n", count);
+    printf("%-16s%10.1f\n", "copy", perVariant(count, [&](uint32_t i) {
+        VM copy(PROGRAMS_KEY, DECRYPT_PSTC, DECRYPT_PSTC_LEN, ENGINE_HANDLERS, AS_WIDE);
+
+        copy.addressSpace()->insData(prefix.data(), prefix.size());
+        copy.addressSpace()->insData(i % 0x1000 * 0x10, (uint8_t *) &i, sizeof(i));
+    }));
+    printf("%-16s%10.1f\n", "fork", perVariant(count, [&](uint32_t i) {
+        VM fork(snapshot);
+
+        fork.addressSpace()->insData(i % 0x1000 * 0x10, (uint8_t *) &i, sizeof(i));
+    }));
+    return 0;
+}
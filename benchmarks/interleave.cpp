@@ -0,0 +1,82 @@
+/*
+ * Aggregate instructions per second of the polictf programs run through
+ * an Interleaver, for every engine and a growing number of VMs in flight.
+ *
+ *   pasticciotto-bench-interleave.elf [vms] [slice]
+ */
+#include "../vm/interleave.h"
+#include "../tests/vm/programs.h"
+#include <chrono>
+#include <memory>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+typedef struct workload {
+    const char *name;
+    uint8_t *code;
+    uint32_t codesize;
+    uint8_t *data;
+    uint32_t datasize;
+} workload_t;
+
+static VM *load(workload_t &w, engines engine) {
+    VM *vm = new VM(PROGRAMS_KEY, w.code, w.codesize, engine);
+
+    vm->addressSpace()->insData(w.data, w.datasize);
+    return vm;
+}
+
+static uint64_t instructions(workload_t &w) {
+    std::unique_ptr<VM> vm(load(w, ENGINE_HANDLERS));
+    uint64_t n = 1;
+
+    while (vm->run(1) == VM_EXHAUSTED) {
+        n++;
+    }
+    return n;
+}
+
+int main(int argc, char *argv[]) {
+    static const engines ENGINES[] = {ENGINE_HANDLERS, ENGINE_THREADED, ENGINE_PREDECODED, ENGINE_BLOCKS,
+                                      ENGINE_JIT};
+    static const char *NAMES[] = {"handlers", "threaded", "predecoded", "blocks", "jit"};
+    static const uint32_t KS[] = {1, 2, 4, 8, 16, 32, 64};
+    uint32_t vms = argc > 1 ? atoi(argv[1]) : 256;
+    uint64_t slice = argc > 2 ? atoi(argv[2]) : 64;
+    workload_t workloads[] = {
+        {"decrypt", DECRYPT_PSTC, DECRYPT_PSTC_LEN, EN_DATASECTION, EN_DATASECTION_LEN},
+        {"encrypt", ENCRYPT_PSTC, ENCRYPT_PSTC_LEN, (uint8_t *) DE_DATASECTION, EN_DATASECTION_LEN},
+    };
+    uint32_t e, k, i;
+
+    printf("%u VMs, %lu instructions per slice, million instructions per second\n", vms,
+           (unsigned long) slice);
+    for (workload_t &w : workloads) {
+        uint64_t total = instructions(w) * vms;
+
+        printf("\n%-10s", w.name);
+        for (k = 0; k < sizeof(KS) / sizeof(*KS); k++) {
+            printf("%8s%-2u", "k=", KS[k]);
+        }
+        printf("\n");
+        for (e = 0; e < sizeof(ENGINES) / sizeof(*ENGINES); e++) {
+            printf("%-10s", NAMES[e]);
+            for (k = 0; k < sizeof(KS) / sizeof(*KS); k++) {
+                std::vector<std::unique_ptr<VM>> loaded;
+                Interleaver interleaver(KS[k], slice);
+
+                for (i = 0; i < vms; i++) {
+                    loaded.emplace_back(load(w, ENGINES[e]));
+                    interleaver.add(loaded.back().get());
+                }
+                auto start = std::chrono::steady_clock::now();
+                interleaver.run();
+                std::chrono::duration<double> took = std::chrono::steady_clock::now() - start;
+                printf("%10.1f", total / took.count() / 1e6);
+            }
+            printf("\n");
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,58 @@
+/*
+ * What an idle VM costs: many VMs built with the PoliCTF decryption program,
+ * the heap they take counted by the allocator itself before and after
+ * running it once. The last ones share a CodeImage.
+ *
+ *   pasticciotto-bench-memory.elf [vms]
+ */
+#include "../vm/vm.h"
+#include "../tests/vm/programs.h"
+#include <memory>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+static size_t heapInUse(void) {
+#ifdef __GLIBC__
+    struct mallinfo2 info = mallinfo2();
+
+    return info.uordblks + info.hblkhd;
+#else
+    return 0;
+#endif
+}
+
+int main(int argc, char *argv[]) {
+    static const engines ENGINES[] = {ENGINE_HANDLERS, ENGINE_PREDECODED, ENGINE_PREDECODED};
+    static const char *NAMES[] = {"handlers", "predecoded", "image"};
+    auto image = std::make_shared<const CodeImage>(DECRYPT_PSTC, DECRYPT_PSTC_LEN);
+    uint32_t count = argc > 1 ? atoi(argv[1]) : 100000;
+    uint32_t e, i;
+
+    printf("sizeof(VM) %zu, sizeof(VMAddrSpace) %zu\n", sizeof(VM), sizeof(VMAddrSpace));
+    printf("%u VMs, heap bytes per VM, idle and after one run\n", count);
+    for (e = 0; e < sizeof(ENGINES) / sizeof(*ENGINES); e++) {
+        std::vector<std::unique_ptr<VM>> vms;
+        size_t before, idle;
+
+        vms.reserve(count);
+        before = heapInUse();
+        for (i = 0; i < count; i++) {
+            if (e == 2) {
+                vms.emplace_back(new VM(PROGRAMS_KEY, image, ENGINES[e]));
+            } else {
+                vms.emplace_back(new VM(PROGRAMS_KEY, DECRYPT_PSTC, DECRYPT_PSTC_LEN, ENGINES[e]));
+            }
+        }
+        idle = heapInUse();
+        for (i = 0; i < count; i++) {
+            vms[i]->addressSpace()->insData(EN_DATASECTION, EN_DATASECTION_LEN);
+            vms[i]->run();
+        }
+        printf("%-12s%8zu%8zu\n", NAMES[e], (idle - before) / count, (heapInUse() - before) / count);
+    }
+    return 0;
+}
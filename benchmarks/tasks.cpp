@@ -0,0 +1,75 @@
+/*
+ * What a yield costs: many tasks each waiting at every iteration of a
+ * three instruction loop, so that almost all the time goes into getting
+ * in and out of the VM and through the scheduler. Built with -std=c++20,
+ * the same tasks also run as VMCoroutines, resumed round-robin.
+ *
+ *   pasticciotto-bench-tasks.elf [tasks] [yields]
+ */
+#include "../vm/task.h"
+#include "../tests/vm/programs.h"
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+// R0++, wait, again
+static uint8_t LOOP_PSTC[] = {K_ADDI, R0, 0x01, 0x00, K_SHIT, K_JMPI, 0x00, 0x00};
+
+int main(int argc, char *argv[]) {
+    static const engines ENGINES[] = {ENGINE_HANDLERS, ENGINE_THREADED, ENGINE_PREDECODED, ENGINE_BLOCKS};
+    static const char *NAMES[] = {"handlers", "threaded", "predecoded", "blocks"};
+    uint32_t count = argc > 1 ? atoi(argv[1]) : 10000;
+    uint16_t yields = argc > 2 ? atoi(argv[2]) : 100;
+    uint32_t e, i;
+
+    printf("%u tasks, %u yields each, nanoseconds per yield\n", count, yields);
+    printf("%-10s%8s%12s\n", "", "tasks", "coroutines");
+    for (e = 0; e < sizeof(ENGINES) / sizeof(*ENGINES); e++) {
+        std::vector<std::unique_ptr<VM>> vms;
+        std::vector<std::unique_ptr<VMTask>> tasks;
+        TaskScheduler *scheduler;
+        TaskScheduler s([&scheduler, yields](VMTask *task) {
+            if (task->getVM().reg(R0) < yields) {
+                scheduler->wake(task);
+            }
+        });
+
+        scheduler = &s;
+        for (i = 0; i < count; i++) {
+            vms.emplace_back(new VM(PROGRAMS_KEY, LOOP_PSTC, sizeof(LOOP_PSTC), ENGINES[e]));
+            tasks.emplace_back(new VMTask(*vms.back()));
+            tasks.back()->waitAt(0x04);
+            s.spawn(tasks.back().get());
+        }
+        auto start = std::chrono::steady_clock::now();
+        s.run();
+        std::chrono::duration<double, std::nano> took = std::chrono::steady_clock::now() - start;
+        printf("%-10s%8.1f", NAMES[e], took.count() / ((uint64_t) count * yields));
+#ifdef __cpp_impl_coroutine
+        std::deque<std::pair<uint32_t, VMCoroutine>> ready;
+
+        for (i = 0; i < count; i++) {
+            vms[i]->reload(LOOP_PSTC, sizeof(LOOP_PSTC), NULL, 0);
+            tasks[i].reset(new VMTask(*vms[i]));
+            tasks[i]->waitAt(0x04);
+            ready.emplace_back(i, VMCoroutine::of(*tasks[i]));
+        }
+        start = std::chrono::steady_clock::now();
+        while (!ready.empty()) {
+            std::pair<uint32_t, VMCoroutine> next = std::move(ready.front());
+
+            ready.pop_front();
+            if (next.second.resume() == TASK_YIELDED || vms[next.first]->reg(R0) < yields) {
+                ready.push_back(std::move(next));
+            }
+        }
+        took = std::chrono::steady_clock::now() - start;
+        printf("%12.1f", took.count() / ((uint64_t) count * yields));
+#endif
+        printf("\n");
+    }
+    return 0;
+}
@@ -6,6 +6,8 @@
 #define OPCODES_KEYLEN 15
 #define CODESIZE 0x300
 #define FLAG_LEN 30
+// the reference decrypt.pstc takes about 70k
+#define MAX_INSTRUCTIONS 0x1000000
 
 unsigned char EN_DATASECTION[] = {
         0x8c, 0xea, 0xbe, 0xaa, 0xed, 0xa0, 0xd0, 0x6b, 0x99, 0x1c, 0x52, 0x25,
@@ -54,7 +56,11 @@ int main(int argc, char *argv[]) {
     }
     VM vm(opcodes_key, clientcode, clientcodesize);
     vm.addressSpace()->insData(EN_DATASECTION, DATASECTIONLEN);
-    vm.run();
+    if (vm.run(MAX_INSTRUCTIONS) == VM_EXHAUSTED) {
+        printf("Too slow!\n");
+        fflush(stdout);
+        exit(1);
+    }
 
     datap = fopen("../res/decrypteddatasection.txt", "r");
     if (datap == NULL) {
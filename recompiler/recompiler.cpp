@@ -0,0 +1,44 @@
+#include "../vm/debug.h"
+#include "../vm/aot.h"
+#include <fstream>
+
+int main(int argc, char *argv[]) {
+    std::ifstream bytecode_if;
+    std::streamsize bytecode_size;
+    uint8_t *bytecode;
+    FILE *out;
+
+    if (argc < 5) {
+        printf("Usage: %s <opcodes_key> <program> <class_name> <output>\n", argv[0]);
+        printf("Writes to <output> a C++ class named <class_name> running <program> natively.\n");
+        return 1;
+    }
+
+    /*
+    reading bytecode
+    */
+    bytecode_if.open(argv[2], std::ios::binary | std::ios::ate);
+    if (!bytecode_if.good()) {
+        printf("File is not valid.\n");
+        return -1;
+    }
+    bytecode_size = bytecode_if.tellg();
+    bytecode_if.seekg(0, std::ios::beg);
+
+    bytecode = new uint8_t[bytecode_size];
+    bytecode_if.read((char *) bytecode, bytecode_size);
+    VM vm((uint8_t *) argv[1], bytecode, bytecode_size);
+    Recompiler recompiler(vm);
+    out = fopen(argv[4], "w");
+    if (!out) {
+        printf("Can't open %s.\n", argv[4]);
+        return -1;
+    }
+    if (!recompiler.recompile(out, argv[3])) {
+        printf("Can't recompile %s: %s.\n", argv[2], recompiler.error());
+        fclose(out);
+        return -1;
+    }
+    fclose(out);
+    return 0;
+}
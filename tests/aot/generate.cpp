@@ -0,0 +1,141 @@
+#include "../../vm/aot.h"
+#include "../vm/programs.h"
+#include "../vm/random_programs.h"
+#include <stdlib.h>
+
+/*
+ * Writes to argv[1] the recompiled programs tests/aot/test_aot.cpp checks
+ * against the handlers.
+ */
+
+#define RANDOM_PROGRAMS 100
+
+// register 11 is the flags: MOVI writes all of it first, so that nothing depends on what VM leaves there
+static uint8_t FLAGS_REGISTER[] = {
+        K_MOVI, 0x0b, 0x01, 0x5a,   // 0x00: MOVI 11, 0x5a01
+        K_MOVR, 0x0b,               // 0x04: MOVR R0, 11
+        K_PUSH, 0x0b,               // 0x06: PUSH 11
+        K_CMPB, 0x0b, 0x00,         // 0x08: CMPB 11, 0x00
+        K_MOVR, 0x1b,               // 0x0b: MOVR R1, 11
+        K_ADDR, 0xb0,               // 0x0d: ADDR 11, R0
+        K_MOVR, 0x2b,               // 0x0f: MOVR R2, 11
+        K_JPEI, 0x16, 0x00,         // 0x11: JPEI 0x16
+        K_NOTR, 0x3b,               // 0x14: NOTR R3, 11
+        K_POOP, 0x0b,               // 0x16: POOP 11
+        K_MOVR, 0x4b,               // 0x18: MOVR S0, 11
+        K_SHIT                      // 0x1a: SHIT
+};
+
+static uint8_t STORE_SPECIAL_REGISTERS[] = {
+        K_CALL, 0x04, 0x00,         // 0x00: CALL 0x04
+        K_SHIT,                     // 0x03: SHIT
+        K_STRI, 0x00, 0x00, IP,     // 0x04: STRI 0x00, IP
+        K_STRI, 0x02, 0x00, RP,     // 0x08: STRI 0x02, RP
+        K_STRI, 0x04, 0x00, SP,     // 0x0c: STRI 0x04, SP
+        K_RETN                      // 0x10: RETN
+};
+
+static uint8_t REGISTER_JUMPS[] = {
+        K_MOVI, 0x00, 0x0e, 0x00,   // 0x00: MOVI R0, 0x0e
+        K_CMPR, 0x00,               // 0x04: CMPR R0, R0
+        K_JPER, 0x0b,               // 0x06: JPER 11, jumps to 0x0b
+        K_SHIT,                     // 0x08: SHIT
+        K_NOPE,                     // 0x09: NOPE
+        K_NOPE,                     // 0x0a: NOPE
+        K_NOPE,                     // 0x0b: NOPE
+        K_MOVI, 0x01, K_NOPE, K_SHIT, // 0x0c: MOVI R1, with NOPE; SHIT at 0x0e
+        K_JPNR, 0x04,               // 0x10: JPNR 4
+        K_JMPR, 0x00,               // 0x12: JMPR R0, into the MOVI
+        K_SHIT                      // 0x14: SHIT
+};
+
+static uint8_t SHIFTS_AND_FAULTS[] = {
+        K_MOVI, 0x00, 0xef, 0xbe,   // 0x00: MOVI R0, 0xbeef
+        K_MOVR, 0x10,               // 0x04: MOVR R1, R0
+        K_SHLI, 0x00, 0x21, 0x00,   // 0x06: SHLI R0, 33
+        K_SHRI, 0x01, 0x14, 0x00,   // 0x0a: SHRI R1, 20
+        K_MOVI, 0x02, 0x28, 0x00,   // 0x0e: MOVI R2, 40
+        K_MOVI, 0x03, 0xef, 0xbe,   // 0x12: MOVI R3, 0xbeef
+        K_SHRR, 0x32,               // 0x16: SHRR R3, R2
+        K_SHLR, 0x02,               // 0x18: SHLR R0, R2
+        K_MULI, 0x03, 0xff, 0xff,   // 0x1a: MULI R3, 0xffff
+        K_MOVI, 0x04, 0x00, 0x01,   // 0x1e: MOVI S0, 0x100
+        K_DIVR, 0x34,               // 0x22: DIVR R3, S0, faults on the lower byte
+        K_SHIT                      // 0x24: SHIT
+};
+
+static uint8_t JUMP_OUTSIDE[] = {
+        K_GRMN,                     // 0x00: GRMN
+        K_JMPI, 0x34, 0x12          // 0x01: JMPI 0x1234
+};
+
+// the handlers would read below the stack, the recompiled class stops
+static uint8_t STACK_UNDERFLOW[] = {
+        K_POOP, 0x00,               // 0x00: POOP R0
+        K_SHIT                      // 0x02: SHIT
+};
+
+// every address is inside wide segments, up to the word at 0xffff
+static uint8_t WIDE_SEGMENTS[] = {
+        K_MOVI, R0, 0xff, 0xff,     // 0x00: MOVI R0, 0xffff
+        K_MOVI, R1, 0xef, 0xbe,     // 0x04: MOVI R1, 0xbeef
+        K_STRR, R0 << 4 | R1,       // 0x08: STRR R0, R1
+        K_LODR, R2 << 4 | R0,       // 0x0a: LODR R2, R0
+        K_LODI, R3, 0xfe, 0xff,     // 0x0c: LODI R3, 0xfffe
+        K_SHIT                      // 0x10: SHIT
+};
+
+// nothing to embed but the size, whatever 0x00 decodes to: 12 bytes hold whole instructions of any length
+static uint8_t ALL_ZEROES[12] = {0};
+
+static FILE *out;
+
+static void recompile(const char *name, uint8_t *code, uint32_t size, uint8_t options = 0) {
+    VM vm(PROGRAMS_KEY, code, size, ENGINE_HANDLERS, options);
+    Recompiler recompiler(vm);
+
+    if (!recompiler.recompile(out, name)) {
+        fprintf(stderr, "Can't recompile %s: %s.\n", name, recompiler.error());
+        exit(1);
+    }
+    return;
+}
+
+int main(int argc, char *argv[]) {
+    std::vector<uint8_t> code;
+    char name[32];
+    uint32_t i;
+
+    if (argc < 2 || !(out = fopen(argv[1], "w"))) {
+        fprintf(stderr, "Usage: %s <output>\n", argv[0]);
+        return 1;
+    }
+    // the data sections are test_aot.cpp's business
+    (void) EN_DATASECTION;
+    (void) EN_DATASECTION_LEN;
+    recompile("AotEncrypt", ENCRYPT_PSTC, ENCRYPT_PSTC_LEN);
+    recompile("AotDecrypt", DECRYPT_PSTC, DECRYPT_PSTC_LEN);
+    recompile("AotFlagsRegister", FLAGS_REGISTER, sizeof(FLAGS_REGISTER));
+    recompile("AotStoreSpecialRegisters", STORE_SPECIAL_REGISTERS, sizeof(STORE_SPECIAL_REGISTERS));
+    recompile("AotRegisterJumps", REGISTER_JUMPS, sizeof(REGISTER_JUMPS));
+    recompile("AotShiftsAndFaults", SHIFTS_AND_FAULTS, sizeof(SHIFTS_AND_FAULTS));
+    recompile("AotJumpOutside", JUMP_OUTSIDE, sizeof(JUMP_OUTSIDE));
+    recompile("AotStackUnderflow", STACK_UNDERFLOW, sizeof(STACK_UNDERFLOW));
+    recompile("AotWideSegments", WIDE_SEGMENTS, sizeof(WIDE_SEGMENTS), AS_WIDE | AS_GUARDED);
+    recompile("AotAllZeroes", ALL_ZEROES, sizeof(ALL_ZEROES));
+    fprintf(out, "#define AOT_SNIPPETS(X) X(AotFlagsRegister) X(AotStoreSpecialRegisters) X(AotRegisterJumps) "
+           "X(AotShiftsAndFaults) X(AotJumpOutside) X(AotAllZeroes)\n");
+
+    for (i = 0; i < RANDOM_PROGRAMS; i++) {
+        code = genProgram(20 + rnd(60));
+        snprintf(name, sizeof(name), "AotRandom%u", i);
+        recompile(name, code.data(), code.size());
+    }
+    fprintf(out, "#define AOT_RANDOM_PROGRAMS(X)");
+    for (i = 0; i < RANDOM_PROGRAMS; i++) {
+        fprintf(out, " X(AotRandom%u)", i);
+    }
+    fprintf(out, "\n");
+    fclose(out);
+    return 0;
+}
@@ -0,0 +1,118 @@
+#include "../include/catch.hpp"
+#include "../../vm/vm.h"
+#include "../vm/programs.h"
+#include "aot-tests.h"
+#include <cstring>
+
+template<typename T>
+static void requireSameState(VM &vm, T &aot) {
+    VMAddrSpace *vas = vm.addressSpace(), *aas = aot.addressSpace();
+    uint32_t i;
+
+    for (i = 0; i < NUM_REGS; i++) {
+        REQUIRE(vm.reg(i) == aot.reg(i));
+    }
+    REQUIRE(memcmp(vas->getData(), aas->getData(), vas->getDatasize()) == 0);
+    REQUIRE(memcmp(vas->getStack(), aas->getStack(), vas->getStacksize()) == 0);
+}
+
+/*
+ * A recompiled program has to leave its state, and return the status,
+ * exactly as ENGINE_HANDLERS does, also when run() is called again after
+ * it stopped. With a budget, it goes budget instructions at a time until
+ * it stops for good.
+ */
+template<typename T>
+static void requireSameRun(uint8_t *data = NULL, uint32_t datasize = 0, uint64_t budget = UINT64_MAX) {
+    T aot;
+    VMAddrSpace *aas = aot.addressSpace();
+    VM vm(PROGRAMS_KEY, aas->getCode(), aas->getCodesize(), ENGINE_HANDLERS, aas->getOptions());
+    statuses status;
+    uint32_t pass;
+
+    if (data) {
+        vm.addressSpace()->insData(data, datasize);
+        aas->insData(data, datasize);
+    }
+    for (pass = 0; pass < 2; pass++) {
+        do {
+            status = vm.run(budget);
+            REQUIRE(aot.run(budget) == status);
+            requireSameState(vm, aot);
+        } while (status == VM_EXHAUSTED);
+    }
+}
+
+#define REQUIRE_SAME_RUN(_class_) requireSameRun<_class_>();
+#define REQUIRE_SAME_BUDGETED_RUN(_class_)                                     \
+  requireSameRun<_class_>(NULL, 0, 1);                                         \
+  requireSameRun<_class_>(NULL, 0, 7);
+
+TEST_CASE("Recompiled programs", "[AOT]") {
+    SECTION("polictf programs") {
+        AotDecrypt aot;
+        uint32_t i;
+
+        requireSameRun<AotEncrypt>();
+        requireSameRun<AotDecrypt>(EN_DATASECTION, EN_DATASECTION_LEN);
+        requireSameRun<AotEncrypt>(NULL, 0, 13);
+        requireSameRun<AotDecrypt>(EN_DATASECTION, EN_DATASECTION_LEN, 13);
+        aot.addressSpace()->insData(EN_DATASECTION, EN_DATASECTION_LEN);
+        REQUIRE(aot.run() == VM_HALTED);
+        for (i = 0; i < EN_DATASECTION_LEN; i++) {
+            REQUIRE(aot.addressSpace()->getData()[i] == (uint8_t) DE_DATASECTION[i]);
+        }
+    }
+    SECTION("Odd corners of the handlers") {
+        AOT_SNIPPETS(REQUIRE_SAME_RUN)
+    }
+    SECTION("Random programs") {
+        AOT_RANDOM_PROGRAMS(REQUIRE_SAME_RUN)
+    }
+    SECTION("Running out of budget") {
+        AOT_SNIPPETS(REQUIRE_SAME_BUDGETED_RUN)
+        AOT_RANDOM_PROGRAMS(REQUIRE_SAME_BUDGETED_RUN)
+    }
+    SECTION("The code section can't change under a recompiled program") {
+        AotJumpOutside aot;
+        uint8_t nope[] = {K_NOPE};
+
+        aot.addressSpace()->insCode(nope, sizeof(nope));
+        REQUIRE_THROWS(aot.run());
+    }
+    SECTION("POOP on an empty stack stops there") {
+        AotStackUnderflow aot;
+
+        REQUIRE(aot.run() == VM_FAULTED);
+        REQUIRE(aot.reg(IP) == 0);
+        REQUIRE(aot.reg(SP) == 0);
+    }
+    SECTION("Stores raise the high-water marks") {
+        AotStoreSpecialRegisters aot;
+        VMAddrSpace *as = aot.addressSpace();
+
+        aot.run();
+        REQUIRE(as->dataSection()[0x05] == 0);
+        REQUIRE(as->dataSection()[0x04] == 0x02);
+        REQUIRE(as->stackSection()[0x00] == 0x03);
+        // past the marks, where clear() must not go
+        as->dataSection()[0x06] = 0xaa;
+        as->stackSection()[0x02] = 0xaa;
+        as->clear();
+        REQUIRE(as->dataSection()[0x04] == 0);
+        REQUIRE(as->stackSection()[0x00] == 0);
+        REQUIRE(as->dataSection()[0x06] == 0xaa);
+        REQUIRE(as->stackSection()[0x02] == 0xaa);
+    }
+    SECTION("Wide and guarded segments") {
+        AotWideSegments aot;
+
+        REQUIRE(aot.addressSpace()->getOptions() == (AS_WIDE | AS_GUARDED));
+        REQUIRE(aot.addressSpace()->getDatasize() == WIDE_SEGMENT);
+        REQUIRE(aot.addressSpace()->getStacksize() == WIDE_SEGMENT);
+        aot.run();
+        REQUIRE(aot.reg(R2) == 0xbeef);
+        REQUIRE(aot.reg(R3) == 0xef00);
+        requireSameRun<AotWideSegments>();
+    }
+}
@@ -0,0 +1,107 @@
+#include "../include/catch.hpp"
+#include "../../vm/batch.h"
+#include "../vm/programs.h"
+#include "../vm/random_programs.h"
+#include <cstring>
+
+/*
+ * Every lane has to end as a VM running the same program over the same
+ * data section does.
+ */
+static void requireSameLanes(uint8_t *code, uint32_t codesize, std::vector<std::vector<uint8_t>> &datas) {
+    BatchVM batch(PROGRAMS_KEY, code, codesize, datas.size());
+    uint32_t lane, i;
+
+    for (lane = 0; lane < datas.size(); lane++) {
+        REQUIRE(batch.insData(lane, datas[lane].data(), datas[lane].size()));
+        REQUIRE(batch.status(lane) == VM_EXHAUSTED);
+    }
+    batch.run();
+    for (lane = 0; lane < datas.size(); lane++) {
+        VM vm(PROGRAMS_KEY, code, codesize);
+        VMAddrSpace *as = vm.addressSpace();
+        std::vector<uint8_t> data(as->getDatasize()), stack(as->getStacksize());
+
+        as->insData(datas[lane].data(), datas[lane].size());
+        REQUIRE(batch.status(lane) == vm.run());
+        for (i = 0; i < NUM_REGS; i++) {
+            REQUIRE(batch.reg(lane, i) == vm.reg(i));
+        }
+        batch.getData(lane, data.data());
+        batch.getStack(lane, stack.data());
+        REQUIRE(memcmp(data.data(), as->getData(), data.size()) == 0);
+        REQUIRE(memcmp(stack.data(), as->getStack(), stack.size()) == 0);
+    }
+}
+
+static std::vector<std::vector<uint8_t>> randomDatas(uint32_t lanes) {
+    std::vector<std::vector<uint8_t>> datas(lanes);
+    uint32_t lane, i;
+
+    for (lane = 0; lane < lanes; lane++) {
+        datas[lane].resize(DEFAULT_DATASIZE);
+        for (i = 0; i < DEFAULT_DATASIZE; i++) {
+            // small values, so that loads from them land inside the data section
+            datas[lane][i] = rnd(4) ? rnd(0x10) : rnd(0x100);
+        }
+    }
+    return datas;
+}
+
+TEST_CASE("Batch VM", "[VM][batch]") {
+    std::vector<std::vector<uint8_t>> datas;
+    std::vector<uint8_t> code;
+    uint32_t n;
+
+    SECTION("polictf programs") {
+        BatchVM batch(PROGRAMS_KEY, DECRYPT_PSTC, DECRYPT_PSTC_LEN, 20);
+        uint8_t data[DEFAULT_DATASIZE];
+        uint32_t lane, i;
+
+        for (lane = 0; lane < 20; lane++) {
+            datas.push_back(std::vector<uint8_t>(EN_DATASECTION, EN_DATASECTION + EN_DATASECTION_LEN));
+            // a different ciphertext byte on every lane but the first
+            datas.back()[lane % EN_DATASECTION_LEN] ^= lane;
+            batch.insData(lane, datas.back().data(), datas.back().size());
+        }
+        requireSameLanes(DECRYPT_PSTC, DECRYPT_PSTC_LEN, datas);
+        requireSameLanes(ENCRYPT_PSTC, ENCRYPT_PSTC_LEN, datas);
+        batch.run();
+        batch.getData(0, data);
+        for (i = 0; i < EN_DATASECTION_LEN; i++) {
+            REQUIRE(data[i] == (uint8_t) DE_DATASECTION[i]);
+        }
+    }
+    SECTION("Diverging lanes") {
+        /*
+         * Sums data[0] down to 1, lanes starting above 0x80 divide by zero
+         * instead. Lanes leaving the loop early wait on SHIT with ZF clear,
+         * while the others still take the JPNI back.
+         */
+        uint8_t code[] = {K_LODI, R0, 0x00, 0x00,
+                          K_CMPB, R0, 0x80,
+                          K_JPAI, 0x20, 0x00,
+                          K_CMPB, R0, 0x00,
+                          K_JPEI, 0x1f, 0x00,
+                          K_ADDR, R1 << 4 | R0,
+                          K_SUBI, R0, 0x01, 0x00,
+                          K_CMPB, R0, 0x00,
+                          K_JPNI, 0x10, 0x00,
+                          K_CMPB, R0, 0x01,
+                          K_SHIT,
+                          K_DIVI, R1, 0x00, 0x00};
+        uint32_t lane;
+
+        for (lane = 0; lane < 37; lane++) {
+            datas.push_back({(uint8_t) (lane * 7)});
+        }
+        requireSameLanes(code, sizeof(code), datas);
+    }
+    SECTION("Random programs") {
+        for (n = 0; n < 100; n++) {
+            code = genProgram(20 + rnd(60));
+            datas = randomDatas(1 + rnd(40));
+            requireSameLanes(code.data(), code.size(), datas);
+        }
+    }
+}
@@ -0,0 +1,57 @@
+#include "../include/catch.hpp"
+#include "../../vm/interleave.h"
+#include "../vm/programs.h"
+#include "../vm/random_programs.h"
+#include <cstring>
+#include <memory>
+
+static VM *load(std::vector<uint8_t> &code, engines engine) {
+    VM *vm = new VM(PROGRAMS_KEY, code.data(), code.size(), engine);
+
+    vm->addressSpace()->insData(EN_DATASECTION, EN_DATASECTION_LEN);
+    return vm;
+}
+
+TEST_CASE("Interleaver", "[VM][interleave]") {
+    std::vector<std::vector<uint8_t>> codes;
+    std::vector<std::unique_ptr<VM>> refs;
+    std::vector<statuses> expected;
+    uint32_t n, i;
+
+    SECTION("Nothing would ever run") {
+        REQUIRE_THROWS(Interleaver(0));
+        REQUIRE_THROWS(Interleaver(4, 0));
+    }
+    SECTION("Every VM ends as if it ran alone") {
+        for (n = 0; n < 60; n++) {
+            if (n % 20 == 0) {
+                codes.push_back(std::vector<uint8_t>(DECRYPT_PSTC, DECRYPT_PSTC + DECRYPT_PSTC_LEN));
+            } else {
+                codes.push_back(genProgram(20 + rnd(60)));
+            }
+            refs.emplace_back(load(codes.back(), ENGINE_HANDLERS));
+            expected.push_back(refs.back()->run());
+        }
+        for (uint32_t k : {1, 7, 100}) {
+            std::vector<std::unique_ptr<VM>> vms;
+            std::vector<statuses> got(codes.size(), VM_EXHAUSTED);
+            Interleaver interleaver(k, 1 + rnd(16));
+
+            for (n = 0; n < codes.size(); n++) {
+                vms.emplace_back(load(codes[n], n % 2 ? ENGINE_PREDECODED : ENGINE_HANDLERS));
+                interleaver.add(vms.back().get(), &got[n]);
+            }
+            interleaver.run();
+            for (n = 0; n < codes.size(); n++) {
+                VMAddrSpace *as = vms[n]->addressSpace(), *ref = refs[n]->addressSpace();
+
+                REQUIRE(got[n] == expected[n]);
+                for (i = 0; i < NUM_REGS; i++) {
+                    REQUIRE(vms[n]->reg(i) == refs[n]->reg(i));
+                }
+                REQUIRE(memcmp(as->getData(), ref->getData(), as->getDatasize()) == 0);
+                REQUIRE(memcmp(as->getStack(), ref->getStack(), as->getStacksize()) == 0);
+            }
+        }
+    }
+}
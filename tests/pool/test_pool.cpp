@@ -0,0 +1,115 @@
+#include "../include/catch.hpp"
+#include "../../vm/pool.h"
+#include "../vm/programs.h"
+#include "../vm/random_programs.h"
+#include <cstring>
+
+static uint8_t OTHER_KEY[] = "SomeOtherKey";
+
+/*
+ * A job has to end as a VM built just for it does, whatever ran on the
+ * worker before.
+ */
+static void requireSameResult(vm_result_t result, uint8_t *key, std::vector<uint8_t> &code,
+                              uint8_t *data, uint32_t datasize, uint64_t budget) {
+    VM vm(key, code.data(), code.size());
+    uint32_t i;
+
+    vm.addressSpace()->insData(data, datasize);
+    REQUIRE(result.status == vm.run(budget));
+    for (i = 0; i < NUM_REGS; i++) {
+        REQUIRE(result.regs[i] == vm.reg(i));
+    }
+    REQUIRE(result.data.size() == vm.addressSpace()->getDatasize());
+    REQUIRE(memcmp(result.data.data(), vm.addressSpace()->getData(), result.data.size()) == 0);
+}
+
+TEST_CASE("VM pool", "[VM][pool]") {
+    std::vector<std::vector<uint8_t>> codes;
+    std::vector<std::future<vm_result_t>> results;
+    std::vector<uint64_t> budgets;
+    uint32_t n;
+
+    SECTION("Jobs which do not fit") {
+        VMPool pool(2);
+        std::vector<uint8_t> big(DEFAULT_CODESIZE + 1);
+
+        REQUIRE_THROWS(pool.submit(PROGRAMS_KEY, big.data(), big.size(), NULL, 0));
+        REQUIRE_THROWS(pool.submit(PROGRAMS_KEY, DECRYPT_PSTC, DECRYPT_PSTC_LEN, big.data(), DEFAULT_DATASIZE + 1));
+    }
+    SECTION("polictf programs") {
+        VMPool pool(3);
+        vm_result_t result;
+        uint32_t i;
+
+        for (n = 0; n < 40; n++) {
+            results.push_back(pool.submit(PROGRAMS_KEY, DECRYPT_PSTC, DECRYPT_PSTC_LEN, EN_DATASECTION,
+                                          EN_DATASECTION_LEN));
+        }
+        for (n = 0; n < 40; n++) {
+            result = results[n].get();
+            REQUIRE(result.status == VM_HALTED);
+            for (i = 0; i < EN_DATASECTION_LEN; i++) {
+                REQUIRE(result.data[i] == (uint8_t) DE_DATASECTION[i]);
+            }
+        }
+    }
+    SECTION("Recycled VMs start from scratch") {
+        for (engines engine : {ENGINE_HANDLERS, ENGINE_PREDECODED, ENGINE_JIT}) {
+            VMPool pool(4, engine);
+
+            codes.clear();
+            results.clear();
+            budgets.clear();
+            for (n = 0; n < 200; n++) {
+                if (n % 10 == 0) {
+                    codes.push_back(std::vector<uint8_t>(DECRYPT_PSTC, DECRYPT_PSTC + DECRYPT_PSTC_LEN));
+                } else if (n % 10 < 4 && n > 10) {
+                    // the very same program again, which keeps what was decoded of it
+                    codes.push_back(codes[n - 10]);
+                } else {
+                    codes.push_back(genProgram(20 + rnd(60)));
+                }
+                budgets.push_back(rnd(4) ? UINT64_MAX : rnd(100));
+                results.push_back(pool.submit(n % 3 ? PROGRAMS_KEY : OTHER_KEY, codes[n].data(), codes[n].size(),
+                                              EN_DATASECTION, n % EN_DATASECTION_LEN, budgets[n]));
+            }
+            for (n = 0; n < 200; n++) {
+                requireSameResult(results[n].get(), n % 3 ? PROGRAMS_KEY : OTHER_KEY, codes[n], EN_DATASECTION,
+                                  n % EN_DATASECTION_LEN, budgets[n]);
+            }
+        }
+    }
+    SECTION("Workers keep a few VMs only") {
+        std::vector<std::string> keys;
+        VMPool pool(2);
+
+        codes.push_back(std::vector<uint8_t>(DECRYPT_PSTC, DECRYPT_PSTC + DECRYPT_PSTC_LEN));
+        for (n = 0; n < 3 * POOL_VMS; n++) {
+            keys.push_back("Key" + std::to_string(n));
+        }
+        // every key comes back after the others pushed it out
+        for (n = 0; n < 6 * POOL_VMS; n++) {
+            results.push_back(pool.submit((uint8_t *) keys[n % keys.size()].c_str(), codes[0].data(),
+                                          codes[0].size(), EN_DATASECTION, EN_DATASECTION_LEN));
+        }
+        for (n = 0; n < 6 * POOL_VMS; n++) {
+            requireSameResult(results[n].get(), (uint8_t *) keys[n % keys.size()].c_str(), codes[0],
+                              EN_DATASECTION, EN_DATASECTION_LEN, UINT64_MAX);
+        }
+        REQUIRE(pool.cachedVMs() <= 2 * POOL_VMS);
+    }
+    SECTION("Destroying the pool waits for its jobs") {
+        {
+            VMPool pool(2);
+
+            for (n = 0; n < 20; n++) {
+                results.push_back(pool.submit(PROGRAMS_KEY, DECRYPT_PSTC, DECRYPT_PSTC_LEN, EN_DATASECTION,
+                                              EN_DATASECTION_LEN));
+            }
+        }
+        for (n = 0; n < 20; n++) {
+            REQUIRE(results[n].wait_for(std::chrono::seconds(0)) == std::future_status::ready);
+        }
+    }
+}
@@ -0,0 +1,170 @@
+#include "../include/catch.hpp"
+#include "../../vm/task.h"
+#include "../vm/programs.h"
+#include <cstring>
+#include <deque>
+#include <memory>
+
+/*
+ * Adds data[0] to R1 three times, waiting at 0x04 for the host to write
+ * it every time.
+ */
+static uint8_t WAITING_PSTC[] = {K_MOVI, R2, 0x03, 0x00,
+                                 K_SHIT,
+                                 K_LODI, R0, 0x00, 0x00,
+                                 K_ADDR, R1 << 4 | R0,
+                                 K_SUBI, R2, 0x01, 0x00,
+                                 K_CMPB, R2, 0x00,
+                                 K_JPNI, 0x04, 0x00,
+                                 K_SHIT};
+
+TEST_CASE("VM tasks", "[VM][task]") {
+    std::vector<std::unique_ptr<VM>> vms;
+    std::vector<std::unique_ptr<VMTask>> tasks;
+    uint32_t n;
+
+    SECTION("A task ends as run() does") {
+        VM ref(PROGRAMS_KEY, DECRYPT_PSTC, DECRYPT_PSTC_LEN);
+        VM vm(PROGRAMS_KEY, DECRYPT_PSTC, DECRYPT_PSTC_LEN, ENGINE_PREDECODED);
+        VMTask task(vm, 1000);
+        uint32_t i, yields = 0;
+
+        REQUIRE_THROWS(VMTask(vm, 0));
+        ref.addressSpace()->insData(EN_DATASECTION, EN_DATASECTION_LEN);
+        vm.addressSpace()->insData(EN_DATASECTION, EN_DATASECTION_LEN);
+        REQUIRE(ref.run() == VM_HALTED);
+        while (task.resume() == TASK_YIELDED) {
+            yields++;
+        }
+        // the decrypt program runs 71414 instructions
+        REQUIRE(yields == 71);
+        REQUIRE(task.getState() == TASK_HALTED);
+        REQUIRE(task.resume() == TASK_HALTED);
+        for (i = 0; i < NUM_REGS; i++) {
+            REQUIRE(vm.reg(i) == ref.reg(i));
+        }
+        REQUIRE(memcmp(vm.addressSpace()->getData(), ref.addressSpace()->getData(), DEFAULT_DATASIZE) == 0);
+    }
+    SECTION("Waiting for the host") {
+        std::vector<VMTask *> woken;
+        uint8_t value;
+        TaskScheduler *scheduler;
+        TaskScheduler now([&scheduler, &value](VMTask *task) {
+            task->getVM().addressSpace()->insData(&value, sizeof(value));
+            scheduler->wake(task);
+        });
+        TaskScheduler later([&woken](VMTask *task) {
+            woken.push_back(task);
+        });
+
+        for (n = 0; n < 2000; n++) {
+            vms.emplace_back(new VM(PROGRAMS_KEY, WAITING_PSTC, sizeof(WAITING_PSTC),
+                                    n % 2 ? ENGINE_HANDLERS : ENGINE_THREADED));
+            tasks.emplace_back(new VMTask(*vms.back(), 1 + n % 4));
+            tasks.back()->waitAt(0x04);
+        }
+        // woken up right away
+        value = 7;
+        scheduler = &now;
+        for (n = 0; n < 1000; n++) {
+            now.spawn(tasks[n].get());
+        }
+        REQUIRE(now.run() == 0);
+        // woken up once all of them wait
+        for (n = 1000; n < 2000; n++) {
+            later.spawn(tasks[n].get());
+        }
+        for (value = 1; value <= 3; value++) {
+            REQUIRE(later.run() == 1000);
+            REQUIRE(woken.size() == 1000);
+            for (VMTask *task : woken) {
+                REQUIRE(task->getState() == TASK_WAITING);
+                task->getVM().addressSpace()->insData(&value, sizeof(value));
+                later.wake(task);
+            }
+            woken.clear();
+        }
+        REQUIRE(later.run() == 0);
+        REQUIRE_THROWS(later.wake(tasks[1000].get()));
+        for (n = 0; n < 2000; n++) {
+            REQUIRE(tasks[n]->getState() == TASK_HALTED);
+            REQUIRE(vms[n]->reg(R1) == (n < 1000 ? 21 : 1 + 2 + 3));
+            REQUIRE(vms[n]->reg(IP) == sizeof(WAITING_PSTC) - 1);
+        }
+    }
+    SECTION("SHIT elsewhere ends the task") {
+        VM vm(PROGRAMS_KEY, WAITING_PSTC, sizeof(WAITING_PSTC));
+        VMTask task(vm);
+
+        REQUIRE(task.resume() == TASK_HALTED);
+        REQUIRE(vm.reg(IP) == 0x04);
+    }
+}
+
+#ifdef __cpp_impl_coroutine
+// built by the coroutine-tests target, with -std=c++20
+TEST_CASE("VM coroutines", "[VM][task]") {
+    SECTION("A coroutine ends as run() does") {
+        VM ref(PROGRAMS_KEY, DECRYPT_PSTC, DECRYPT_PSTC_LEN);
+        VM vm(PROGRAMS_KEY, DECRYPT_PSTC, DECRYPT_PSTC_LEN, ENGINE_PREDECODED);
+        VMTask task(vm, 1000);
+        VMCoroutine coroutine = VMCoroutine::of(task);
+        uint32_t i, yields = 0;
+
+        ref.addressSpace()->insData(EN_DATASECTION, EN_DATASECTION_LEN);
+        vm.addressSpace()->insData(EN_DATASECTION, EN_DATASECTION_LEN);
+        REQUIRE(ref.run() == VM_HALTED);
+        while (coroutine.resume() == TASK_YIELDED) {
+            yields++;
+        }
+        REQUIRE(yields == 71);
+        REQUIRE_FALSE(coroutine.done());
+        REQUIRE(coroutine.resume() == TASK_HALTED);
+        REQUIRE(coroutine.done());
+        REQUIRE(coroutine.resume() == TASK_HALTED);
+        for (i = 0; i < NUM_REGS; i++) {
+            REQUIRE(vm.reg(i) == ref.reg(i));
+        }
+    }
+    SECTION("Many coroutines on one thread") {
+        std::vector<std::unique_ptr<VM>> vms;
+        std::vector<std::unique_ptr<VMTask>> tasks;
+        std::deque<std::pair<uint32_t, VMCoroutine>> ready;
+        uint32_t n, waits = 0;
+        uint8_t value = 7;
+
+        for (n = 0; n < 2000; n++) {
+            vms.emplace_back(new VM(PROGRAMS_KEY, WAITING_PSTC, sizeof(WAITING_PSTC),
+                                    n % 2 ? ENGINE_HANDLERS : ENGINE_THREADED));
+            tasks.emplace_back(new VMTask(*vms.back(), 1 + n % 4));
+            tasks.back()->waitAt(0x04);
+            ready.emplace_back(n, VMCoroutine::of(*tasks.back()));
+        }
+        // the host gives a waiting coroutine its input, then resumes it
+        while (!ready.empty()) {
+            std::pair<uint32_t, VMCoroutine> next = std::move(ready.front());
+
+            ready.pop_front();
+            switch (next.second.resume()) {
+            case TASK_WAITING:
+                waits++;
+                vms[next.first]->addressSpace()->insData(&value, sizeof(value));
+                ready.push_back(std::move(next));
+                break;
+            case TASK_YIELDED:
+                ready.push_back(std::move(next));
+                break;
+            default:
+                REQUIRE(next.second.resume() == TASK_HALTED);
+                REQUIRE(next.second.done());
+                break;
+            }
+        }
+        REQUIRE(waits == 2000 * 3);
+        for (n = 0; n < 2000; n++) {
+            REQUIRE(tasks[n]->getState() == TASK_HALTED);
+            REQUIRE(vms[n]->reg(R1) == 21);
+        }
+    }
+}
+#endif
@@ -0,0 +1,124 @@
+#ifndef TEST_PROGRAMS_H
+#define TEST_PROGRAMS_H
+
+#include <stdint.h>
+
+/*
+ * polictf/asms/{encrypt,decrypt}.pstc assembled with
+ * `python3 assembler/assembler.py 'HaveFun!PoliCTF2017!' <asm> <out>`
+ */
+static uint8_t PROGRAMS_KEY[] = "HaveFun!PoliCTF2017!";
+
+/*
+ * Opcode values for PROGRAMS_KEY, handy for hand-written snippets.
+ * 0x00 does not map to any instruction.
+ */
+#define K_MOVI 0x48
+#define K_MOVR 0xcb
+#define K_LODI 0x22
+#define K_LODR 0x12
+#define K_STRI 0xd4
+#define K_STRR 0x4e
+#define K_ADDI 0x05
+#define K_ADDR 0x39
+#define K_SUBI 0x42
+#define K_SUBR 0x57
+#define K_ANDB 0x53
+#define K_ANDW 0x01
+#define K_ANDR 0xf3
+#define K_YORB 0x54
+#define K_YORW 0x98
+#define K_YORR 0xe9
+#define K_XORB 0xe5
+#define K_XORW 0x6b
+#define K_XORR 0xb1
+#define K_NOTR 0x55
+#define K_MULI 0x07
+#define K_MULR 0x09
+#define K_DIVI 0xc6
+#define K_DIVR 0x06
+#define K_SHLI 0x20
+#define K_SHLR 0xce
+#define K_SHRI 0x36
+#define K_SHRR 0x25
+#define K_PUSH 0xde
+#define K_POOP 0x5c
+#define K_CMPB 0xf4
+#define K_CMPW 0x3a
+#define K_CMPR 0xd7
+#define K_JMPI 0x4c
+#define K_JMPR 0xc0
+#define K_JPAI 0xff
+#define K_JPAR 0x3d
+#define K_JPBI 0x93
+#define K_JPBR 0x9a
+#define K_JPEI 0x38
+#define K_JPER 0x0e
+#define K_JPNI 0xae
+#define K_JPNR 0xb9
+#define K_CALL 0xd8
+#define K_RETN 0xbb
+#define K_SHIT 0x5d
+#define K_NOPE 0xf9
+#define K_GRMN 0xc3
+#define K_WAT 0x00
+
+// the benchmarks include this file too, and run only some of these programs
+[[maybe_unused]] static uint8_t ENCRYPT_PSTC[] = {
+        0xc3, 0x48, 0x00, 0xde, 0xad, 0x48, 0x01, 0xb0, 0x0b, 0xd4, 0x00, 0x00,
+        0x00, 0xd4, 0x02, 0x00, 0x01, 0x48, 0x00, 0xb0, 0x0b, 0x48, 0x01, 0xfa,
+        0xce, 0xd4, 0x04, 0x00, 0x00, 0xd4, 0x06, 0x00, 0x01, 0x48, 0x00, 0x00,
+        0x00, 0xd8, 0xd6, 0x00, 0xcb, 0x20, 0x48, 0x04, 0x00, 0x00, 0xde, 0x04,
+        0x48, 0x00, 0x00, 0x00, 0x48, 0x01, 0x02, 0x00, 0x39, 0x04, 0x39, 0x14,
+        0xd8, 0x5b, 0x00, 0x5c, 0x04, 0x05, 0x04, 0x04, 0x00, 0xd7, 0x42, 0x93,
+        0x2e, 0x00, 0x22, 0x00, 0x00, 0x00, 0x22, 0x01, 0x02, 0x00, 0x22, 0x02,
+        0x04, 0x00, 0x22, 0x03, 0x06, 0x00, 0x5d, 0xde, 0x01, 0xde, 0x02, 0xde,
+        0x03, 0x12, 0x20, 0x12, 0x31, 0x48, 0x04, 0x00, 0x00, 0x48, 0x05, 0x00,
+        0x00, 0xde, 0x04, 0x05, 0x05, 0x6f, 0x62, 0xde, 0x05, 0xcb, 0x43, 0x20,
+        0x04, 0x04, 0x00, 0x05, 0x04, 0x65, 0x70, 0xcb, 0x53, 0x5c, 0x07, 0xde,
+        0x07, 0xb1, 0x45, 0xde, 0x04, 0xcb, 0x43, 0x36, 0x04, 0x05, 0x00, 0x05,
+        0x04, 0x65, 0x70, 0x5c, 0x05, 0xb1, 0x45, 0x39, 0x24, 0xcb, 0x42, 0x20,
+        0x04, 0x04, 0x00, 0x05, 0x04, 0x75, 0x72, 0xcb, 0x52, 0x5c, 0x07, 0xde,
+        0x07, 0xb1, 0x45, 0xde, 0x04, 0xcb, 0x42, 0x36, 0x04, 0x05, 0x00, 0x05,
+        0x04, 0x73, 0x6e, 0x5c, 0x05, 0xb1, 0x45, 0x39, 0x34, 0x5c, 0x05, 0x5c,
+        0x04, 0x05, 0x04, 0x01, 0x00, 0xf4, 0x04, 0x7f, 0x93, 0x6d, 0x00, 0x4e,
+        0x02, 0x4e, 0x13, 0x5c, 0x03, 0x5c, 0x02, 0x5c, 0x01, 0xbb, 0xde, 0x01,
+        0xde, 0x02, 0xde, 0x03, 0xcb, 0x60, 0x48, 0x05, 0x00, 0x00, 0x12, 0x46,
+        0xf4, 0x04, 0x00, 0x38, 0xfc, 0x00, 0x48, 0x06, 0x00, 0x00, 0x05, 0x05,
+        0x01, 0x00, 0x39, 0x65, 0x12, 0x46, 0xf4, 0x04, 0x00, 0xae, 0xea, 0x00,
+        0xcb, 0x05, 0x5c, 0x03, 0x5c, 0x02, 0x5c, 0x01, 0xbb};
+[[maybe_unused]] static uint32_t ENCRYPT_PSTC_LEN = 261;
+
+[[maybe_unused]] static uint8_t DECRYPT_PSTC[] = {
+        0x48, 0x00, 0x00, 0x00, 0xd8, 0x95, 0x00, 0xcb, 0x20, 0x48, 0x04, 0x00,
+        0x00, 0xde, 0x04, 0x48, 0x00, 0x00, 0x00, 0x48, 0x01, 0x02, 0x00, 0x39,
+        0x04, 0x39, 0x14, 0xd8, 0x2a, 0x00, 0x5c, 0x04, 0x05, 0x04, 0x04, 0x00,
+        0xd7, 0x42, 0x93, 0x0d, 0x00, 0x5d, 0xde, 0x01, 0xde, 0x02, 0xde, 0x03,
+        0x12, 0x20, 0x12, 0x31, 0x48, 0x04, 0x00, 0x00, 0x48, 0x05, 0x00, 0x00,
+        0xde, 0x04, 0xcb, 0x42, 0x20, 0x04, 0x04, 0x00, 0x05, 0x04, 0x75, 0x72,
+        0xcb, 0x52, 0xb1, 0x45, 0xde, 0x04, 0xcb, 0x42, 0x36, 0x04, 0x05, 0x00,
+        0x05, 0x04, 0x73, 0x6e, 0x5c, 0x05, 0xb1, 0x45, 0x57, 0x34, 0xcb, 0x43,
+        0x20, 0x04, 0x04, 0x00, 0x05, 0x04, 0x65, 0x70, 0xcb, 0x53, 0xb1, 0x45,
+        0xde, 0x04, 0xcb, 0x43, 0x36, 0x04, 0x05, 0x00, 0x05, 0x04, 0x65, 0x70,
+        0x5c, 0x05, 0xb1, 0x45, 0x57, 0x24, 0x5c, 0x04, 0x05, 0x04, 0x01, 0x00,
+        0xf4, 0x04, 0x7f, 0x93, 0x3c, 0x00, 0x4e, 0x02, 0x4e, 0x13, 0x5c, 0x03,
+        0x5c, 0x02, 0x5c, 0x01, 0xbb, 0xde, 0x01, 0xde, 0x02, 0xde, 0x03, 0xcb,
+        0x60, 0x48, 0x05, 0x00, 0x00, 0x12, 0x46, 0xf4, 0x04, 0x00, 0x38, 0xbb,
+        0x00, 0x48, 0x06, 0x00, 0x00, 0x05, 0x05, 0x01, 0x00, 0x39, 0x65, 0x12,
+        0x46, 0xf4, 0x04, 0x00, 0xae, 0xa9, 0x00, 0xcb, 0x05, 0x5c, 0x03, 0x5c,
+        0x02, 0x5c, 0x01, 0xbb};
+[[maybe_unused]] static uint32_t DECRYPT_PSTC_LEN = 196;
+
+// polictf/server/pasticciotto_server.cpp
+[[maybe_unused]] static uint8_t EN_DATASECTION[] = {
+        0x8c, 0xea, 0xbe, 0xaa, 0xed, 0xa0, 0xd0, 0x6b, 0x99, 0x1c, 0x52, 0x25,
+        0xb9, 0xe6, 0xd8, 0xff, 0xf9, 0xe9, 0x92, 0x7a, 0x1c, 0xc5, 0xc4, 0x7e,
+        0x2a, 0xec, 0x67, 0x32, 0x86, 0xca, 0xff, 0xf8, 0x3c, 0x1c, 0x77, 0x42,
+        0xe3, 0x20, 0x29, 0x4b, 0x34, 0x67, 0x4b, 0xc9, 0x9f, 0xa9, 0xf9, 0x0c,
+        0x0f, 0x9b, 0x8a, 0x5b, 0x72, 0x64, 0xe5, 0xd8, 0x5c, 0x52, 0x58, 0x46,
+        0xef, 0x36, 0x76, 0x87, 0xec, 0x1e, 0xfb, 0x5d, 0x42, 0x8e, 0xb7, 0x47};
+[[maybe_unused]] static uint32_t EN_DATASECTION_LEN = 72;
+
+static const char DE_DATASECTION[] = "TheDataSectionHasBeenEncrypted...WhoAreYouGonnaCall...TheRuNasOfCourse..";
+
+#endif
@@ -0,0 +1,156 @@
+#ifndef TEST_RANDOM_PROGRAMS_H
+#define TEST_RANDOM_PROGRAMS_H
+
+#include "../../vm/vm.h"
+#include "programs.h"
+#include <vector>
+
+static uint32_t rnd_state = 0x47474747;
+
+static uint32_t rnd(uint32_t max) {
+    rnd_state ^= rnd_state << 13;
+    rnd_state ^= rnd_state >> 17;
+    rnd_state ^= rnd_state << 5;
+    return rnd_state % max;
+}
+
+static uint8_t rnd_reg(void) {
+    // mostly R0 -> S3, sometimes IP, RP, SP or an invalid one
+    static const uint8_t odd[] = {IP, RP, SP, 12, 15};
+    if (rnd(64) == 0) {
+        return odd[rnd(sizeof(odd))];
+    }
+    return rnd(S3 + 1);
+}
+
+static uint16_t rnd_imm(void) {
+    switch (rnd(4)) {
+    case 0:
+        return rnd(0x10000);
+    case 1:
+        return rnd(20);
+    default:
+        return rnd(DEFAULT_DATASIZE + 0x10);
+    }
+}
+
+typedef struct gen_instr {
+    uint8_t bytes[4];
+    uint8_t length;
+    int32_t target; // index of the jump target, -1 if none
+} gen_instr_t;
+
+/*
+ * Random, well-formed program whose control flow only goes forward, apart
+ * from the register-based conditional jumps which land on 0 -> 7.
+ * It starts with 8 pushes so POOP never underflows the stack.
+ */
+static std::vector<uint8_t> genProgram(uint32_t count) {
+    static const uint8_t rr[] = {K_MOVR, K_LODR, K_STRR, K_ADDR, K_SUBR, K_ANDR, K_YORR, K_XORR,
+                                 K_NOTR, K_MULR, K_DIVR, K_SHLR, K_SHRR, K_CMPR};
+    static const uint8_t ri[] = {K_MOVI, K_LODI, K_ADDI, K_SUBI, K_ANDW, K_YORW, K_XORW,
+                                 K_MULI, K_DIVI, K_SHLI, K_SHRI, K_CMPW};
+    static const uint8_t rb[] = {K_ANDB, K_YORB, K_XORB, K_CMPB};
+    static const uint8_t ji[] = {K_JMPI, K_JPAI, K_JPBI, K_JPEI, K_JPNI, K_CALL};
+    static const uint8_t jr[] = {K_JPAR, K_JPBR, K_JPER, K_JPNR};
+    std::vector<gen_instr_t> instrs;
+    std::vector<uint8_t> code;
+    std::vector<uint32_t> offsets;
+    uint32_t i, pops = 0, offset = 0;
+    gen_instr_t in;
+    uint16_t imm;
+
+    for (i = 0; i < 8; i++) {
+        instrs.push_back({{K_PUSH, R0}, PUSH_SIZE, -1});
+    }
+    instrs.push_back({{K_CMPR, 0x00}, CMPR_SIZE, -1});
+    for (i = 0; i < count; i++) {
+        in.target = -1;
+        switch (rnd(10)) {
+        case 0:
+        case 1:
+        case 2:
+            in.bytes[0] = rr[rnd(sizeof(rr))];
+            in.bytes[1] = rnd_reg() << 4 | rnd_reg();
+            in.length = REG2REG;
+            // keeps addresses in range and divisors non-zero most of the time
+            if (in.bytes[0] == K_LODR || in.bytes[0] == K_STRR || in.bytes[0] == K_DIVR) {
+                if (rnd(8)) {
+                    uint8_t reg = in.bytes[0] == K_STRR ? in.bytes[1] >> 4 : in.bytes[1] & 0x0f;
+                    if (in.bytes[0] == K_DIVR) {
+                        instrs.push_back({{K_YORB, reg, 0x01}, YORB_SIZE, -1});
+                    } else {
+                        instrs.push_back({{K_ANDW, reg, 0xfe, 0x00}, ANDW_SIZE, -1});
+                    }
+                }
+            }
+            break;
+        case 3:
+        case 4:
+            imm = rnd_imm();
+            in.bytes[0] = ri[rnd(sizeof(ri))];
+            in.bytes[1] = rnd_reg();
+            in.bytes[2] = imm & 0xff;
+            in.bytes[3] = imm >> 8;
+            in.length = IMM2REG;
+            break;
+        case 5:
+            in.bytes[0] = rb[rnd(sizeof(rb))];
+            in.bytes[1] = rnd_reg();
+            in.bytes[2] = rnd(0x100);
+            in.length = BYT2REG;
+            break;
+        case 6:
+            // execSTRI validates the lower byte of the address as a register
+            imm = rnd(16) ? rnd(S3 + 1) : rnd_imm();
+            in.bytes[0] = K_STRI;
+            in.bytes[1] = imm & 0xff;
+            in.bytes[2] = imm >> 8;
+            in.bytes[3] = rnd(SP + 1);
+            in.length = STRI_SIZE;
+            break;
+        case 7:
+            if (rnd(4) == 0) {
+                in.bytes[0] = jr[rnd(sizeof(jr))];
+                in.bytes[1] = rnd_reg();
+                in.length = REGONLY;
+            } else {
+                in.bytes[0] = ji[rnd(sizeof(ji))];
+                in.target = instrs.size() + 1 + rnd(8);
+                in.length = IMMONLY;
+            }
+            break;
+        case 8:
+            in.bytes[0] = (pops < 7 && rnd(2)) ? K_POOP : K_PUSH;
+            in.bytes[1] = rnd_reg();
+            if (in.bytes[0] == K_POOP) {
+                pops++;
+            }
+            in.length = REGONLY;
+            break;
+        default:
+            in.bytes[0] = rnd(2) ? K_GRMN : K_NOPE;
+            in.length = SINGLE;
+            break;
+        }
+        instrs.push_back(in);
+    }
+    instrs.push_back({{K_SHIT}, SHIT_SIZE, -1});
+
+    for (i = 0; i < instrs.size(); i++) {
+        offsets.push_back(offset);
+        offset += instrs[i].length;
+    }
+    for (i = 0; i < instrs.size(); i++) {
+        in = instrs[i];
+        if (in.target >= 0) {
+            imm = offsets[in.target < (int32_t) instrs.size() ? in.target : instrs.size() - 1];
+            in.bytes[1] = imm & 0xff;
+            in.bytes[2] = imm >> 8;
+        }
+        code.insert(code.end(), in.bytes, in.bytes + in.length);
+    }
+    return code;
+}
+
+#endif
@@ -0,0 +1,493 @@
+#include "../include/catch.hpp"
+#include "../../vm/vm.h"
+#include "programs.h"
+#include "random_programs.h"
+#include <cstring>
+#include <memory>
+#include <vector>
+
+/*
+ * Every engine has to leave the VM exactly as ENGINE_HANDLERS does.
+ */
+static const engines ENGINES[] = {ENGINE_THREADED, ENGINE_PREDECODED, ENGINE_BLOCKS, ENGINE_JIT, ENGINE_TRACE,
+                                   ENGINE_VERIFIED};
+
+static void requireSameState(VM &expected, VM &actual) {
+    uint32_t i;
+    VMAddrSpace *eas = expected.addressSpace(), *aas = actual.addressSpace();
+
+    for (i = 0; i < NUM_REGS; i++) {
+        REQUIRE(expected.reg(i) == actual.reg(i));
+    }
+    REQUIRE(expected.flagsWord() == actual.flagsWord());
+    REQUIRE(memcmp(eas->getData(), aas->getData(), eas->getDatasize()) == 0);
+    REQUIRE(memcmp(eas->getStack(), aas->getStack(), eas->getStacksize()) == 0);
+}
+
+TEST_CASE("Engines run the polictf programs", "[VM][engines]") {
+    uint32_t i;
+
+    VM ref_enc(PROGRAMS_KEY, ENCRYPT_PSTC, ENCRYPT_PSTC_LEN);
+    statuses enc = ref_enc.run();
+    VM ref_dec(PROGRAMS_KEY, DECRYPT_PSTC, DECRYPT_PSTC_LEN);
+    ref_dec.addressSpace()->insData(EN_DATASECTION, EN_DATASECTION_LEN);
+    statuses dec = ref_dec.run();
+
+    for (engines engine : ENGINES) {
+        VM vm_enc(PROGRAMS_KEY, ENCRYPT_PSTC, ENCRYPT_PSTC_LEN, engine);
+        REQUIRE(vm_enc.run() == enc);
+        requireSameState(ref_enc, vm_enc);
+
+        VM vm_dec(PROGRAMS_KEY, DECRYPT_PSTC, DECRYPT_PSTC_LEN, engine);
+        vm_dec.addressSpace()->insData(EN_DATASECTION, EN_DATASECTION_LEN);
+        REQUIRE(vm_dec.run() == dec);
+        requireSameState(ref_dec, vm_dec);
+        for (i = 0; i < EN_DATASECTION_LEN; i++) {
+            REQUIRE(vm_dec.addressSpace()->getData()[i] == (uint8_t) DE_DATASECTION[i]);
+        }
+    }
+}
+
+TEST_CASE("Engines match the handlers on random programs", "[VM][engines]") {
+    uint32_t n;
+    std::vector<uint8_t> code;
+
+    for (n = 0; n < 500; n++) {
+        code = genProgram(20 + rnd(60));
+        VM ref(PROGRAMS_KEY, code.data(), code.size());
+        statuses status = ref.run();
+        for (engines engine : ENGINES) {
+            VM vm(PROGRAMS_KEY, code.data(), code.size(), engine);
+            REQUIRE(vm.run() == status);
+            requireSameState(ref, vm);
+        }
+    }
+}
+
+TEST_CASE("Engines on a shared code image", "[VM][engines]") {
+    uint8_t other[] = "SomeOtherKey";
+    std::vector<uint8_t> code;
+    uint32_t n, i;
+
+    SECTION("Many VMs, two keys, one image") {
+        auto image = std::make_shared<const CodeImage>(DECRYPT_PSTC, DECRYPT_PSTC_LEN);
+
+        for (i = 0; i < 4; i++) {
+            VM vm(i % 2 ? other : PROGRAMS_KEY, image, ENGINE_PREDECODED);
+
+            REQUIRE(vm.addressSpace()->getCode() == image->getCode());
+            REQUIRE(vm.addressSpace()->getCodeOwner() == OWNER_IMAGE);
+            vm.addressSpace()->insData(EN_DATASECTION, EN_DATASECTION_LEN);
+            vm.run();
+            REQUIRE((memcmp(vm.addressSpace()->getData(), DE_DATASECTION, EN_DATASECTION_LEN) == 0) == (i % 2 == 0));
+        }
+    }
+    SECTION("Writing the code leaves the image alone") {
+        auto image = std::make_shared<const CodeImage>(DECRYPT_PSTC, DECRYPT_PSTC_LEN);
+        VM vm(PROGRAMS_KEY, image, ENGINE_PREDECODED);
+        uint8_t shit[] = {K_SHIT};
+
+        vm.run();
+        REQUIRE(vm.addressSpace()->insCode(shit, sizeof(shit)));
+        REQUIRE(vm.addressSpace()->getCodeImage() == NULL);
+        REQUIRE(image->getCode()[0] == DECRYPT_PSTC[0]);
+        vm.reset();
+        REQUIRE(vm.run() == VM_HALTED);
+        REQUIRE(vm.reg(IP) == 0);
+    }
+    SECTION("Random programs") {
+        for (n = 0; n < 100; n++) {
+            code = genProgram(20 + rnd(60));
+            auto image = std::make_shared<const CodeImage>(code.data(), code.size());
+            VM ref(PROGRAMS_KEY, image);
+            statuses status = ref.run();
+            for (engines engine : ENGINES) {
+                // the second one finds what the first one left in the image
+                for (i = 0; i < 2; i++) {
+                    VM vm(PROGRAMS_KEY, image, engine);
+                    REQUIRE(vm.run() == status);
+                    requireSameState(ref, vm);
+                }
+            }
+        }
+    }
+}
+
+TEST_CASE("Engines on wide segments", "[VM][engines]") {
+    // writes and reads the last data word, then pushes until SP wraps around
+    uint8_t wrap[] = {K_MOVI, R0, 0xff, 0xff,
+                      K_MOVI, R1, 0x47, 0x47,
+                      K_STRR, R0 << 4 | R1,
+                      K_LODR, R2 << 4 | R0,
+                      K_MOVI, R3, 0x00, 0x80,
+                      K_PUSH, R2,
+                      K_SUBI, R3, 0x01, 0x00,
+                      K_CMPW, R3, 0x00, 0x00,
+                      K_JPNI, 0x10, 0x00,
+                      K_SHIT};
+    std::vector<uint8_t> code;
+    uint32_t n;
+
+    SECTION("No access is out of bounds") {
+        VM ref(PROGRAMS_KEY, wrap, sizeof(wrap), ENGINE_HANDLERS, AS_WIDE);
+
+        REQUIRE(ref.run() == VM_HALTED);
+        REQUIRE(ref.reg(R2) == 0x4747);
+        REQUIRE(ref.reg(SP) == 0);
+        REQUIRE(ref.addressSpace()->getData()[0x10000] == 0x47);
+        REQUIRE(ref.addressSpace()->getStack()[0xffff] == 0x47);
+        for (engines engine : ENGINES) {
+            VM vm(PROGRAMS_KEY, wrap, sizeof(wrap), engine, AS_WIDE);
+
+            REQUIRE(vm.run() == VM_HALTED);
+            requireSameState(ref, vm);
+        }
+    }
+    SECTION("Random programs") {
+        // with nothing to fault on, a stray jump may keep a program going forever
+        for (n = 0; n < 100; n++) {
+            code = genProgram(20 + rnd(60));
+            VM ref(PROGRAMS_KEY, code.data(), code.size(), ENGINE_HANDLERS, AS_WIDE);
+            statuses status = ref.run(100000);
+            for (engines engine : ENGINES) {
+                VM vm(PROGRAMS_KEY, code.data(), code.size(), engine, AS_WIDE);
+                REQUIRE(vm.run(100000) == status);
+                requireSameState(ref, vm);
+            }
+        }
+    }
+}
+
+TEST_CASE("Predecoded instructions follow code rewrites", "[VM][engines]") {
+    uint8_t first[] = {K_MOVI, R0, 0x01, 0x00, K_SHIT};
+    uint8_t second[] = {K_MOVI, R0, 0x01, 0x00, K_MOVI, R1, 0x02, 0x00, K_SHIT};
+
+    for (engines engine : {ENGINE_PREDECODED, ENGINE_BLOCKS, ENGINE_JIT}) {
+        VM vm(PROGRAMS_KEY, first, sizeof(first), engine);
+
+        vm.run();
+        REQUIRE(vm.reg(IP) == 4);
+        vm.addressSpace()->insCode(second, sizeof(second));
+        vm.run();
+        REQUIRE(vm.reg(R1) == 2);
+        REQUIRE(vm.reg(IP) == 8);
+    }
+}
+
+TEST_CASE("Superinstructions", "[VM][engines]") {
+    uint8_t code[] = {
+            K_MOVI, R1, 0x05, 0x00, // 0x00
+            K_MOVI, R0, 0x07, 0x00, // 0x04 fused with the next one
+            K_ADDR, R0 << 4 | R1,   // 0x08
+            K_ADDI, R2, 0x01, 0x00, // 0x0a
+            K_CMPB, R2, 0x02,       // 0x0e fused with the next one
+            K_JPEI, 0x17, 0x00,     // 0x11
+            K_JMPI, 0x08, 0x00,     // 0x14 lands in the middle of MOVI+ADDR
+            K_SHIT                  // 0x17
+    };
+
+    for (engines engine : {ENGINE_PREDECODED, ENGINE_BLOCKS, ENGINE_JIT}) {
+        VM vm(PROGRAMS_KEY, code, sizeof(code), engine);
+
+        vm.run();
+        REQUIRE(vm.reg(R0) == 0x11);
+        REQUIRE(vm.reg(R2) == 2);
+        REQUIRE(vm.reg(IP) == 0x17);
+        // MOVI+ADDR once, CMPB+JPEI twice
+        REQUIRE(vm.fusions() == 3);
+
+        VM vm_dec(PROGRAMS_KEY, DECRYPT_PSTC, DECRYPT_PSTC_LEN, engine);
+        vm_dec.addressSpace()->insData(EN_DATASECTION, EN_DATASECTION_LEN);
+        vm_dec.run();
+        REQUIRE(vm_dec.fusions() > 0);
+    }
+}
+
+TEST_CASE("Blocks run past the end of the code section", "[VM][engines]") {
+    uint8_t code[] = {
+            K_MOVI, R0, 0x03, 0x00, // 0x00
+            K_SUBI, R0, 0x01, 0x00, // 0x04
+            K_CMPB, R0, 0x00,       // 0x08
+            K_JPNI, 0x04, 0x00,     // 0x0b
+            K_ADDI, R1, 0x02, 0x00  // 0x0e falls off the code section
+    };
+    VM ref(PROGRAMS_KEY, code, sizeof(code));
+    VM vm(PROGRAMS_KEY, code, sizeof(code), ENGINE_BLOCKS);
+
+    REQUIRE(vm.run() == ref.run());
+    requireSameState(ref, vm);
+    REQUIRE(vm.reg(R1) == 2);
+    REQUIRE(vm.reg(IP) == sizeof(code));
+}
+
+/*
+ * Runs both VMs slices instructions at a time, they have to stop at the
+ * very same place after every slice.
+ */
+static void requireSameSlices(VM &expected, VM &actual, uint64_t slice) {
+    statuses status;
+
+    do {
+        status = expected.run(slice);
+        REQUIRE(actual.run(slice) == status);
+        requireSameState(expected, actual);
+    } while (status == VM_EXHAUSTED);
+}
+
+TEST_CASE("Engines on forked VMs", "[VM][engines]") {
+    std::vector<uint8_t> code;
+    statuses status;
+    uint64_t cut;
+    uint32_t n;
+
+    SECTION("polictf programs") {
+        for (engines engine : ENGINES) {
+            VM ref(PROGRAMS_KEY, DECRYPT_PSTC, DECRYPT_PSTC_LEN, engine);
+            VM vm(PROGRAMS_KEY, DECRYPT_PSTC, DECRYPT_PSTC_LEN, engine);
+
+            ref.addressSpace()->insData(EN_DATASECTION, EN_DATASECTION_LEN);
+            vm.addressSpace()->insData(EN_DATASECTION, EN_DATASECTION_LEN);
+            REQUIRE(ref.run() == VM_HALTED);
+            REQUIRE(vm.run(997) == VM_EXHAUSTED);
+            std::shared_ptr<const VMSnapshot> snapshot = vm.snapshot();
+            REQUIRE(snapshot);
+            VM a(snapshot), b(snapshot);
+
+            // what a fork writes is its own
+            a.addressSpace()->getData()[DEFAULT_DATASIZE - 1] = 0x47;
+            REQUIRE(b.addressSpace()->getData()[DEFAULT_DATASIZE - 1] == 0);
+            REQUIRE(vm.addressSpace()->getData()[DEFAULT_DATASIZE - 1] == 0);
+            a.addressSpace()->getData()[DEFAULT_DATASIZE - 1] = 0;
+            for (VM *goesOn : {&vm, &a, &b}) {
+                REQUIRE(goesOn->run() == VM_HALTED);
+                requireSameState(ref, *goesOn);
+            }
+        }
+    }
+    SECTION("Random programs") {
+        for (n = 0; n < 100; n++) {
+            code = genProgram(20 + rnd(60));
+            for (engines engine : ENGINES) {
+                VM ref(PROGRAMS_KEY, code.data(), code.size());
+                VM vm(PROGRAMS_KEY, code.data(), code.size(), engine);
+
+                cut = 1 + rnd(30);
+                status = ref.run(100000);
+                if (vm.run(cut) != VM_EXHAUSTED) {
+                    continue;
+                }
+                std::unique_ptr<VM> child = vm.fork();
+                REQUIRE(child);
+                REQUIRE(child->run(100000 - cut) == status);
+                requireSameState(ref, *child);
+            }
+        }
+    }
+}
+
+TEST_CASE("Instruction budget", "[VM][engines]") {
+    uint32_t n;
+    std::vector<uint8_t> code;
+
+    SECTION("Statuses") {
+        uint8_t halts[] = {K_NOPE, K_SHIT};
+        uint8_t faults[] = {K_NOPE, K_DIVI, R0, 0x00, 0x00};
+        uint8_t loops[] = {K_ADDI, R0, 0x01, 0x00, K_JMPI, 0x00, 0x00};
+
+        for (engines engine : ENGINES) {
+            VM vm_halts(PROGRAMS_KEY, halts, sizeof(halts), engine);
+            VM vm_faults(PROGRAMS_KEY, faults, sizeof(faults), engine);
+            VM vm_loops(PROGRAMS_KEY, loops, sizeof(loops), engine);
+
+            REQUIRE(vm_halts.run(0) == VM_EXHAUSTED);
+            REQUIRE(vm_halts.run(1) == VM_EXHAUSTED);
+            REQUIRE(vm_halts.reg(IP) == 1);
+            REQUIRE(vm_halts.run() == VM_HALTED);
+            REQUIRE(vm_halts.reg(IP) == 1);
+            REQUIRE(vm_faults.run() == VM_FAULTED);
+            REQUIRE(vm_faults.reg(IP) == 1);
+            REQUIRE(vm_loops.run(100000) == VM_EXHAUSTED);
+            REQUIRE(vm_loops.reg(R0) == 50000);
+            REQUIRE(vm_loops.step() == VM_EXHAUSTED);
+            REQUIRE(vm_loops.reg(R0) == 50001);
+            REQUIRE(vm_loops.run(3) == VM_EXHAUSTED);
+            REQUIRE(vm_loops.reg(R0) == 50002);
+            REQUIRE(vm_loops.reg(IP) == 0);
+        }
+    }
+    SECTION("Leaving a trace early") {
+        uint8_t code[] = {
+                K_MOVI, R0, 0x28, 0x00, // 0x00
+                K_SUBI, R0, 0x01, 0x00, // 0x04
+                K_CMPB, R0, 0x00,       // 0x08
+                K_JPEI, 0x19, 0x00,     // 0x0b leaves the trace halfway
+                K_ADDI, R1, 0x01, 0x00, // 0x0e
+                K_ADDI, R1, 0x01, 0x00, // 0x12
+                K_JMPI, 0x04, 0x00,     // 0x16
+                K_ADDI, R2, 0x01, 0x00, // 0x19
+                K_CMPW, R2, 0x00, 0x02, // 0x1d
+                K_JPNI, 0x19, 0x00,     // 0x21
+                K_SHIT                  // 0x24
+        };
+        VM ref(PROGRAMS_KEY, code, sizeof(code));
+        VM vm(PROGRAMS_KEY, code, sizeof(code), ENGINE_TRACE);
+
+        requireSameSlices(ref, vm, 1000);
+        REQUIRE(vm.reg(R2) == 0x200);
+        REQUIRE(vm.traces() == 2);
+    }
+    SECTION("polictf programs") {
+        for (engines engine : ENGINES) {
+            for (uint64_t slice : {997, 10000}) {
+                VM ref(PROGRAMS_KEY, DECRYPT_PSTC, DECRYPT_PSTC_LEN);
+                VM vm(PROGRAMS_KEY, DECRYPT_PSTC, DECRYPT_PSTC_LEN, engine);
+
+                ref.addressSpace()->insData(EN_DATASECTION, EN_DATASECTION_LEN);
+                vm.addressSpace()->insData(EN_DATASECTION, EN_DATASECTION_LEN);
+                requireSameSlices(ref, vm, slice);
+            }
+        }
+    }
+    SECTION("Random programs") {
+        for (n = 0; n < 100; n++) {
+            code = genProgram(20 + rnd(60));
+            for (engines engine : ENGINES) {
+                VM ref(PROGRAMS_KEY, code.data(), code.size());
+                VM vm(PROGRAMS_KEY, code.data(), code.size(), engine);
+
+                requireSameSlices(ref, vm, 1 + rnd(8));
+            }
+        }
+    }
+}
+
+static bool verifies(uint8_t *code, uint32_t codesize) {
+    VM vm(PROGRAMS_KEY, code, codesize);
+
+    return vm.verify();
+}
+
+TEST_CASE("Verifier", "[VM][engines]") {
+    uint32_t n, passed = 0;
+    std::vector<uint8_t> code;
+
+    SECTION("polictf programs pass") {
+        REQUIRE(verifies(ENCRYPT_PSTC, ENCRYPT_PSTC_LEN));
+        REQUIRE(verifies(DECRYPT_PSTC, DECRYPT_PSTC_LEN));
+    }
+    SECTION("Statically wrong programs do not") {
+        uint8_t ok[] = {K_MOVI, R0, 0x01, 0x00, K_SHIT};
+        uint8_t bad_reg[] = {K_MOVR, R0 << 4 | SP, K_SHIT};
+        uint8_t bad_stri[] = {K_STRI, 0x09, 0x00, R0, K_SHIT};
+        uint8_t bad_lodi[] = {K_LODI, R0, 0xfe, 0x00, K_SHIT};
+        uint8_t bad_jump[] = {K_JMPI, 0x00, 0x10};
+        uint8_t bad_end[] = {K_MOVI, R0, 0x01, 0x00};
+        uint8_t cut[] = {K_NOPE, K_MOVI, R0};
+        // only reachable instructions count
+        uint8_t dead[] = {K_JMPI, 0x04, 0x00, K_MOVR, K_SHIT};
+
+        REQUIRE(verifies(ok, sizeof(ok)));
+        REQUIRE(!verifies(bad_reg, sizeof(bad_reg)));
+        REQUIRE(!verifies(bad_stri, sizeof(bad_stri)));
+        REQUIRE(!verifies(bad_lodi, sizeof(bad_lodi)));
+        REQUIRE(!verifies(bad_jump, sizeof(bad_jump)));
+        REQUIRE(!verifies(bad_end, sizeof(bad_end)));
+        REQUIRE(!verifies(cut, sizeof(cut)));
+        REQUIRE(verifies(dead, sizeof(dead)));
+    }
+    SECTION("Register jumps landing on unverified code") {
+        uint8_t code[] = {
+                K_MOVI, R0, 0x0b, 0x00, // 0x00
+                K_JMPR, R0,             // 0x04 lands in the middle of the next one
+                K_MOVI, R1, 0x00, 0x00, // 0x06
+                K_SHIT,                 // 0x0a
+                K_MOVI, R2, 0x02, 0x00, // 0x0b
+                K_SHIT                  // 0x0f
+        };
+        VM ref(PROGRAMS_KEY, code, sizeof(code));
+        VM vm(PROGRAMS_KEY, code, sizeof(code), ENGINE_VERIFIED);
+
+        REQUIRE(vm.verify());
+        REQUIRE(vm.run() == ref.run());
+        requireSameState(ref, vm);
+        REQUIRE(vm.reg(R2) == 2);
+        REQUIRE(vm.reg(IP) == 0x0f);
+    }
+    SECTION("Verified random programs") {
+        for (n = 0; n < 500; n++) {
+            code = genProgram(5 + rnd(20));
+            VM ref(PROGRAMS_KEY, code.data(), code.size());
+            VM vm(PROGRAMS_KEY, code.data(), code.size(), ENGINE_VERIFIED);
+            if (!vm.verify()) {
+                continue;
+            }
+            passed++;
+            REQUIRE(vm.run() == ref.run());
+            requireSameState(ref, vm);
+        }
+        REQUIRE(passed > 100);
+    }
+}
+
+static void requireSameRun(uint8_t *code, uint32_t codesize, uint32_t traces) {
+    VM ref(PROGRAMS_KEY, code, codesize);
+    VM vm(PROGRAMS_KEY, code, codesize, ENGINE_TRACE);
+
+    REQUIRE(vm.run() == ref.run());
+    requireSameState(ref, vm);
+    REQUIRE(vm.traces() == traces);
+}
+
+TEST_CASE("Traces", "[VM][engines]") {
+    SECTION("A hoisted data check fails") {
+        uint8_t code[] = {
+                K_MOVI, R1, 0x00, 0x00, // 0x00
+                K_LODR, R0 << 4 | R1,   // 0x04 faults once R1 gets to 0xfe
+                K_ADDI, R1, 0x02, 0x00, // 0x06
+                K_JMPI, 0x04, 0x00      // 0x0a
+        };
+        requireSameRun(code, sizeof(code), 1);
+    }
+    SECTION("A hoisted stack check fails") {
+        uint8_t code[] = {
+                K_PUSH, R0,             // 0x00 overflows the stack
+                K_ADDI, R0, 0x01, 0x00, // 0x02
+                K_JMPI, 0x00, 0x00      // 0x06
+        };
+        requireSameRun(code, sizeof(code), 1);
+    }
+    SECTION("Leaving the trace writes the flags") {
+        uint8_t code[] = {
+                K_MOVI, R0, 0x28, 0x00, // 0x00
+                K_SUBI, R0, 0x01, 0x00, // 0x04
+                K_CMPB, R0, 0x00,       // 0x08 only seen when leaving
+                K_JPEI, 0x18, 0x00,     // 0x0b
+                K_CMPW, R0, 0x00, 0x01, // 0x0e
+                K_JPBI, 0x04, 0x00,     // 0x12
+                K_NOPE, K_NOPE, K_NOPE, // 0x15
+                K_JPNI, 0x1f, 0x00,     // 0x18 ZF is still set by CMPB
+                K_MOVI, R2, 0x01, 0x00, // 0x1b
+                K_SHIT                  // 0x1f
+        };
+        requireSameRun(code, sizeof(code), 1);
+    }
+    SECTION("Calls inside the loop") {
+        uint8_t code[] = {
+                K_MOVI, R0, 0x00, 0x00, // 0x00
+                K_CALL, 0x12, 0x00,     // 0x04
+                K_CMPW, R0, 0x32, 0x00, // 0x07
+                K_JPNI, 0x04, 0x00,     // 0x0b
+                K_SHIT,                 // 0x0e
+                K_NOPE, K_NOPE, K_NOPE, // 0x0f
+                K_ADDI, R0, 0x01, 0x00, // 0x12
+                K_RETN                  // 0x16
+        };
+        requireSameRun(code, sizeof(code), 1);
+    }
+    SECTION("TEA rounds") {
+        VM vm(PROGRAMS_KEY, DECRYPT_PSTC, DECRYPT_PSTC_LEN, ENGINE_TRACE);
+        vm.addressSpace()->insData(EN_DATASECTION, EN_DATASECTION_LEN);
+        vm.run();
+        REQUIRE(vm.traces() > 0);
+    }
+}
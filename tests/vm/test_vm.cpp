@@ -1,6 +1,13 @@
 #include "../include/catch.hpp"
 #include "../../vm/vm.h"
+#include "programs.h"
 #include <cstring>
+#include <thread>
+#include <vector>
+#ifdef __unix__
+#include <stdio.h>
+#include <unistd.h>
+#endif
 
 
 TEST_CASE("VM initialization", "[VM]") {
@@ -77,3 +84,197 @@ TEST_CASE("VM initialization", "[VM]") {
 
 }
 
+TEST_CASE("VM execution", "[VM]") {
+    uint32_t i;
+
+// Decrypting the server's data section gives back the plaintext
+    VM vm_dec(PROGRAMS_KEY, DECRYPT_PSTC, DECRYPT_PSTC_LEN);
+    vm_dec.addressSpace()->insData(EN_DATASECTION, EN_DATASECTION_LEN);
+    vm_dec.run();
+    for (i = 0; i < EN_DATASECTION_LEN; i++) {
+        REQUIRE(vm_dec.addressSpace()->getData()[i] == (uint8_t) DE_DATASECTION[i]);
+    }
+
+// The client's program encrypts its own data and loads it in R0 -> R3
+    VM vm_enc(PROGRAMS_KEY, ENCRYPT_PSTC, ENCRYPT_PSTC_LEN);
+    vm_enc.run();
+    REQUIRE(vm_enc.reg(R0) == 0xac04);
+    REQUIRE(vm_enc.reg(R1) == 0xeab3);
+    REQUIRE(vm_enc.reg(R2) == 0x793b);
+    REQUIRE(vm_enc.reg(R3) == 0x3856);
+
+// An unknown opcode stops the VM where it is
+    uint8_t wat[] = {K_MOVI, R0, 0x01, 0x00, K_WAT, K_MOVI, R1, 0x01, 0x00};
+    VM vm_wat(PROGRAMS_KEY, wat, sizeof(wat));
+    vm_wat.run();
+    REQUIRE(vm_wat.reg(R0) == 1);
+    REQUIRE(vm_wat.reg(R1) == 0);
+    REQUIRE(vm_wat.reg(IP) == 4);
+}
+
+TEST_CASE("VMs sharing the opcodes of a key", "[VM]") {
+    uint8_t other[] = "SomeOtherKey";
+    std::vector<std::thread> threads;
+    bool decrypted[8];
+    uint32_t i;
+
+    // built while another key's VM lives, after the first set for the key is gone
+    {
+        VM first(PROGRAMS_KEY);
+    }
+    VM keep(other);
+    VM vm(PROGRAMS_KEY, DECRYPT_PSTC, DECRYPT_PSTC_LEN);
+    VM wrong(other, DECRYPT_PSTC, DECRYPT_PSTC_LEN);
+
+    vm.addressSpace()->insData(EN_DATASECTION, EN_DATASECTION_LEN);
+    wrong.addressSpace()->insData(EN_DATASECTION, EN_DATASECTION_LEN);
+    REQUIRE(vm.run() == VM_HALTED);
+    REQUIRE(memcmp(vm.addressSpace()->getData(), DE_DATASECTION, EN_DATASECTION_LEN) == 0);
+    wrong.run();
+    REQUIRE(memcmp(wrong.addressSpace()->getData(), DE_DATASECTION, EN_DATASECTION_LEN) != 0);
+
+    // and from many threads at once
+    for (i = 0; i < 8; i++) {
+        threads.emplace_back([i, &decrypted, &other]() {
+            VM vm(i % 2 ? other : PROGRAMS_KEY, DECRYPT_PSTC, DECRYPT_PSTC_LEN);
+
+            vm.addressSpace()->insData(EN_DATASECTION, EN_DATASECTION_LEN);
+            vm.run();
+            decrypted[i] = memcmp(vm.addressSpace()->getData(), DE_DATASECTION, EN_DATASECTION_LEN) == 0;
+        });
+    }
+    for (i = 0; i < 8; i++) {
+        threads[i].join();
+        REQUIRE(decrypted[i] == (i % 2 == 0));
+    }
+}
+
+TEST_CASE("VM reset and reload", "[VM]") {
+    uint8_t zero[DEFAULT_CODESIZE + 1] = {0};
+    uint32_t i;
+
+    for (engines engine : {ENGINE_HANDLERS, ENGINE_PREDECODED, ENGINE_JIT}) {
+        VM vm(PROGRAMS_KEY, DECRYPT_PSTC, DECRYPT_PSTC_LEN, engine);
+        VM ref(PROGRAMS_KEY, ENCRYPT_PSTC, ENCRYPT_PSTC_LEN);
+        VMAddrSpace *as = vm.addressSpace();
+
+        // the same program over and over, on the data it is given
+        for (i = 0; i < 3; i++) {
+            REQUIRE(vm.reload(DECRYPT_PSTC, DECRYPT_PSTC_LEN, EN_DATASECTION, EN_DATASECTION_LEN));
+            REQUIRE(vm.run() == VM_HALTED);
+            REQUIRE(memcmp(as->getData(), DE_DATASECTION, EN_DATASECTION_LEN) == 0);
+        }
+        vm.reset();
+        for (i = 0; i < NUM_REGS; i++) {
+            REQUIRE(vm.reg(i) == 0);
+        }
+        REQUIRE(memcmp(as->getData(), zero, DEFAULT_DATASIZE) == 0);
+        REQUIRE(memcmp(as->getStack(), zero, DEFAULT_STACKSIZE) == 0);
+        REQUIRE(memcmp(as->getCode(), DECRYPT_PSTC, DECRYPT_PSTC_LEN) == 0);
+
+        // a shorter program leaves nothing of the longer one behind
+        REQUIRE(vm.reload(ENCRYPT_PSTC, ENCRYPT_PSTC_LEN));
+        REQUIRE(vm.reload(DECRYPT_PSTC, DECRYPT_PSTC_LEN));
+        REQUIRE(memcmp(as->getCode() + DECRYPT_PSTC_LEN, zero, DEFAULT_CODESIZE - DECRYPT_PSTC_LEN) == 0);
+        REQUIRE(vm.reload(ENCRYPT_PSTC, ENCRYPT_PSTC_LEN));
+        REQUIRE(vm.run() == ref.run());
+        for (i = 0; i < NUM_REGS; i++) {
+            REQUIRE(vm.reg(i) == ref.reg(i));
+        }
+
+        // what does not fit changes nothing
+        REQUIRE_FALSE(vm.reload(zero, DEFAULT_CODESIZE + 1));
+        REQUIRE_FALSE(vm.reload(DECRYPT_PSTC, DECRYPT_PSTC_LEN, zero, DEFAULT_DATASIZE + 1));
+        REQUIRE(vm.reg(R0) == ref.reg(R0));
+    }
+}
+
+TEST_CASE("VM reset clears the whole flags word", "[VM]") {
+    // register 11 is the flags and the byte after them
+    uint8_t code[] = {K_MOVI, 0x0b, 0x00, 0xff, K_SHIT};
+
+    for (engines engine : {ENGINE_HANDLERS, ENGINE_PREDECODED, ENGINE_JIT}) {
+        VM vm(PROGRAMS_KEY, code, sizeof(code), engine);
+
+        REQUIRE(vm.run() == VM_HALTED);
+        REQUIRE(vm.flagsWord() == 0xff00);
+        vm.reset();
+        REQUIRE(vm.flagsWord() == 0);
+    }
+}
+
+TEST_CASE("VM reset clears the written prefix only", "[VM]") {
+    // stores up to 0xc0 in data and pushes up to 0x84 in the stack, in a loop hot enough to be traced
+    uint8_t code[] = {K_MOVI, R0, 0x47, 0x47,     // 0x00
+                      K_STRI, 0x06, 0x00, R0,     // 0x04
+                      K_MOVI, R1, 0x40, 0x00,     // 0x08
+                      K_STRR, R1 << 4 | R0,       // 0x0c
+                      K_PUSH, R0,                 // 0x0e
+                      K_ADDI, R1, 0x02, 0x00,     // 0x10
+                      K_CMPW, R1, 0xc0, 0x00,     // 0x14
+                      K_JPNI, 0x0c, 0x00,         // 0x18
+                      K_CALL, 0x1f, 0x00,         // 0x1b
+                      K_SHIT,                     // 0x1e
+                      K_PUSH, R0,                 // 0x1f
+                      K_SHIT};                    // 0x21
+
+    for (engines engine : {ENGINE_HANDLERS, ENGINE_THREADED, ENGINE_PREDECODED, ENGINE_BLOCKS, ENGINE_JIT,
+                           ENGINE_TRACE, ENGINE_VERIFIED}) {
+        VM vm(PROGRAMS_KEY, code, sizeof(code), engine);
+        VMAddrSpace *as = vm.addressSpace();
+
+        REQUIRE(vm.run() == VM_HALTED);
+        REQUIRE(vm.reg(IP) == 0x21);
+        REQUIRE(vm.traces() == (engine == ENGINE_TRACE ? 1 : 0));
+        REQUIRE(as->dataSection()[0xbf] == 0x47);
+        REQUIRE(as->stackSection()[0x83] == 0x47);
+        // past the marks, where reset() must not go
+        as->dataSection()[0xc0] = 0xaa;
+        as->stackSection()[0x84] = 0xaa;
+        vm.reset();
+        REQUIRE(as->dataSection()[0x06] == 0);
+        REQUIRE(as->dataSection()[0xbf] == 0);
+        REQUIRE(as->stackSection()[0x83] == 0);
+        REQUIRE(as->dataSection()[0xc0] == 0xaa);
+        REQUIRE(as->stackSection()[0x84] == 0xaa);
+    }
+}
+
+#ifdef __unix__
+TEST_CASE("VM checkpoints", "[VM]") {
+    uint8_t other[] = "AnotherKey";
+    FILE *f = tmpfile();
+    uint64_t magic = 0;
+    uint32_t i;
+
+    REQUIRE(f != NULL);
+    VM ref(PROGRAMS_KEY, DECRYPT_PSTC, DECRYPT_PSTC_LEN, ENGINE_PREDECODED);
+    ref.addressSpace()->insData(EN_DATASECTION, EN_DATASECTION_LEN);
+    REQUIRE(ref.run(997) == VM_EXHAUSTED);
+    REQUIRE(ref.checkpoint(fileno(f)));
+
+    // any number of VMs go on from the file, as the one it was taken from
+    std::shared_ptr<const VMSnapshot> restored = VM::restore(PROGRAMS_KEY, fileno(f));
+    REQUIRE(restored);
+    REQUIRE(ref.run() == VM_HALTED);
+    for (i = 0; i < 3; i++) {
+        VM vm(restored);
+
+        REQUIRE(vm.addressSpace()->getDataOwner() == OWNER_MAPPING);
+        REQUIRE(vm.run() == VM_HALTED);
+        REQUIRE(memcmp(vm.addressSpace()->getData(), DE_DATASECTION, EN_DATASECTION_LEN) == 0);
+        for (uint8_t r = R0; r < NUM_REGS; r++) {
+            REQUIRE(vm.reg(r) == ref.reg(r));
+        }
+    }
+    REQUIRE(restored.use_count() == 1);
+
+    REQUIRE_FALSE(VM::restore(other, fileno(f)));
+    REQUIRE(ftruncate(fileno(f), 0x100) == 0);
+    REQUIRE_FALSE(VM::restore(PROGRAMS_KEY, fileno(f)));
+    REQUIRE(pwrite(fileno(f), &magic, sizeof(magic), 0) == sizeof(magic));
+    REQUIRE_FALSE(VM::restore(PROGRAMS_KEY, fileno(f)));
+    REQUIRE_THROWS_AS(VM(VM::restore(PROGRAMS_KEY, fileno(f))), const std::invalid_argument &);
+    fclose(f);
+}
+#endif
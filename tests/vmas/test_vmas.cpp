@@ -1,6 +1,15 @@
 #include "../include/catch.hpp"
 #include "../../vm/vm.h"
+#include "../vm/programs.h"
+#include <algorithm>
 #include <cstring>
+#include <vector>
+#ifdef __unix__
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
 
 TEST_CASE("VMAddrSpace initialization", "[VMAS]") {
     uint32_t i;
@@ -128,6 +137,318 @@ TEST_CASE("VMAddrSpace initialization", "[VMAS]") {
 
 }
 
+#ifdef __unix__
+// whether writing at offset from the start of the section kills the process
+static bool faults(uint8_t *section, int32_t offset) {
+    pid_t pid = fork();
+    int status;
+
+    if (pid == 0) {
+        signal(SIGSEGV, SIG_DFL);
+        section[offset] = 0x47;
+        _exit(0);
+    }
+    waitpid(pid, &status, 0);
+    return WIFSIGNALED(status);
+}
+#endif
+
+TEST_CASE("Guarded VMAddrSpace", "[VMAS]") {
+    VMAddrSpace guarded(0x1000, 0x300, 0x102, AS_GUARDED), plain(0x1000, 0x300, 0x102);
+    uint8_t data[0x102];
+    uint32_t i;
+
+    REQUIRE_FALSE(plain.isMapped());
+#ifdef __unix__
+    REQUIRE(guarded.isMapped());
+#endif
+    REQUIRE(guarded.getCodesize() == 0x300);
+    REQUIRE(guarded.getDatasize() == 0x102);
+    REQUIRE(guarded.getStacksize() == 0x1000);
+    for (i = 0; i < 0x102; i++) {
+        REQUIRE(guarded.getData()[i] == 0);
+        data[i] = i;
+    }
+    REQUIRE(guarded.insData(data, sizeof(data)));
+    REQUIRE(memcmp(guarded.getData(), data, sizeof(data)) == 0);
+    guarded.clear();
+    REQUIRE(guarded.getData()[0x101] == 0);
+
+    SECTION("Running over any section faults") {
+#ifdef __unix__
+        REQUIRE_FALSE(faults(guarded.getCode(), 0x2ff));
+        REQUIRE(faults(guarded.getCode(), 0x300));
+        REQUIRE_FALSE(faults(guarded.getData(), 0x101));
+        REQUIRE(faults(guarded.getData(), 0x102));
+        REQUIRE_FALSE(faults(guarded.getStack(), 0xfff));
+        REQUIRE(faults(guarded.getStack(), 0x1000));
+#endif
+    }
+    SECTION("A guarded VM runs as any other") {
+        VM vm(PROGRAMS_KEY, DECRYPT_PSTC, DECRYPT_PSTC_LEN, ENGINE_PREDECODED, AS_GUARDED);
+
+        REQUIRE(vm.addressSpace()->isMapped() == guarded.isMapped());
+        vm.addressSpace()->insData(EN_DATASECTION, EN_DATASECTION_LEN);
+        REQUIRE(vm.run() == VM_HALTED);
+        REQUIRE(memcmp(vm.addressSpace()->getData(), DE_DATASECTION, EN_DATASECTION_LEN) == 0);
+    }
+}
+
+TEST_CASE("Wide VMAddrSpace", "[VMAS]") {
+    VMAddrSpace wide(0x10, 0x300, 0x10, AS_WIDE);
+    uint8_t zero[0x1000] = {0};
+    uint32_t i;
+
+    REQUIRE(wide.getDatasize() == WIDE_SEGMENT);
+    REQUIRE(wide.getStacksize() == WIDE_SEGMENT);
+    REQUIRE(wide.getCodesize() == 0x300);
+    for (i = 0; i < WIDE_SEGMENT; i += 0x111) {
+        wide.getData()[i] = 0x47;
+        wide.getStack()[i] = 0x47;
+    }
+    wide.getData()[0x10001] = 0x47;
+    wide.clear();
+    for (i = 0; i < WIDE_SEGMENT; i += sizeof(zero)) {
+        REQUIRE(memcmp(wide.getData() + i, zero, std::min<uint32_t>(sizeof(zero), WIDE_SEGMENT - i)) == 0);
+        REQUIRE(memcmp(wide.getStack() + i, zero, std::min<uint32_t>(sizeof(zero), WIDE_SEGMENT - i)) == 0);
+    }
+}
+
+#ifdef __unix__
+// how many pages of [start, start + size) take memory
+static uint32_t resident(uint8_t *start, uint32_t size) {
+    uintptr_t page = sysconf(_SC_PAGESIZE), first = (uintptr_t) start / page * page;
+    std::vector<unsigned char> pages(((uintptr_t) start + size - first + page - 1) / page);
+    uint32_t count = 0;
+
+    REQUIRE(mincore((void *) first, (uintptr_t) start + size - first, pages.data()) == 0);
+    for (unsigned char p : pages) {
+        count += p & 1;
+    }
+    return count;
+}
+
+TEST_CASE("Sparse VMAddrSpace", "[VMAS]") {
+    VMAddrSpace sparse(0x100, 0x300, 0xFFFF);
+    uint8_t zero[0x1000] = {0};
+    uint32_t i;
+
+    REQUIRE(sparse.isMapped());
+    REQUIRE(resident(sparse.getData(), 0xFFFF) == 0);
+    sparse.getData()[0x10] = 0x47;
+    sparse.getData()[0xF000] = 0x47;
+    REQUIRE(resident(sparse.getData(), 0xFFFF) == 2);
+    sparse.clear();
+    REQUIRE(resident(sparse.getData(), 0xFFFF) == 0);
+    for (i = 0; i < 0xFFFF; i += sizeof(zero)) {
+        REQUIRE(memcmp(sparse.getData() + i, zero, std::min<uint32_t>(sizeof(zero), 0xFFFF - i)) == 0);
+    }
+
+    // small sections still come from the resource
+    VMAddrSpace small(0x100, 0x300, SPARSE_SECTION - 1);
+    REQUIRE_FALSE(small.isMapped());
+}
+
+TEST_CASE("Forked VMAddrSpace", "[VMAS]") {
+    VMAddrSpace parent(0x100, 0x300, 0xFFFF);
+    uint8_t bytes[] = {0x47, 0x48, 0x49};
+
+    REQUIRE(parent.insCode(bytes, sizeof(bytes)));
+    REQUIRE(parent.insData(0x10, bytes, sizeof(bytes)));
+    REQUIRE(parent.insStack(bytes, sizeof(bytes)));
+    std::shared_ptr<const SpaceImage> image = parent.snapshot();
+    REQUIRE(image);
+    // later writes are the parent's own
+    REQUIRE(parent.insData(0x20, bytes, sizeof(bytes)));
+
+    VMAddrSpace a(image), b(image);
+
+    REQUIRE(a.getDataOwner() == OWNER_MAPPING);
+    REQUIRE(a.getStackOwner() == OWNER_MAPPING);
+    REQUIRE(a.getCodeOwner() == OWNER_IMAGE);
+    REQUIRE(a.getCodeImage() == b.getCodeImage());
+    REQUIRE(a.getDatasize() == 0xFFFF);
+    REQUIRE(a.getStacksize() == 0x100);
+    REQUIRE(a.getCodesize() == 0x300);
+    REQUIRE(memcmp(a.getCode(), bytes, sizeof(bytes)) == 0);
+    // nothing past the bytes the snapshot had takes memory
+    REQUIRE(resident(a.getData() + 0x1000, 0xFFFF - 0x1000) == 0);
+    REQUIRE(memcmp(a.getData() + 0x10, bytes, sizeof(bytes)) == 0);
+    REQUIRE(a.getData()[0x20] == 0);
+    REQUIRE(memcmp(a.getStack(), bytes, sizeof(bytes)) == 0);
+
+    a.getData()[0x10] = 0;
+    a.getData()[0x8000] = 0x47;
+    a.getStack()[0] = 0;
+    REQUIRE(resident(b.getData() + 0x1000, 0xFFFF - 0x1000) == 0);
+    REQUIRE(b.getData()[0x10] == 0x47);
+    REQUIRE(b.getData()[0x8000] == 0);
+    REQUIRE(b.getStack()[0] == 0x47);
+    REQUIRE(parent.getData()[0x10] == 0x47);
+
+    // clearing a fork zeroes it, the image stays as it was
+    a.clear();
+    REQUIRE(a.getData()[0x11] == 0);
+    VMAddrSpace c(image);
+    REQUIRE(c.getData()[0x11] == 0x48);
+
+    SECTION("Guarded forks are guarded too") {
+        VMAddrSpace guarded(0x1000, 0x300, 0x102, AS_GUARDED);
+        VMAddrSpace forked(guarded.snapshot());
+
+        REQUIRE_FALSE(faults(forked.getData(), 0x101));
+        REQUIRE(faults(forked.getData(), 0x102));
+        REQUIRE_FALSE(faults(forked.getStack(), 0xfff));
+        REQUIRE(faults(forked.getStack(), 0x1000));
+    }
+}
+#endif
+
+// counts what is still allocated from it, and how many times it was asked
+class CountingResource : public std::pmr::memory_resource {
+public:
+    size_t live = 0, allocations = 0;
+
+private:
+    void *do_allocate(size_t bytes, size_t alignment) override {
+        live += bytes;
+        allocations++;
+        return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+    }
+
+    void do_deallocate(void *p, size_t bytes, size_t alignment) override {
+        live -= bytes;
+        std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+        return this == &other;
+    }
+};
+
+TEST_CASE("VMAddrSpace on a memory resource", "[VMAS]") {
+    CountingResource counting;
+
+    SECTION("Every section comes from the resource and goes back to it") {
+        {
+            VMAddrSpace vmas(0x10, 0x300, 0x20, 0, &counting);
+
+            REQUIRE(counting.allocations == 1);
+            REQUIRE(counting.live == 0x330);
+            REQUIRE(vmas.getData()[0x1f] == 0);
+        }
+        REQUIRE(counting.live == 0);
+    }
+    SECTION("Mapped sections don't touch it") {
+        VMAddrSpace vmas(0x10, 0x300, 0x20, AS_GUARDED, &counting);
+
+        REQUIRE(counting.allocations == (vmas.isMapped() ? 0 : 1));
+    }
+    SECTION("A VM on a monotonic buffer runs as any other") {
+        uint8_t buffer[0x1000];
+        std::pmr::monotonic_buffer_resource arena(buffer, sizeof(buffer), &counting);
+
+        memset(buffer, 0x47, sizeof(buffer));
+        {
+            VM vm(PROGRAMS_KEY, DECRYPT_PSTC, DECRYPT_PSTC_LEN, ENGINE_PREDECODED, 0, &arena);
+
+            REQUIRE(vm.addressSpace()->getStack() >= buffer);
+            REQUIRE(vm.addressSpace()->getStack() < buffer + sizeof(buffer));
+            vm.addressSpace()->insData(EN_DATASECTION, EN_DATASECTION_LEN);
+            REQUIRE(vm.run() == VM_HALTED);
+            REQUIRE(memcmp(vm.addressSpace()->getData(), DE_DATASECTION, EN_DATASECTION_LEN) == 0);
+        }
+        REQUIRE(counting.allocations == 0);
+    }
+}
+
+TEST_CASE("Partial data inserts", "[VMAS]") {
+    VMAddrSpace vmas;
+    uint8_t patch[] = {0x47, 0x48, 0x49};
+
+    REQUIRE(vmas.insData(EN_DATASECTION, EN_DATASECTION_LEN));
+    REQUIRE(vmas.insData(0x10, patch, sizeof(patch)));
+    REQUIRE(memcmp(vmas.getData(), EN_DATASECTION, 0x10) == 0);
+    REQUIRE(memcmp(vmas.getData() + 0x10, patch, sizeof(patch)) == 0);
+    REQUIRE(memcmp(vmas.getData() + 0x13, EN_DATASECTION + 0x13, EN_DATASECTION_LEN - 0x13) == 0);
+    REQUIRE(vmas.insData(DEFAULT_DATASIZE - 3, patch, sizeof(patch)));
+    REQUIRE_FALSE(vmas.insData(DEFAULT_DATASIZE - 2, patch, sizeof(patch)));
+    REQUIRE_FALSE(vmas.insData(0xffffffff, patch, sizeof(patch)));
+
+    VMAddrSpace clean;
+
+    REQUIRE(clean.insData(0xf0, patch, sizeof(patch)));
+    clean.clear();
+    REQUIRE(clean.getData()[0xf2] == 0);
+}
+
+TEST_CASE("Adopted code", "[VMAS]") {
+    for (engines engine : {ENGINE_HANDLERS, ENGINE_PREDECODED, ENGINE_JIT}) {
+        VM vm(PROGRAMS_KEY, ENCRYPT_PSTC, ENCRYPT_PSTC_LEN, engine);
+        VMAddrSpace *as = vm.addressSpace();
+        uint32_t version = as->getCodeVersion();
+
+        as->insData((uint8_t *) DE_DATASECTION, EN_DATASECTION_LEN);
+        REQUIRE(vm.run() == VM_HALTED);
+
+        // the decryption from the very bytes of DECRYPT_PSTC
+        REQUIRE(as->adoptCode(DECRYPT_PSTC, DECRYPT_PSTC_LEN));
+        REQUIRE(as->getCode() == DECRYPT_PSTC);
+        REQUIRE(as->getCodesize() == DECRYPT_PSTC_LEN);
+        REQUIRE(as->getCodeOwner() == OWNER_CALLER);
+        REQUIRE(as->getCodeVersion() != version);
+        vm.reset();
+        as->insData(EN_DATASECTION, EN_DATASECTION_LEN);
+        REQUIRE(vm.run() == VM_HALTED);
+        REQUIRE(memcmp(as->getData(), DE_DATASECTION, EN_DATASECTION_LEN) == 0);
+
+        // the section is only as big as the buffer
+        REQUIRE_FALSE(vm.reload(ENCRYPT_PSTC, ENCRYPT_PSTC_LEN));
+        // writing the code copies it first
+        REQUIRE(as->insCode(ENCRYPT_PSTC, 1));
+        REQUIRE(as->getCodeOwner() == OWNER_SPACE);
+        REQUIRE(as->getCode() != DECRYPT_PSTC);
+        REQUIRE(as->getCode()[0] == ENCRYPT_PSTC[0]);
+        REQUIRE(memcmp(as->getCode() + 1, DECRYPT_PSTC + 1, DECRYPT_PSTC_LEN - 1) == 0);
+    }
+}
+
+#ifdef __unix__
+TEST_CASE("Data mapped from a file", "[VMAS]") {
+    FILE *f = tmpfile();
+    std::vector<uint8_t> file(0x3000, 0x47);
+    uint64_t offset = 0x1ff0;
+
+    REQUIRE(f != NULL);
+    memcpy(file.data() + offset, EN_DATASECTION, EN_DATASECTION_LEN);
+    REQUIRE(fwrite(file.data(), 1, file.size(), f) == file.size());
+    REQUIRE(fflush(f) == 0);
+
+    VM vm(PROGRAMS_KEY, DECRYPT_PSTC, DECRYPT_PSTC_LEN);
+    VMAddrSpace *as = vm.addressSpace();
+
+    REQUIRE_FALSE(as->mapData(fileno(f), offset, DEFAULT_DATASIZE + 1));
+    REQUIRE_FALSE(as->mapData(fileno(f), file.size() - 0x10, 0x11));
+    REQUIRE(as->mapData(fileno(f), offset, EN_DATASECTION_LEN));
+    REQUIRE(as->getDataOwner() == OWNER_MAPPING);
+    REQUIRE(as->getData()[EN_DATASECTION_LEN] == 0);
+    REQUIRE(as->getData()[DEFAULT_DATASIZE - 1] == 0);
+    REQUIRE(vm.run() == VM_HALTED);
+    REQUIRE(memcmp(as->getData(), DE_DATASECTION, EN_DATASECTION_LEN) == 0);
+
+    // the file never sees the writes
+    std::vector<uint8_t> after(file.size());
+    REQUIRE(fseek(f, 0, SEEK_SET) == 0);
+    REQUIRE(fread(after.data(), 1, after.size(), f) == after.size());
+    REQUIRE(after == file);
+
+    // clearing zeroes the copy, not back to the file
+    as->clear();
+    REQUIRE(as->getData()[0] == 0);
+    fclose(f);
+}
+#endif
+
 TEST_CASE("Getting operands from VMAddrSpace", "[VMAS]") {
     uint8_t dst8, src8;
     uint16_t dst16, src16;
@@ -0,0 +1,747 @@
+#include "aot.h"
+#include <stdarg.h>
+
+enum decode_results {
+    DECODE_OK, DECODE_FAULT, DECODE_OUTSIDE
+};
+
+Recompiler::Recompiler(VM &vm) : vm(vm) {
+    codesize = vm.as.getCodesize();
+}
+
+const char *Recompiler::error(void) {
+    return err.c_str();
+}
+
+void Recompiler::emit(const char *fmt, ...) {
+    char buf[256];
+    va_list args;
+
+    va_start(args, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    out += buf;
+    return;
+}
+
+static std::string hex(uint32_t value) {
+    char buf[16];
+    snprintf(buf, sizeof(buf), "0x%04x", value);
+    return buf;
+}
+
+/*
+ * Same test as VM::isRegValid: register 11 gets through, and lands on the
+ * flags (see FLAGS_REG in the generated class).
+ */
+static bool isRegValid(uint8_t reg) {
+    return reg <= NUM_REGS && reg != IP && reg != RP && reg != SP;
+}
+
+/*
+ * Pulls the operands out of the code section the very same way
+ * VMAddrSpace::getArgs does for the instruction's handler. DECODE_FAULT if
+ * getArgs fails, DECODE_OUTSIDE if it would read past the code section.
+ */
+uint8_t Recompiler::decode(uint32_t ip, insn_t *in) {
+    uint8_t *code = vm.as.getCode();
+    const VM::instruction_t *instr = vm.DECODE[code[ip]];
+
+    in->op = instr == vm.WAT ? NUM_OPS : instr - vm.INSTR;
+    in->length = instr->length;
+    in->dst = 0;
+    in->src = 0;
+    in->imm = 0;
+    switch (in->op) {
+    case MOVI:
+    case LODI:
+    case ADDI:
+    case SUBI:
+    case ANDW:
+    case YORW:
+    case XORW:
+    case MULI:
+    case DIVI:
+    case SHLI:
+    case SHRI:
+    case CMPW:
+        if (ip + 1 >= codesize) {
+            return DECODE_FAULT;
+        }
+        if (ip + 3 >= codesize) {
+            return DECODE_OUTSIDE;
+        }
+        in->dst = code[ip + 1];
+        in->imm = code[ip + 2] | code[ip + 3] << 8;
+        break;
+    case ANDB:
+    case YORB:
+    case XORB:
+    case CMPB:
+        if (ip + 1 >= codesize) {
+            return DECODE_FAULT;
+        }
+        if (ip + 2 >= codesize) {
+            return DECODE_OUTSIDE;
+        }
+        in->dst = code[ip + 1];
+        in->imm = code[ip + 2];
+        break;
+    case STRI:
+        if (ip + 2 >= codesize) {
+            return DECODE_FAULT;
+        }
+        if (ip + 3 >= codesize) {
+            return DECODE_OUTSIDE;
+        }
+        in->imm = code[ip + 1] | code[ip + 2] << 8;
+        in->src = code[ip + 3];
+        break;
+    case MOVR:
+    case LODR:
+    case STRR:
+    case ADDR:
+    case SUBR:
+    case ANDR:
+    case YORR:
+    case XORR:
+    case NOTR:
+    case MULR:
+    case DIVR:
+    case SHLR:
+    case SHRR:
+    case CMPR:
+        if (ip + 1 >= codesize) {
+            return DECODE_FAULT;
+        }
+        in->dst = code[ip + 1] >> 4;
+        in->src = code[ip + 1] & 0b00001111;
+        break;
+    case PUSH:
+    case POOP:
+    case JMPR:
+    case JPAR:
+    case JPBR:
+    case JPER:
+    case JPNR:
+        if (ip + 1 >= codesize) {
+            return DECODE_FAULT;
+        }
+        in->dst = code[ip + 1];
+        break;
+    case JMPI:
+    case JPAI:
+    case JPBI:
+    case JPEI:
+    case JPNI:
+    case CALL:
+        if (ip + 1 >= codesize) {
+            return DECODE_FAULT;
+        }
+        if (ip + 2 >= codesize) {
+            return DECODE_OUTSIDE;
+        }
+        in->imm = code[ip + 1] | code[ip + 2] << 8;
+        break;
+    default:
+        break;
+    }
+    return DECODE_OK;
+}
+
+/*
+ * Whether the handler fails whatever the state of the VM is.
+ */
+bool Recompiler::faults(uint32_t ip, insn_t *in) {
+    switch (in->op) {
+    case MOVI:
+    case ADDI:
+    case SUBI:
+    case ANDB:
+    case ANDW:
+    case YORB:
+    case YORW:
+    case XORB:
+    case XORW:
+    case MULI:
+    case SHLI:
+    case SHRI:
+    case CMPB:
+    case CMPW:
+    case PUSH:
+    case POOP:
+    case JMPR:
+    case JPAR:
+    case JPBR:
+    case JPER:
+    case JPNR:
+        return !isRegValid(in->dst);
+    case DIVI:
+        return !isRegValid(in->dst) || in->imm == 0;
+    case LODI:
+        return !isRegValid(in->dst) || in->imm + sizeof(uint16_t) >= vm.as.getDatasize();
+    case STRI:
+        // execSTRI validates the lower byte of the address as a register
+        return !isRegValid(in->imm) || in->imm + sizeof(uint16_t) >= vm.as.getDatasize();
+    case MOVR:
+    case LODR:
+    case STRR:
+    case ADDR:
+    case SUBR:
+    case ANDR:
+    case YORR:
+    case XORR:
+    case NOTR:
+    case MULR:
+    case DIVR:
+    case SHLR:
+    case SHRR:
+    case CMPR:
+        return !isRegValid(in->src) || !isRegValid(in->dst);
+    case CALL:
+        return ip + 1 + sizeof(uint16_t) >= codesize;
+    case SHIT:
+    case NUM_OPS:
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool Recompiler::endsBlock(uint32_t ip, insn_t *in) {
+    return (in->op < NUM_OPS && vm.INSTR[in->op].isJump) || faults(ip, in);
+}
+
+/*
+ * Every address control can get to starts a block: 0, jump and call
+ * targets, and whatever follows a conditional jump or a call (RETN goes
+ * back there). A JMPR can go anywhere, so then every address does.
+ */
+bool Recompiler::findBlocks(void) {
+    std::vector<uint32_t> work, targets;
+    uint32_t ip, next, i;
+    insn_t in;
+
+    leader.assign(codesize, false);
+    indirect = false;
+    if (codesize == 0) {
+        return true;
+    }
+    leader[0] = true;
+    work.push_back(0);
+    while (!work.empty()) {
+        ip = work.back();
+        work.pop_back();
+        while (true) {
+            switch (decode(ip, &in)) {
+            case DECODE_FAULT:
+                in.op = NUM_OPS;
+                break;
+            case DECODE_OUTSIDE:
+                err = "the instruction at " + hex(ip) + " has operands past the end of the code section";
+                return false;
+            }
+            if (in.op == STRI && !faults(ip, &in) && in.src > NUM_REGS) {
+                err = "the STRI at " + hex(ip) + " stores a register which does not exist";
+                return false;
+            }
+
+            targets.clear();
+            next = (ip + in.length) & 0xffff;
+            switch (faults(ip, &in) ? NUM_OPS : in.op) {
+            case JMPI:
+                targets.push_back(in.imm);
+                break;
+            case JPAI:
+            case JPBI:
+            case JPEI:
+            case JPNI:
+            case CALL:
+                targets.push_back(in.imm);
+                targets.push_back(next);
+                break;
+            case JPAR:
+            case JPBR:
+            case JPER:
+            case JPNR:
+                // they jump to the register number, see execJPAR
+                targets.push_back(in.dst);
+                targets.push_back(next);
+                break;
+            case JMPR:
+                for (i = 0; i < codesize; i++) {
+                    targets.push_back(i);
+                }
+                indirect = true;
+                break;
+            case RETN:
+                indirect = true;
+                break;
+            }
+            for (uint32_t target : targets) {
+                if (target < codesize && !leader[target]) {
+                    leader[target] = true;
+                    work.push_back(target);
+                }
+            }
+            if (endsBlock(ip, &in) || next >= codesize || leader[next]) {
+                break;
+            }
+            ip = next;
+        }
+    }
+    return true;
+}
+
+/*
+ * C++ expression reading register reg. Only STRI can read IP, RP or SP:
+ * IP is the address of the instruction itself.
+ */
+static std::string readReg(uint8_t reg, uint32_t ip) {
+    static const char *names[] = {"r0", "r1", "r2", "r3", "s0", "s1", "s2", "s3",
+                                  "", "rp", "sp", "FLAGS"};
+    if (reg == IP) {
+        return hex(ip);
+    }
+    // the handler fails before reading it
+    if (reg > NUM_REGS) {
+        return "";
+    }
+    return names[reg];
+}
+
+static std::string binaryOp(uint8_t op) {
+    switch (op) {
+    case ADDI:
+    case ADDR:
+        return "+";
+    case SUBI:
+    case SUBR:
+        return "-";
+    case ANDB:
+    case ANDW:
+    case ANDR:
+        return "&";
+    case YORB:
+    case YORW:
+    case YORR:
+        return "|";
+    default:
+        return "^";
+    }
+}
+
+void Recompiler::emitAssign(uint8_t reg, const std::string &value) {
+    if (reg == NUM_REGS) {
+        emit("        { uint16_t v = %s; fw = v & ~3; zf = v & 1; cf = v >> 1 & 1; }\n", value.c_str());
+    } else {
+        emit("        %s = %s;\n", readReg(reg, 0).c_str(), value.c_str());
+    }
+    return;
+}
+
+void Recompiler::emitJump(uint32_t target) {
+    if (target < codesize) {
+        emit("goto L_%04x;", target);
+    } else {
+        emit("{ ip = %s; goto out; }", hex(target).c_str());
+    }
+    return;
+}
+
+/*
+ * Emits the body of the instruction at ip, faults and all. Returns whether
+ * control can go on to the next instruction.
+ */
+bool Recompiler::emitInstr(uint32_t ip, insn_t *in) {
+    std::string stop = "{ ip = " + hex(ip) + "; goto out; }";
+    std::string dst = readReg(in->dst, ip), src = readReg(in->src, ip), imm = hex(in->imm);
+    std::string cond;
+    uint32_t next = (ip + in->length) & 0xffff;
+
+    emit("        // %04x: %s\n", ip, vm.DECODE[vm.as.getCode()[ip]]->name);
+    if (in->op == SHIT) {
+        emit("        { ip = %s; goto halted; }\n", hex(ip).c_str());
+        halts = true;
+        return false;
+    }
+    if (faults(ip, in)) {
+        emit("        %s\n", stop.c_str());
+        return false;
+    }
+    switch (in->op) {
+    case MOVI:
+        emitAssign(in->dst, imm);
+        break;
+    case MOVR:
+        emitAssign(in->dst, src);
+        break;
+    case LODI:
+        emitAssign(in->dst, "load(data + " + imm + ")");
+        break;
+    case LODR:
+        emit("        if (%s + 2u >= DATASIZE) %s\n", src.c_str(), stop.c_str());
+        emitAssign(in->dst, "load(data + " + src + ")");
+        break;
+    case STRI:
+        emit("        store(data + %s, %s);\n", imm.c_str(), src.c_str());
+        emit("        mark(dataTop, %s + 2u);\n", imm.c_str());
+        break;
+    case STRR:
+        emit("        if (%s + 2u >= DATASIZE) %s\n", dst.c_str(), stop.c_str());
+        emit("        store(data + %s, %s);\n", dst.c_str(), src.c_str());
+        emit("        mark(dataTop, %s + 2u);\n", dst.c_str());
+        break;
+    case ADDI:
+    case SUBI:
+    case ANDW:
+    case YORW:
+    case XORW:
+        emitAssign(in->dst, dst + " " + binaryOp(in->op) + " " + imm);
+        break;
+    case ADDR:
+    case SUBR:
+    case ANDR:
+    case YORR:
+    case XORR:
+        emitAssign(in->dst, dst + " " + binaryOp(in->op) + " " + src);
+        break;
+    case ANDB:
+    case YORB:
+    case XORB:
+        emitAssign(in->dst, dst + " " + binaryOp(in->op) + " (uint8_t) " + imm);
+        break;
+    case NOTR:
+        emitAssign(in->dst, "~" + src);
+        break;
+    case MULI:
+        emitAssign(in->dst, "(uint32_t) " + dst + " * " + imm);
+        break;
+    case MULR:
+        emitAssign(in->dst, "(uint32_t) " + dst + " * " + src);
+        break;
+    case DIVI:
+        emitAssign(in->dst, dst + " / " + imm);
+        break;
+    case DIVR:
+        // execDIVR only looks at the lower byte of the divisor
+        emit("        if ((uint8_t) %s == 0) %s\n", src.c_str(), stop.c_str());
+        emitAssign(in->dst, dst + " / " + src);
+        break;
+    case SHLI:
+        emitAssign(in->dst, "shl(" + dst + ", " + imm + ")");
+        break;
+    case SHLR:
+        emitAssign(in->dst, "shl(" + dst + ", " + src + ")");
+        break;
+    case SHRI:
+        emitAssign(in->dst, "shr(" + dst + ", " + imm + ")");
+        break;
+    case SHRR:
+        emitAssign(in->dst, "shr(" + dst + ", " + src + ")");
+        break;
+    case PUSH:
+        emit("        if (sp + 2u >= STACKSIZE) %s\n", stop.c_str());
+        emit("        store(stack + sp, %s);\n", dst.c_str());
+        emit("        mark(stackTop, sp + 2u);\n");
+        emit("        sp += 2;\n");
+        break;
+    case POOP:
+        /*
+         * execPOOP never notices the stack going below 0 and reads whatever
+         * is before it: stop there instead, as on a fault.
+         */
+        emit("        if (sp < 2u || sp > STACKSIZE) %s\n", stop.c_str());
+        emit("        sp -= 2;\n");
+        emitAssign(in->dst, "load(stack + sp)");
+        break;
+    case CMPB:
+        // both halves re-read the register, like execCMPB does
+        emit("        zf = (uint8_t) %s == %s;\n", dst.c_str(), imm.c_str());
+        emit("        cf = (uint8_t) %s <= %s;\n", dst.c_str(), imm.c_str());
+        break;
+    case CMPW:
+        emit("        zf = %s == %s;\n", dst.c_str(), imm.c_str());
+        emit("        cf = %s <= %s;\n", dst.c_str(), imm.c_str());
+        break;
+    case CMPR:
+        if (in->dst == in->src) {
+            emit("        zf = cf = true;\n");
+        } else {
+            emit("        zf = %s == %s;\n", dst.c_str(), src.c_str());
+            emit("        cf = %s <= %s;\n", dst.c_str(), src.c_str());
+        }
+        break;
+    case JMPI:
+        emit("        ");
+        emitJump(in->imm);
+        emit("\n");
+        return false;
+    case JMPR:
+        emit("        ip = %s;\n", dst.c_str());
+        emit("        goto dispatch;\n");
+        return false;
+    case JPAI:
+    case JPAR:
+        cond = "!cf && !zf";
+        break;
+    case JPBI:
+    case JPBR:
+        cond = "cf";
+        break;
+    case JPEI:
+    case JPER:
+        cond = "zf";
+        break;
+    case JPNI:
+    case JPNR:
+        cond = "!zf";
+        break;
+    case CALL:
+        emit("        if (sp + 2u >= STACKSIZE) %s\n", stop.c_str());
+        emit("        rp = %s;\n", hex(next).c_str());
+        emit("        store(stack + sp, rp);\n");
+        emit("        mark(stackTop, sp + 2u);\n");
+        emit("        sp += 2;\n");
+        emit("        ");
+        emitJump(in->imm);
+        emit("\n");
+        return false;
+    case RETN:
+        // execRETN never notices the stack going below 0, but reads nothing from it
+        emit("        sp -= 2;\n");
+        emit("        ip = rp;\n");
+        emit("        goto dispatch;\n");
+        return false;
+    case GRMN:
+        emit("        r0 = r1 = r2 = r3 = s0 = s1 = s2 = s3 = 0x4747;\n");
+        break;
+#ifdef DBG
+    case DEBG:
+        emit("        SAVE(%s);\n", hex(ip).c_str());
+        emit("        status();\n");
+        break;
+#endif
+    default:
+        break;
+    }
+    if (!cond.empty()) {
+        // the register forms jump to the register number, see execJPAR
+        emit("        if (%s) ", cond.c_str());
+        emitJump(in->op == JPAR || in->op == JPBR || in->op == JPER || in->op == JPNR ? in->dst : in->imm);
+        emit("\n");
+    }
+    return true;
+}
+
+/*
+ * The addresses of the instructions in the block at ip, in order.
+ */
+void Recompiler::blockOf(uint32_t ip, std::vector<uint32_t> &ips) {
+    uint32_t next;
+    insn_t in;
+
+    ips.clear();
+    while (true) {
+        ips.push_back(ip);
+        if (decode(ip, &in) == DECODE_FAULT) {
+            in.op = NUM_OPS;
+        }
+        next = (ip + in.length) & 0xffff;
+        if (endsBlock(ip, &in) || next >= codesize || leader[next]) {
+            return;
+        }
+        ip = next;
+    }
+}
+
+/*
+ * Emits the block at ip twice. The first copy pays for all of its
+ * instructions at the head, as ENGINE_JIT does. Where the budget can't
+ * cover them it goes to the second one, which pays for one instruction at
+ * a time and stops exactly where the handlers would. A run which stopped
+ * inside a block goes on from there through the second copy.
+ */
+void Recompiler::emitBlock(uint32_t ip) {
+    std::vector<uint32_t> ips;
+    uint32_t i, next = 0;
+    bool counted, goes_on = false;
+    insn_t in;
+
+    blockOf(ip, ips);
+    for (counted = false; ; counted = true) {
+        if (!counted) {
+            emit("    L_%04x:\n", ip);
+            emit("        if (left < %zu) goto C_%04x;\n", ips.size(), ip);
+            emit("        left -= %zu;\n", ips.size());
+        }
+        for (i = 0; i < ips.size(); i++) {
+            if (counted && !labelled[ips[i]]) {
+                emit("    C_%04x:\n", ips[i]);
+                labelled[ips[i]] = true;
+            }
+            if (counted) {
+                emit("        if (left == 0) { ip = %s; goto exhausted; }\n", hex(ips[i]).c_str());
+                emit("        left--;\n");
+            }
+            if (decode(ips[i], &in) == DECODE_FAULT) {
+                in.op = NUM_OPS;
+            }
+            goes_on = emitInstr(ips[i], &in);
+            next = (ips[i] + in.length) & 0xffff;
+        }
+        if (goes_on) {
+            emit("        ");
+            emitJump(next);
+            emit("\n");
+        }
+        if (counted) {
+            return;
+        }
+    }
+}
+
+bool Recompiler::recompile(FILE *f, const char *name) {
+    uint8_t *code = vm.as.getCode();
+    uint32_t i, len;
+
+    std::vector<uint32_t> ips;
+
+    out.clear();
+    err.clear();
+    halts = false;
+    if (!findBlocks()) {
+        return false;
+    }
+    start.assign(codesize, false);
+    labelled.assign(codesize, false);
+    for (i = 0; i < codesize; i++) {
+        if (leader[i]) {
+            blockOf(i, ips);
+            for (uint32_t ip : ips) {
+                start[ip] = true;
+            }
+        }
+    }
+    // trailing zeroes are left to the section, only an empty one has no array
+    for (len = codesize; len > 1 && code[len - 1] == 0; len--);
+
+    emit("/*\n * %s: generated by pasticciotto-aot, do not edit.\n */\n", name);
+    emit("#include \"vm.h\"\n#include <stdexcept>\n#include <stdint.h>\n#include <string.h>\n\n");
+    emit("class %s {\n", name);
+    emit("private:\n");
+    emit("    enum {\n");
+    emit("        IP = 8, RP, SP,\n");
+    emit("        // what VM::isRegValid lets through as register 11: ZF is bit 0, CF bit 1\n");
+    emit("        FLAGS_REG, NUM_REGS = FLAGS_REG\n");
+    emit("    };\n");
+    emit("    static const uint32_t CODESIZE = %s, DATASIZE = %s, STACKSIZE = %s;\n",
+         hex(codesize).c_str(), hex(vm.as.getDatasize()).c_str(), hex(vm.as.getStacksize()).c_str());
+    emit("    // the AS_* options of the VM this was recompiled from\n");
+    emit("    static const uint8_t OPTIONS = 0x%02x;\n", vm.as.getOptions());
+    emit("\n    uint16_t regs[NUM_REGS + 1];\n");
+    emit("    VMAddrSpace as;\n");
+    emit("    uint32_t codeVersion;\n\n");
+    emit("    static uint16_t load(uint8_t *p) {\n");
+    emit("        uint16_t v;\n        memcpy(&v, p, sizeof(v));\n        return v;\n    }\n\n");
+    emit("    static void store(uint8_t *p, uint16_t v) {\n");
+    emit("        memcpy(p, &v, sizeof(v));\n    }\n\n");
+    emit("    // raises a high-water mark to end, see VMAddrSpace::markData\n");
+    emit("    static void mark(uint32_t &top, uint32_t end) {\n");
+    emit("        top = end > top ? end : top;\n    }\n\n");
+    emit("    // what the handlers' shifts do on x86: the count is taken modulo 32\n");
+    emit("    static uint16_t shl(uint16_t v, uint16_t n) {\n");
+    emit("        return (uint32_t) v << (n & 31);\n    }\n\n");
+    emit("    static uint16_t shr(uint16_t v, uint16_t n) {\n");
+    emit("        return (uint32_t) v >> (n & 31);\n    }\n\n");
+    emit("public:\n");
+    emit("    // with AS_WIDE the sizes given for data and stack are ignored\n");
+    emit("    %s() : as(STACKSIZE, CODESIZE, (uint16_t) DATASIZE, OPTIONS) {\n", name);
+    if (len > 0) {
+        emit("        static uint8_t code[] = {");
+        for (i = 0; i < len; i++) {
+            emit("%s0x%02x,", i % 12 ? " " : "\n                ", code[i]);
+        }
+        emit("\n        };\n");
+        emit("        as.insCode(code, sizeof(code));\n");
+    }
+    emit("        memset(regs, 0, sizeof(regs));\n");
+    emit("        codeVersion = as.getCodeVersion();\n    }\n\n");
+    emit("    VMAddrSpace *addressSpace() {\n        return &as;\n    }\n\n");
+    emit("    uint16_t reg(uint8_t reg) {\n");
+    emit("        if (reg >= NUM_REGS) {\n");
+    emit("            throw std::invalid_argument(\"Invalid register\");\n        }\n");
+    emit("        return regs[reg];\n    }\n\n");
+    emit("    void status(void) {\n#ifdef DBG\n");
+    emit("        static const char *names[] = {\"R0\", \"R1\", \"R2\", \"R3\", \"S0\", \"S1\", \"S2\", \"S3\",\n");
+    emit("                                      \"IP\", \"RP\", \"SP\"};\n");
+    emit("        DBG_SUCC((\"VM Status:\\n\"));\n");
+    emit("        DBG_SUCC((\"~~~~~~~~~~\\n\"));\n");
+    emit("        for (uint8_t i = 0; i < NUM_REGS; i++) {\n");
+    emit("            DBG_INFO((\"%%s:\\t0x%%04x\\n\", names[i], regs[i]));\n        }\n");
+    emit("        DBG_INFO((\"Flags: ZF = %%d, CF = %%d\\n\", regs[FLAGS_REG] & 1, regs[FLAGS_REG] >> 1 & 1));\n");
+    emit("        DBG_SUCC((\"~~~~~~~~~~\\n\"));\n#endif\n    }\n\n");
+
+    emit("    statuses run(uint64_t max_instructions = UINT64_MAX) {\n");
+    emit("        uint16_t r0 = regs[0], r1 = regs[1], r2 = regs[2], r3 = regs[3];\n");
+    emit("        uint16_t s0 = regs[4], s1 = regs[5], s2 = regs[6], s3 = regs[7];\n");
+    emit("        uint16_t ip = regs[IP], rp = regs[RP], sp = regs[SP];\n");
+    emit("        uint16_t fw = regs[FLAGS_REG] & ~3;\n");
+    emit("        bool zf = regs[FLAGS_REG] & 1, cf = regs[FLAGS_REG] >> 1 & 1;\n");
+    emit("        uint8_t *data = as.dataSection(), *stack = as.stackSection();\n");
+    emit("        uint32_t dataTop = 0, stackTop = 0;\n");
+    emit("        uint64_t left = max_instructions;\n\n");
+    emit("#define FLAGS ((uint16_t) (fw | zf | cf << 1))\n");
+    emit("#define SAVE(_ip_) do { \\\n");
+    emit("            regs[0] = r0; regs[1] = r1; regs[2] = r2; regs[3] = r3; \\\n");
+    emit("            regs[4] = s0; regs[5] = s1; regs[6] = s2; regs[7] = s3; \\\n");
+    emit("            regs[IP] = _ip_; regs[RP] = rp; regs[SP] = sp; regs[FLAGS_REG] = FLAGS; \\\n");
+    emit("            as.markData(dataTop); as.markStack(stackTop); \\\n");
+    emit("        } while (0)\n");
+    emit("        (void) data;\n        (void) stack;\n        (void) left;\n");
+    emit("        if (as.getCodeVersion() != codeVersion) {\n");
+    emit("            throw std::logic_error(\"The code section changed after recompilation.\");\n        }\n");
+    if (indirect) {
+        emit("    dispatch:\n");
+    }
+    emit("        switch (ip) {\n");
+    for (i = 0; i < codesize; i++) {
+        if (leader[i]) {
+            emit("        case %s:\n            goto L_%04x;\n", hex(i).c_str(), i);
+        } else if (start[i]) {
+            // where a previous run stopped inside a block
+            emit("        case %s:\n            goto C_%04x;\n", hex(i).c_str(), i);
+        }
+    }
+    emit("        default:\n");
+    emit("            // outside the code section\n");
+    emit("            goto out;\n");
+    emit("        }\n");
+    for (i = 0; i < codesize; i++) {
+        if (leader[i]) {
+            emitBlock(i);
+        }
+    }
+    if (halts) {
+        emit("    halted:\n");
+        emit("        SAVE(ip);\n");
+        emit("        return VM_HALTED;\n");
+    }
+    if (codesize > 0) {
+        emit("    exhausted:\n");
+        emit("        SAVE(ip);\n");
+        emit("        return VM_EXHAUSTED;\n");
+    }
+    emit("    out:\n");
+    emit("        SAVE(ip);\n");
+    emit("        return VM_FAULTED;\n");
+    emit("#undef SAVE\n#undef FLAGS\n");
+    emit("    }\n");
+    emit("};\n");
+
+    if (fwrite(out.data(), 1, out.size(), f) != out.size()) {
+        err = "can't write the translation unit";
+        return false;
+    }
+    return true;
+}
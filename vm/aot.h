@@ -0,0 +1,75 @@
+#ifndef AOT_H
+#define AOT_H
+
+#include "vm.h"
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+/*
+ * Ahead-of-time recompiler: turns the program loaded in a VM into a C++
+ * class with the same run()/reg()/addressSpace() API, where every guest
+ * basic block is a labelled block of plain C++ the host compiler optimizes
+ * as a whole. Its address space is built with the VM's own sizes and
+ * AS_* options. The generated class leaves its state, and returns the
+ * status, exactly as ENGINE_HANDLERS would, faults and instruction budgets
+ * included, except that a POOP with the
+ * stack empty, which the handlers let read outside it, stops there as a
+ * fault.
+ */
+class Recompiler {
+private:
+    // an instruction the way its exec* handler reads it
+    typedef struct insn {
+        uint8_t op;
+        uint8_t length;
+        uint8_t dst;
+        uint8_t src;
+        uint16_t imm;
+    } insn_t;
+
+    VM &vm;
+    uint32_t codesize;
+    std::vector<bool> leader;
+    // where an instruction of some block starts, and which ones got their counted label
+    std::vector<bool> start, labelled;
+    // whether the program has JMPR or RETN, which go through the dispatch switch
+    bool indirect;
+    // whether some SHIT can be reached
+    bool halts;
+    std::string out, err;
+
+    uint8_t decode(uint32_t ip, insn_t *in);
+
+    bool faults(uint32_t ip, insn_t *in);
+
+    bool endsBlock(uint32_t ip, insn_t *in);
+
+    bool findBlocks(void);
+
+    void blockOf(uint32_t ip, std::vector<uint32_t> &ips);
+
+    void emitAssign(uint8_t reg, const std::string &value);
+
+    void emitJump(uint32_t target);
+
+    void emitBlock(uint32_t ip);
+
+    bool emitInstr(uint32_t ip, insn_t *in);
+
+    void emit(const char *fmt, ...);
+
+public:
+    Recompiler(VM &vm);
+
+    /*
+     * Writes the translation unit for a class called name. Returns false,
+     * with error() telling why, for the programs which would make the VM
+     * read outside its own memory.
+     */
+    bool recompile(FILE *f, const char *name);
+
+    const char *error(void);
+};
+
+#endif
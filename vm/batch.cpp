@@ -0,0 +1,526 @@
+#include "batch.h"
+#include <string.h>
+#include <stdexcept>
+
+// a vector comparison, all ones where it holds
+#define MASK(_cond_) ((lanes_t) (_cond_))
+#define DST (g.r[d->dst])
+#define SRC (g.r[d->src])
+// writes _value_ to DST in the running lanes only
+#define SET(_value_) (DST = pick(m, (_value_), DST))
+
+static inline __attribute__((always_inline)) lanes_t splat(uint16_t value) {
+    lanes_t v = {};
+
+    return v + value;
+}
+
+static inline __attribute__((always_inline)) lanes_t pick(lanes_t m, lanes_t a, lanes_t b) {
+    return (a & m) | (b & ~m);
+}
+
+static inline __attribute__((always_inline)) bool none(const lanes_t &m) {
+    uint64_t words[sizeof(m) / sizeof(uint64_t)], any = 0;
+    uint32_t i;
+
+    memcpy(words, &m, sizeof(m));
+    for (i = 0; i < sizeof(m) / sizeof(uint64_t); i++) {
+        any |= words[i];
+    }
+    return any == 0;
+}
+
+// the lowest value among the lanes of m
+static inline __attribute__((always_inline)) uint32_t lowest(const lanes_t &addr, const lanes_t &m) {
+    lanes_t v = pick(m, addr, splat(0xffff));
+    uint16_t cur = 0xffff;
+    uint32_t l;
+
+    for (l = 0; l < BATCH_LANES; l++) {
+        cur = v[l] < cur ? v[l] : cur;
+    }
+    return cur;
+}
+
+// lanes where addr + 2 >= size, the bounds check of the handlers
+static inline __attribute__((always_inline)) lanes_t outside(lanes_t addr, uint32_t size) {
+    if (size < sizeof(uint16_t)) {
+        return splat(0xffff);
+    }
+    if (size - sizeof(uint16_t) > 0xffff) {
+        return splat(0);
+    }
+    return MASK(addr >= (uint16_t) (size - sizeof(uint16_t)));
+}
+
+BatchVM::BatchVM(uint8_t *key, uint8_t *code, uint32_t codesize, uint32_t lanes) : vm(key, code, codesize),
+                                                                                     lanes(lanes) {
+    lanes_t zero = {};
+    uint32_t i, l;
+
+    this->codesize = vm.as.getCodesize();
+    datasize = vm.as.getDatasize();
+    stacksize = vm.as.getStacksize();
+    groups.resize((lanes + BATCH_LANES - 1) / BATCH_LANES);
+    for (i = 0; i < groups.size(); i++) {
+        group_t &g = groups[i];
+
+        for (l = R0; l <= S3; l++) {
+            g.r[l] = zero;
+        }
+        g.ip = g.rp = g.sp = zero;
+        g.zf = g.cf = g.fw = zero;
+        for (l = 0; l < BATCH_LANES; l++) {
+            g.live[l] = i * BATCH_LANES + l < lanes ? 0xffff : 0;
+        }
+        g.data.assign(datasize * BATCH_LANES, 0);
+        g.stack.assign(stacksize * BATCH_LANES, 0);
+    }
+    results.assign(lanes, VM_EXHAUSTED);
+    decoded.assign(this->codesize, {VM::DEC_UNDECODED, 0, 0, 0, 0, 0, 0, 0});
+}
+
+bool BatchVM::insData(uint32_t lane, uint8_t *buf, uint32_t size) {
+    uint32_t a;
+
+    if (lane >= lanes || size > datasize) {
+        DBG_ERROR(("The injected data size is too big!\n"));
+        return false;
+    }
+    for (a = 0; a < size; a++) {
+        groups[lane / BATCH_LANES].data[a * BATCH_LANES + lane % BATCH_LANES] = buf[a];
+    }
+    return true;
+}
+
+uint16_t BatchVM::reg(uint32_t lane, uint8_t reg) {
+    group_t &g = groups.at(lane / BATCH_LANES);
+    uint32_t l = lane % BATCH_LANES;
+
+    switch (reg) {
+    case IP:
+        return g.ip[l];
+    case RP:
+        return g.rp[l];
+    case SP:
+        return g.sp[l];
+    default:
+        if (reg > S3) {
+            throw std::invalid_argument("Invalid register");
+        }
+        return g.r[reg][l];
+    }
+}
+
+statuses BatchVM::status(uint32_t lane) {
+    return results.at(lane);
+}
+
+void BatchVM::getData(uint32_t lane, uint8_t *buf) {
+    group_t &g = groups.at(lane / BATCH_LANES);
+    uint32_t a;
+
+    for (a = 0; a < datasize; a++) {
+        buf[a] = g.data[a * BATCH_LANES + lane % BATCH_LANES];
+    }
+    return;
+}
+
+void BatchVM::getStack(uint32_t lane, uint8_t *buf) {
+    group_t &g = groups.at(lane / BATCH_LANES);
+    uint32_t a;
+
+    for (a = 0; a < stacksize; a++) {
+        buf[a] = g.stack[a * BATCH_LANES + lane % BATCH_LANES];
+    }
+    return;
+}
+
+VM::decoded_t *BatchVM::decode(uint16_t ip) {
+    if (decoded[ip].op == VM::DEC_UNDECODED) {
+        vm.decodeOne(ip, &decoded[ip]);
+    }
+    return &decoded[ip];
+}
+
+void BatchVM::stop(group_t &g, uint32_t first, const lanes_t &m, statuses status) {
+    uint32_t l;
+
+    if (none(m)) {
+        return;
+    }
+    g.live &= ~m;
+    for (l = 0; l < BATCH_LANES; l++) {
+        if (m[l]) {
+            results[first + l] = status;
+        }
+    }
+    return;
+}
+
+/*
+ * Runs the instruction at IP through its handler, one lane of m at a time,
+ * in vm loaded with the whole state of the lane.
+ */
+void BatchVM::slow(group_t &g, uint32_t first, const lanes_t &m) {
+    const VM::instruction_t *instr_p;
+    uint16_t word;
+    uint32_t l, i;
+    bool ok;
+
+    if (none(m)) {
+        return;
+    }
+    for (l = 0; l < BATCH_LANES; l++) {
+        if (!m[l]) {
+            continue;
+        }
+        for (i = R0; i <= S3; i++) {
+            vm.regs[i] = g.r[i][l];
+        }
+        vm.regs[IP] = g.ip[l];
+        vm.regs[RP] = g.rp[l];
+        vm.regs[SP] = g.sp[l];
+        word = g.fw[l];
+        memcpy(&vm.flags, &word, sizeof(word));
+        vm.flags.ZF = g.zf[l] & 1;
+        vm.flags.CF = g.cf[l] & 1;
+        for (i = 0; i < datasize; i++) {
+            vm.as.getData()[i] = g.data[i * BATCH_LANES + l];
+        }
+        for (i = 0; i < stacksize; i++) {
+            vm.as.getStack()[i] = g.stack[i * BATCH_LANES + l];
+        }
+
+        instr_p = vm.DECODE[vm.as.getCode()[vm.regs[IP]]];
+        ok = (vm.*(instr_p->exec))();
+        if (ok && !instr_p->isJump) {
+            vm.regs[IP] += instr_p->length;
+        }
+
+        for (i = R0; i <= S3; i++) {
+            g.r[i][l] = vm.regs[i];
+        }
+        g.ip[l] = vm.regs[IP];
+        g.rp[l] = vm.regs[RP];
+        g.sp[l] = vm.regs[SP];
+        memcpy(&word, &vm.flags, sizeof(word));
+        g.fw[l] = word;
+        g.zf[l] = vm.flags.ZF ? 0xffff : 0;
+        g.cf[l] = vm.flags.CF ? 0xffff : 0;
+        for (i = 0; i < datasize; i++) {
+            g.data[i * BATCH_LANES + l] = vm.as.getData()[i];
+        }
+        for (i = 0; i < stacksize; i++) {
+            g.stack[i * BATCH_LANES + l] = vm.as.getStack()[i];
+        }
+        if (!ok) {
+            DBG_ERROR(("%s failed.\n", instr_p->name));
+            g.live[l] = 0;
+            results[first + l] = VM_FAULTED;
+        }
+    }
+    return;
+}
+
+/*
+ * The 16 bit words at addr in the lanes of m. When all of them read the
+ * same address it is two rows of bytes, one vector each.
+ */
+void BatchVM::load(std::vector<uint8_t> &mem, const lanes_t &addr, const lanes_t &m, lanes_t &value) {
+    lane_bytes_t lo, hi;
+    uint32_t l, a;
+
+    value = lanes_t{};
+    if (none(m)) {
+        return;
+    }
+    a = lowest(addr, m);
+    if (none(m & MASK(addr != (uint16_t) a))) {
+        memcpy(&lo, &mem[a * BATCH_LANES], sizeof(lo));
+        memcpy(&hi, &mem[(a + 1) * BATCH_LANES], sizeof(hi));
+        value = __builtin_convertvector(lo, lanes_t) | __builtin_convertvector(hi, lanes_t) << 8;
+        return;
+    }
+    for (l = 0; l < BATCH_LANES; l++) {
+        if (m[l]) {
+            a = addr[l];
+            value[l] = mem[a * BATCH_LANES + l] | mem[(a + 1) * BATCH_LANES + l] << 8;
+        }
+    }
+    return;
+}
+
+void BatchVM::store(std::vector<uint8_t> &mem, const lanes_t &addr, const lanes_t &value, const lanes_t &m) {
+    lane_bytes_t lo, hi, old, m8;
+    uint32_t l, a;
+
+    if (none(m)) {
+        return;
+    }
+    a = lowest(addr, m);
+    if (none(m & MASK(addr != (uint16_t) a))) {
+        m8 = __builtin_convertvector(m, lane_bytes_t);
+        lo = __builtin_convertvector(value, lane_bytes_t);
+        hi = __builtin_convertvector(value >> 8, lane_bytes_t);
+        memcpy(&old, &mem[a * BATCH_LANES], sizeof(old));
+        old = (lo & m8) | (old & ~m8);
+        memcpy(&mem[a * BATCH_LANES], &old, sizeof(old));
+        memcpy(&old, &mem[(a + 1) * BATCH_LANES], sizeof(old));
+        old = (hi & m8) | (old & ~m8);
+        memcpy(&mem[(a + 1) * BATCH_LANES], &old, sizeof(old));
+        return;
+    }
+    for (l = 0; l < BATCH_LANES; l++) {
+        if (m[l]) {
+            a = addr[l];
+            mem[a * BATCH_LANES + l] = value[l] & 0xff;
+            mem[(a + 1) * BATCH_LANES + l] = value[l] >> 8;
+        }
+    }
+    return;
+}
+
+/*
+ * Every instruction does what its runFast body does, on the lanes of m:
+ * the lanes which would fault stop there, the ones runFast would hand to
+ * the handlers go through slow.
+ */
+void BatchVM::runGroup(group_t &g, uint32_t first) {
+    VM::decoded_t *d;
+    lanes_t m, f, t, a, b;
+    uint32_t l, cur, target;
+
+    while (!none(g.live)) {
+        cur = lowest(g.ip, g.live);
+        m = g.live & MASK(g.ip == (uint16_t) cur);
+        if (cur >= codesize) {
+            DBG_ERROR(("Out of bounds: IP is outside the code section.\n"));
+            stop(g, first, m, VM_FAULTED);
+            continue;
+        }
+        d = decode(cur);
+        switch (d->op) {
+        case MOVI:
+            SET(splat(d->imm));
+            break;
+        case MOVR:
+            SET(SRC);
+            break;
+        case LODI:
+            if (d->imm + sizeof(uint16_t) >= datasize) {
+                stop(g, first, m, VM_FAULTED);
+                continue;
+            }
+            load(g.data, splat(d->imm), m, a);
+            SET(a);
+            break;
+        case LODR:
+            f = m & outside(SRC, datasize);
+            stop(g, first, f, VM_FAULTED);
+            m &= ~f;
+            load(g.data, SRC, m, a);
+            SET(a);
+            break;
+        case STRI:
+            if (d->imm + sizeof(uint16_t) >= datasize) {
+                stop(g, first, m, VM_FAULTED);
+                continue;
+            }
+            store(g.data, splat(d->imm), SRC, m);
+            break;
+        case STRR:
+            f = m & outside(DST, datasize);
+            stop(g, first, f, VM_FAULTED);
+            m &= ~f;
+            store(g.data, DST, SRC, m);
+            break;
+        case ADDI:
+            SET(DST + d->imm);
+            break;
+        case ADDR:
+            SET(DST + SRC);
+            break;
+        case SUBI:
+            SET(DST - d->imm);
+            break;
+        case SUBR:
+            SET(DST - SRC);
+            break;
+        case ANDB:
+            SET(DST & d->src);
+            break;
+        case ANDW:
+            SET(DST & d->imm);
+            break;
+        case ANDR:
+            SET(DST & SRC);
+            break;
+        case YORB:
+            SET(DST | d->src);
+            break;
+        case YORW:
+            SET(DST | d->imm);
+            break;
+        case YORR:
+            SET(DST | SRC);
+            break;
+        case XORB:
+            SET(DST ^ d->src);
+            break;
+        case XORW:
+            SET(DST ^ d->imm);
+            break;
+        case XORR:
+            SET(DST ^ SRC);
+            break;
+        case NOTR:
+            SET(~SRC);
+            break;
+        case MULI:
+            SET(DST * d->imm);
+            break;
+        case MULR:
+            SET(DST * SRC);
+            break;
+        case DIVI:
+            if (d->imm == 0) {
+                stop(g, first, m, VM_FAULTED);
+                continue;
+            }
+            SET(DST / d->imm);
+            break;
+        case DIVR:
+            // execDIVR only looks at the lower byte of the divisor
+            f = m & MASK((SRC & 0xff) == 0);
+            stop(g, first, f, VM_FAULTED);
+            m &= ~f;
+            SET(DST / pick(m, SRC, splat(1)));
+            break;
+        /*
+         * Shifting by 16 or more is left to the handlers, as in runFast.
+         */
+        case SHLI:
+        case SHRI:
+            if (d->imm > 15) {
+                slow(g, first, m);
+                continue;
+            }
+            SET(d->op == SHLI ? DST << d->imm : DST >> d->imm);
+            break;
+        case SHLR:
+        case SHRR:
+            t = m & MASK(SRC > 15);
+            slow(g, first, t);
+            m &= ~t;
+            a = SRC & 15;
+            SET(d->op == SHLR ? DST << a : DST >> a);
+            break;
+        case PUSH:
+            f = m & outside(g.sp, stacksize);
+            stop(g, first, f, VM_FAULTED);
+            m &= ~f;
+            store(g.stack, g.sp, DST, m);
+            g.sp = pick(m, g.sp + sizeof(uint16_t), g.sp);
+            break;
+        case POOP:
+            // execPOOP does not catch underflows, let it deal with them
+            t = m & MASK(g.sp < sizeof(uint16_t));
+            if (stacksize < 0xffff) {
+                t |= m & MASK(g.sp > (uint16_t) stacksize);
+            }
+            slow(g, first, t);
+            m &= ~t;
+            g.sp = pick(m, g.sp - sizeof(uint16_t), g.sp);
+            load(g.stack, g.sp, m, a);
+            SET(a);
+            break;
+        case CMPB:
+            a = DST & 0xff;
+            b = splat(d->src);
+            g.zf = pick(m, MASK(a == b), g.zf);
+            g.cf = pick(m, MASK(a <= b), g.cf);
+            break;
+        case CMPW:
+            g.zf = pick(m, MASK(DST == d->imm), g.zf);
+            g.cf = pick(m, MASK(DST <= d->imm), g.cf);
+            break;
+        case CMPR:
+            g.zf = pick(m, MASK(DST == SRC), g.zf);
+            g.cf = pick(m, MASK(DST <= SRC), g.cf);
+            break;
+        case JMPI:
+            g.ip = pick(m, splat(d->imm), g.ip);
+            continue;
+        case JMPR:
+            g.ip = pick(m, DST, g.ip);
+            continue;
+        /*
+         * As in the handlers, the register-based conditional jumps land on
+         * the register number, not on its content.
+         */
+        case JPAI:
+        case JPAR:
+        case JPBI:
+        case JPBR:
+        case JPEI:
+        case JPER:
+        case JPNI:
+        case JPNR:
+            if (d->op <= JPAR) {
+                t = ~g.cf & ~g.zf;
+            } else if (d->op <= JPBR) {
+                t = g.cf;
+            } else if (d->op <= JPER) {
+                t = g.zf;
+            } else {
+                t = ~g.zf;
+            }
+            target = (d->op - JPAI) % 2 == 0 ? d->imm : d->dst;
+            g.ip = pick(m & t, splat(target), pick(m, splat(cur + d->length), g.ip));
+            continue;
+        case CALL:
+            if (cur + CALL_SIZE >= codesize) {
+                stop(g, first, m, VM_FAULTED);
+                continue;
+            }
+            f = m & outside(g.sp, stacksize);
+            stop(g, first, f, VM_FAULTED);
+            m &= ~f;
+            store(g.stack, g.sp, splat(cur + CALL_SIZE), m);
+            g.rp = pick(m, splat(cur + CALL_SIZE), g.rp);
+            g.sp = pick(m, g.sp + sizeof(uint16_t), g.sp);
+            g.ip = pick(m, splat(d->imm), g.ip);
+            continue;
+        case RETN:
+            g.sp = pick(m, g.sp - sizeof(uint16_t), g.sp);
+            g.ip = pick(m, g.rp, g.ip);
+            continue;
+        case GRMN:
+            for (l = R0; l <= S3; l++) {
+                g.r[l] = pick(m, splat(0x4747), g.r[l]);
+            }
+            break;
+        case NOPE:
+            break;
+        case SHIT:
+            DBG_INFO(("SHIT\n"));
+            stop(g, first, m, VM_HALTED);
+            continue;
+        default:
+            slow(g, first, m);
+            continue;
+        }
+        g.ip = pick(m, splat(cur + d->length), g.ip);
+    }
+    return;
+}
+
+void BatchVM::run(void) {
+    uint32_t i;
+
+    for (i = 0; i < groups.size(); i++) {
+        runGroup(groups[i], i * BATCH_LANES);
+    }
+    return;
+}
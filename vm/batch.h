@@ -0,0 +1,83 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "vm.h"
+#include <vector>
+
+// lanes run by a single vector operation
+#define BATCH_LANES 16
+
+/*
+ * One uint16_t per lane, an AVX2 register when built with -mavx2.
+ */
+typedef uint16_t lanes_t __attribute__((vector_size(BATCH_LANES * sizeof(uint16_t))));
+typedef uint8_t lane_bytes_t __attribute__((vector_size(BATCH_LANES)));
+
+/*
+ * Runs one program over many data sections at once. Lanes are packed
+ * BATCH_LANES at a time in groups holding every register as a lanes_t and
+ * the data and stack sections interleaved byte by byte, so that the
+ * instruction stream is fetched once for the whole group and most
+ * instructions are a single vector operation.
+ *
+ * Lanes going different ways are masked off: the group always runs the
+ * lowest IP among its lanes, with the lanes sitting there, so they meet
+ * again as soon as they get to the same address. Every lane ends exactly
+ * as a VM running the same program over its data section would, faults
+ * included.
+ */
+class BatchVM {
+private:
+    typedef struct group {
+        lanes_t r[S3 + 1];
+        lanes_t ip, rp, sp;
+        // all ones where the flag is set
+        lanes_t zf, cf;
+        // register 11: the byte after the flags in VM, see VM::isRegValid
+        lanes_t fw;
+        // all ones for the lanes still running
+        lanes_t live;
+        // byte a of lane l at [a * BATCH_LANES + l]
+        std::vector<uint8_t> data, stack;
+    } group_t;
+
+    // decode tables, and one lane at a time for whatever goes to the handlers
+    VM vm;
+    uint32_t lanes, codesize, datasize, stacksize;
+    std::vector<group_t> groups;
+    std::vector<statuses> results;
+    std::vector<VM::decoded_t> decoded;
+
+    VM::decoded_t *decode(uint16_t ip);
+
+    void stop(group_t &g, uint32_t first, const lanes_t &m, statuses status);
+
+    void slow(group_t &g, uint32_t first, const lanes_t &m);
+
+    void load(std::vector<uint8_t> &mem, const lanes_t &addr, const lanes_t &m, lanes_t &value);
+
+    void store(std::vector<uint8_t> &mem, const lanes_t &addr, const lanes_t &value, const lanes_t &m);
+
+    void runGroup(group_t &g, uint32_t first);
+
+public:
+    BatchVM(uint8_t *key, uint8_t *code, uint32_t codesize, uint32_t lanes);
+
+    // as VMAddrSpace::insData, for a single lane
+    bool insData(uint32_t lane, uint8_t *buf, uint32_t size);
+
+    // runs every lane until SHIT or a fault
+    void run(void);
+
+    uint16_t reg(uint32_t lane, uint8_t reg);
+
+    // VM_HALTED or VM_FAULTED once run, VM_EXHAUSTED before
+    statuses status(uint32_t lane);
+
+    // copies the data section of lane to buf
+    void getData(uint32_t lane, uint8_t *buf);
+
+    void getStack(uint32_t lane, uint8_t *buf);
+};
+
+#endif
@@ -0,0 +1,43 @@
+#include "interleave.h"
+#include <stdexcept>
+
+Interleaver::Interleaver(uint32_t k, uint64_t slice) : k(k), slice(slice) {
+    if (k == 0 || slice == 0) {
+        throw std::invalid_argument("Nothing would ever run");
+    }
+}
+
+void Interleaver::add(VM *vm, statuses *status) {
+    waiting.push_back({vm, status});
+    return;
+}
+
+void Interleaver::run(void) {
+    statuses status;
+    uint32_t i;
+
+    while (running.size() < k && !waiting.empty()) {
+        running.push_back(waiting.front());
+        waiting.pop_front();
+    }
+    while (!running.empty()) {
+        for (i = 0; i < running.size();) {
+            status = running[i].vm->run(slice);
+            if (status == VM_EXHAUSTED) {
+                i++;
+                continue;
+            }
+            if (running[i].status) {
+                *running[i].status = status;
+            }
+            // the next one waiting takes its place in the round
+            if (!waiting.empty()) {
+                running[i] = waiting.front();
+                waiting.pop_front();
+            } else {
+                running.erase(running.begin() + i);
+            }
+        }
+    }
+    return;
+}
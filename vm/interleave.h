@@ -0,0 +1,36 @@
+#ifndef INTERLEAVE_H
+#define INTERLEAVE_H
+
+#include "vm.h"
+#include <deque>
+#include <vector>
+
+/*
+ * Runs many VMs on one thread, k of them at a time: every VM in flight
+ * runs slice instructions in turn, so the host always has work from k
+ * unrelated programs going. A VM ending makes room for the next one
+ * added. VMs are not owned and keep their own engine.
+ */
+class Interleaver {
+private:
+    typedef struct task {
+        VM *vm;
+        // where to write how it ended, may be NULL
+        statuses *status;
+    } task_t;
+
+    uint32_t k;
+    uint64_t slice;
+    std::deque<task_t> waiting;
+    std::vector<task_t> running;
+
+public:
+    Interleaver(uint32_t k, uint64_t slice = 64);
+
+    void add(VM *vm, statuses *status = NULL);
+
+    // runs every VM added so far until SHIT or a fault
+    void run(void);
+};
+
+#endif
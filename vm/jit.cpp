@@ -0,0 +1,1456 @@
+#include "vm.h"
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__linux__)
+#define JIT_SUPPORTED
+#include <sys/mman.h>
+#endif
+
+/*
+ * Baseline JIT for x86-64 Linux. Every basic block (see VM::decodeBlock) is
+ * compiled once into the code cache, the first time control gets there.
+ *
+ * Host registers while native code runs:
+ *   r8d -> r15d   R0 -> S3, always holding zero-extended 16 bit values
+ *   esi           SP
+ *   rbx           the jit_context_t
+ *   rbp, rdi      data and stack sections
+ *   eax, ecx, edx scratch
+ * RP and the flags stay in the context.
+ *
+ * A block leaves native code through the exit stub with the reason in
+ * ctx->exit. Whatever runFast hands to the exec* handlers is handed back to
+ * runJIT in the same way, so faults and quirks stay those of
+ * ENGINE_HANDLERS. An exit towards a fixed address is patched to jump
+ * straight to the block there, once it is compiled.
+ *
+ * Every block pays for all of its instructions out of ctx->budget when it
+ * is entered, and leaves with JIT_BUDGET instead when it can't. Leaving
+ * before the end gives back what did not run.
+ */
+
+// records compiled in a single go, longer blocks are split
+#define JIT_MAXRECORDS 512
+// upper bound of the native code of a single record
+#define JIT_RECORDSIZE 256
+#define JIT_BLOCKSIZE ((JIT_MAXRECORDS + 1) * JIT_RECORDSIZE)
+
+CodeCache::CodeCache(uint32_t size) {
+    this->base = NULL;
+    this->top = NULL;
+    this->size = size;
+    this->writing = false;
+}
+
+CodeCache::~CodeCache() {
+#ifdef JIT_SUPPORTED
+    if (base != NULL) {
+        munmap(base, size);
+    }
+#endif
+}
+
+bool CodeCache::map(void) {
+#ifdef JIT_SUPPORTED
+    void *mem;
+
+    if (base != NULL) {
+        return true;
+    }
+    mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        DBG_ERROR(("Can't map the JIT code cache.\n"));
+        return false;
+    }
+    // where memory can't be made executable, better find out before compiling anything
+    if (mprotect(mem, size, PROT_READ | PROT_EXEC) != 0) {
+        DBG_ERROR(("Can't make the JIT code cache executable.\n"));
+        munmap(mem, size);
+        return false;
+    }
+    base = (uint8_t *) mem;
+    top = base;
+    writing = false;
+    return true;
+#else
+    return false;
+#endif
+}
+
+void CodeCache::flush(void) {
+    top = base;
+    return;
+}
+
+bool CodeCache::beginWrite(void) {
+#ifdef JIT_SUPPORTED
+    if (!writing && mprotect(base, size, PROT_READ | PROT_WRITE) != 0) {
+        DBG_ERROR(("Can't make the JIT code cache writable.\n"));
+        return false;
+    }
+#endif
+    writing = true;
+    return true;
+}
+
+void CodeCache::endWrite(void) {
+#ifdef JIT_SUPPORTED
+    if (writing && mprotect(base, size, PROT_READ | PROT_EXEC) != 0) {
+        DBG_ERROR(("Can't make the JIT code cache executable.\n"));
+    }
+#endif
+    writing = false;
+    return;
+}
+
+uint8_t *CodeCache::getTop() {
+    return top;
+}
+
+void CodeCache::setTop(uint8_t *top) {
+    this->top = top;
+    return;
+}
+
+uint32_t CodeCache::getFree() {
+    return size - (top - base);
+}
+
+#ifdef JIT_SUPPORTED
+
+enum jit_exits {
+    // towards a fixed address, ctx->patch is the jump to link
+    JIT_CHAIN,
+    // as JIT_CHAIN, jumping backwards
+    JIT_BACKEDGE,
+    // towards a computed address
+    JIT_LOOKUP,
+    // the instruction at ctx->ip has to go through its handler
+    JIT_SLOW,
+    JIT_FAULT,
+    JIT_SHIT,
+    // not enough budget left to run the block at ctx->ip
+    JIT_BUDGET
+};
+
+typedef struct jit_context {
+    uint8_t *data;
+    uint8_t *stack;
+    uint8_t *patch;
+    uint64_t budget;
+    uint32_t ip;
+    uint32_t exit;
+    // high-water marks of the stores, see VMAddrSpace::markData
+    uint32_t dataTop;
+    uint32_t stackTop;
+    uint16_t r[S3 + 1];
+    uint16_t rp;
+    uint16_t sp;
+    uint8_t zf;
+    uint8_t cf;
+} jit_context_t;
+
+typedef void (*jit_entry_t)(jit_context_t *ctx, uint8_t *code);
+
+#define CTX(_field_) ((int32_t) offsetof(jit_context_t, _field_))
+#define CTX_R(_reg_) (CTX(r) + (_reg_) * (int32_t) sizeof(uint16_t))
+
+enum hostregs {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15, NOREG = 0xff
+};
+// condition codes, flipping the lowest bit negates them
+enum conds {
+    CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_BE = 0x6, CC_A = 0x7
+};
+// operand size prefixes
+#define REX_W 1
+#define OP16 2
+
+#define HOST(_reg_) (R8 + (_reg_))
+
+/*
+ * Bare x86-64 encoder, just what compile needs. Memory operands are always
+ * emitted as [base + index + disp32] through a SIB byte.
+ */
+class Emitter {
+public:
+    uint8_t *p;
+    // instructions paid for which do not run when leaving from here
+    uint32_t refund;
+
+    Emitter(uint8_t *at) : p(at), refund(0) {}
+
+    void u8(uint8_t v) {
+        *p++ = v;
+    }
+
+    void u16(uint16_t v) {
+        memcpy(p, &v, sizeof(v));
+        p += sizeof(v);
+    }
+
+    void u32(uint32_t v) {
+        memcpy(p, &v, sizeof(v));
+        p += sizeof(v);
+    }
+
+    void u64(uint64_t v) {
+        memcpy(p, &v, sizeof(v));
+        p += sizeof(v);
+    }
+
+    // OP reg, rm with rm a register. reg may be an opcode extension
+    void rr(uint32_t opcode, uint8_t reg, uint8_t rm, uint8_t flags = 0) {
+        prefix(flags, reg, NOREG, rm);
+        op(opcode);
+        u8(0xc0 | (reg & 7) << 3 | (rm & 7));
+    }
+
+    // OP reg, [base + index + disp]
+    void rm(uint32_t opcode, uint8_t reg, uint8_t base, uint8_t index, int32_t disp, uint8_t flags = 0) {
+        prefix(flags, reg, index, base);
+        op(opcode);
+        u8(0x80 | (reg & 7) << 3 | RSP);
+        u8((index == NOREG ? RSP : index & 7) << 3 | (base & 7));
+        u32(disp);
+    }
+
+    void movImm(uint8_t reg, uint32_t imm) {
+        prefix(0, 0, NOREG, reg);
+        u8(0xb8 | (reg & 7));
+        u32(imm);
+    }
+
+    void movAbs(uint8_t reg, uint64_t imm) {
+        prefix(REX_W, 0, NOREG, reg);
+        u8(0xb8 | (reg & 7));
+        u64(imm);
+    }
+
+    // zero-extends the lower 16 bits of reg
+    void zext(uint8_t reg) {
+        rr(0x0fb7, reg, reg);
+    }
+
+    void push(uint8_t reg) {
+        prefix(0, 0, NOREG, reg);
+        u8(0x50 | (reg & 7));
+    }
+
+    void pop(uint8_t reg) {
+        prefix(0, 0, NOREG, reg);
+        u8(0x58 | (reg & 7));
+    }
+
+    void ret(void) {
+        u8(0xc3);
+    }
+
+    // the rel32 to fill with link or land
+    uint8_t *jmp(void) {
+        u8(0xe9);
+        u32(0);
+        return p - sizeof(uint32_t);
+    }
+
+    uint8_t *jcc(uint8_t cc) {
+        u8(0x0f);
+        u8(0x80 | cc);
+        u32(0);
+        return p - sizeof(uint32_t);
+    }
+
+    static void link(uint8_t *rel, uint8_t *target) {
+        int32_t disp = target - (rel + sizeof(uint32_t));
+
+        memcpy(rel, &disp, sizeof(disp));
+        return;
+    }
+
+    void land(uint8_t *rel) {
+        link(rel, p);
+        return;
+    }
+
+private:
+    void prefix(uint8_t flags, uint8_t reg, uint8_t index, uint8_t base) {
+        uint8_t rex = 0x40;
+
+        if (flags & OP16) {
+            u8(0x66);
+        }
+        if (flags & REX_W) {
+            rex |= 0b1000;
+        }
+        if (reg & 0b1000) {
+            rex |= 0b0100;
+        }
+        if (index != NOREG && index & 0b1000) {
+            rex |= 0b0010;
+        }
+        if (base & 0b1000) {
+            rex |= 0b0001;
+        }
+        if (rex != 0x40) {
+            u8(rex);
+        }
+    }
+
+    void op(uint32_t opcode) {
+        if (opcode > 0xff) {
+            u8(opcode >> 8);
+        }
+        u8(opcode & 0xff);
+    }
+};
+
+static void emitRefund(Emitter &e) {
+    if (e.refund > 0) {
+        e.rm(0x81, 0, RBX, NOREG, CTX(budget), REX_W);
+        e.u32(e.refund);
+    }
+    return;
+}
+
+static void emitExit(Emitter &e, uint8_t *stub, uint32_t reason, uint32_t ip) {
+    emitRefund(e);
+    e.rm(0xc7, 0, RBX, NOREG, CTX(ip));
+    e.u32(ip);
+    e.rm(0xc7, 0, RBX, NOREG, CTX(exit));
+    e.u32(reason);
+    Emitter::link(e.jmp(), stub);
+    return;
+}
+
+// exit with the address in eax
+static void emitExitTo(Emitter &e, uint8_t *stub, uint32_t reason) {
+    emitRefund(e);
+    e.rm(0x89, RAX, RBX, NOREG, CTX(ip));
+    e.rm(0xc7, 0, RBX, NOREG, CTX(exit));
+    e.u32(reason);
+    Emitter::link(e.jmp(), stub);
+    return;
+}
+
+// exit only when cc holds
+static void emitExitIf(Emitter &e, uint8_t *stub, uint8_t cc, uint32_t reason, uint32_t ip) {
+    uint8_t *skip = e.jcc(cc ^ 1);
+
+    emitExit(e, stub, reason, ip);
+    e.land(skip);
+    return;
+}
+
+/*
+ * Goes to ip through the exit stub, until runJIT links the final jump to
+ * the block there.
+ */
+static void emitChain(Emitter &e, uint8_t *stub, uint32_t ip, uint32_t reason) {
+    uint8_t *site, *imm;
+    uint64_t addr;
+
+    emitRefund(e);
+    e.rm(0xc7, 0, RBX, NOREG, CTX(ip));
+    e.u32(ip);
+    e.rm(0xc7, 0, RBX, NOREG, CTX(exit));
+    e.u32(reason);
+    e.movAbs(RAX, 0);
+    imm = e.p - sizeof(uint64_t);
+    e.rm(0x89, RAX, RBX, NOREG, CTX(patch), REX_W);
+    site = e.jmp();
+    Emitter::link(site, stub);
+    addr = (uintptr_t) site;
+    memcpy(imm, &addr, sizeof(addr));
+    return;
+}
+
+// eax = reg + 2, compared to limit
+/*
+ * Compares reg + 2 with limit, leaving the exit on CC_AE to the caller.
+ * False when nothing was emitted: no 16 bit address gets past a
+ * WIDE_SEGMENT.
+ */
+static bool emitBoundsCheck(Emitter &e, uint8_t reg, uint32_t limit) {
+    if (limit >= WIDE_SEGMENT) {
+        return false;
+    }
+    e.rm(0x8d, RAX, reg, NOREG, sizeof(uint16_t));
+    e.rr(0x81, 7, RAX);
+    e.u32(limit);
+    return true;
+}
+
+/*
+ * Raises the high-water mark at field of the context to reg + 2, the byte
+ * past the store at reg.
+ */
+static void emitMark(Emitter &e, uint8_t reg, int32_t field) {
+    uint8_t *below;
+
+    e.rm(0x8d, RAX, reg, NOREG, sizeof(uint16_t));
+    e.rm(0x39, RAX, RBX, NOREG, field);
+    below = e.jcc(CC_AE);
+    e.rm(0x89, RAX, RBX, NOREG, field);
+    e.land(below);
+    return;
+}
+
+// as emitMark, for a store at a constant address
+static void emitMarkImm(Emitter &e, uint32_t addr, int32_t field) {
+    uint8_t *below;
+
+    e.rm(0x81, 7, RBX, NOREG, field);
+    e.u32(addr + sizeof(uint16_t));
+    below = e.jcc(CC_AE);
+    e.rm(0xc7, 0, RBX, NOREG, field);
+    e.u32(addr + sizeof(uint16_t));
+    e.land(below);
+    return;
+}
+
+static void emitSetFlags(Emitter &e) {
+    e.rm(0x0f94, 0, RBX, NOREG, CTX(zf));
+    e.rm(0x0f96, 0, RBX, NOREG, CTX(cf));
+    return;
+}
+
+/*
+ * Pays for count instructions, leaving towards the handlers with
+ * JIT_BUDGET at ip if there are not that many left.
+ */
+static void emitBudget(Emitter &e, uint8_t *stub, uint32_t count, uint32_t ip) {
+    e.rm(0x81, 7, RBX, NOREG, CTX(budget), REX_W);
+    e.u32(count);
+    emitExitIf(e, stub, CC_B, JIT_BUDGET, ip);
+    e.rm(0x81, 5, RBX, NOREG, CTX(budget), REX_W);
+    e.u32(count);
+    return;
+}
+
+static void emitCount(Emitter &e, uint64_t *counter) {
+    e.movAbs(RAX, (uintptr_t) counter);
+    e.rm(0xff, 0, RAX, NOREG, 0, REX_W);
+    return;
+}
+
+/*
+ * The entry trampoline loads the context into the host registers and jumps
+ * to the block it is given, the exit stub does the opposite.
+ */
+bool VM::flushJIT(void) {
+    Emitter e(NULL);
+    uint8_t i;
+
+    if (!jitCache.beginWrite()) {
+        // flushed again on the next run
+        jitEnter = NULL;
+        return false;
+    }
+    jitCache.flush();
+    jitAt.assign(as.getCodesize(), NULL);
+    jitVersion = as.getCodeVersion();
+    if (engine == ENGINE_TRACE) {
+        jitHeat.assign(as.getCodesize(), 0);
+        traceAt.assign(as.getCodesize(), NULL);
+    }
+
+    e.p = jitCache.getTop();
+    jitEnter = e.p;
+    e.push(RBX);
+    e.push(RBP);
+    e.push(R12);
+    e.push(R13);
+    e.push(R14);
+    e.push(R15);
+    e.rr(0x89, RDI, RBX, REX_W);
+    e.rr(0x89, RSI, RAX, REX_W);
+    e.rm(0x8b, RBP, RBX, NOREG, CTX(data), REX_W);
+    e.rm(0x8b, RDI, RBX, NOREG, CTX(stack), REX_W);
+    e.rm(0x0fb7, RSI, RBX, NOREG, CTX(sp));
+    for (i = R0; i <= S3; i++) {
+        e.rm(0x0fb7, HOST(i), RBX, NOREG, CTX_R(i));
+    }
+    e.rr(0xff, 4, RAX);
+
+    jitExit = e.p;
+    for (i = R0; i <= S3; i++) {
+        e.rm(0x89, HOST(i), RBX, NOREG, CTX_R(i), OP16);
+    }
+    e.rm(0x89, RSI, RBX, NOREG, CTX(sp), OP16);
+    e.pop(R15);
+    e.pop(R14);
+    e.pop(R13);
+    e.pop(R12);
+    e.pop(RBP);
+    e.pop(RBX);
+    e.ret();
+    jitCache.setTop(e.p);
+    return true;
+}
+
+enum emitted {
+    // not a straight-line instruction
+    EMIT_NONE,
+    EMIT_DONE,
+    // it always leaves native code
+    EMIT_EXITED
+};
+
+/*
+ * Emits the instructions which do not change the control flow. Without
+ * checks, LODR, STRR, PUSH and POOP trust their caller to have checked
+ * their bounds already; without flags, CMP* leaves ZF and CF alone.
+ */
+uint8_t VM::emitStraight(Emitter &e, decoded_t *d, uint32_t ip, bool checks, bool flags) {
+    uint32_t datasize = as.getDatasize(), stacksize = as.getStacksize();
+    uint8_t dst = HOST(d->dst), src = HOST(d->src), *stub = jitExit;
+    uint8_t i;
+
+    switch (d->op) {
+    case MOVI:
+        e.movImm(dst, d->imm);
+        break;
+    case MOVR:
+        e.rr(0x89, src, dst);
+        break;
+    case LODI:
+        if (d->imm + sizeof(uint16_t) >= datasize) {
+            emitExit(e, stub, JIT_FAULT, ip);
+            return EMIT_EXITED;
+        }
+        e.rm(0x0fb7, dst, RBP, NOREG, d->imm);
+        break;
+    case LODR:
+        if (checks) {
+            if (emitBoundsCheck(e, src, datasize)) {
+                emitExitIf(e, stub, CC_AE, JIT_FAULT, ip);
+            }
+        }
+        e.rm(0x0fb7, dst, RBP, src, 0);
+        break;
+    case STRI:
+        if (d->imm + sizeof(uint16_t) >= datasize) {
+            emitExit(e, stub, JIT_FAULT, ip);
+            return EMIT_EXITED;
+        }
+        e.rm(0x89, src, RBP, NOREG, d->imm, OP16);
+        emitMarkImm(e, d->imm, CTX(dataTop));
+        break;
+    case STRR:
+        if (checks) {
+            if (emitBoundsCheck(e, dst, datasize)) {
+                emitExitIf(e, stub, CC_AE, JIT_FAULT, ip);
+            }
+        }
+        e.rm(0x89, src, RBP, dst, 0, OP16);
+        emitMark(e, dst, CTX(dataTop));
+        break;
+    case ADDI:
+        e.rr(0x81, 0, dst);
+        e.u32(d->imm);
+        e.zext(dst);
+        break;
+    case ADDR:
+        e.rr(0x01, src, dst);
+        e.zext(dst);
+        break;
+    case SUBI:
+        e.rr(0x81, 5, dst);
+        e.u32(d->imm);
+        e.zext(dst);
+        break;
+    case SUBR:
+        e.rr(0x29, src, dst);
+        e.zext(dst);
+        break;
+    case ANDB:
+        e.rr(0x81, 4, dst);
+        e.u32(d->src);
+        break;
+    case ANDW:
+        e.rr(0x81, 4, dst);
+        e.u32(d->imm);
+        break;
+    case ANDR:
+        e.rr(0x21, src, dst);
+        break;
+    case YORB:
+        e.rr(0x81, 1, dst);
+        e.u32(d->src);
+        break;
+    case YORW:
+        e.rr(0x81, 1, dst);
+        e.u32(d->imm);
+        break;
+    case YORR:
+        e.rr(0x09, src, dst);
+        break;
+    case XORB:
+        e.rr(0x81, 6, dst);
+        e.u32(d->src);
+        break;
+    case XORW:
+        e.rr(0x81, 6, dst);
+        e.u32(d->imm);
+        break;
+    case XORR:
+        e.rr(0x31, src, dst);
+        break;
+    case NOTR:
+        e.rr(0x89, src, dst);
+        e.rr(0xf7, 2, dst);
+        e.zext(dst);
+        break;
+    case MULI:
+        e.rr(0x69, dst, dst);
+        e.u32(d->imm);
+        e.zext(dst);
+        break;
+    case MULR:
+        e.rr(0x0faf, dst, src);
+        e.zext(dst);
+        break;
+    case DIVI:
+        if (d->imm == 0) {
+            emitExit(e, stub, JIT_FAULT, ip);
+            return EMIT_EXITED;
+        }
+        e.movImm(RCX, d->imm);
+        e.rr(0x89, dst, RAX);
+        e.rr(0x31, RDX, RDX);
+        e.rr(0xf7, 6, RCX);
+        e.rr(0x89, RAX, dst);
+        break;
+    case DIVR:
+        // execDIVR only looks at the lower byte of the divisor
+        e.rr(0x89, src, RCX);
+        e.rr(0xf7, 0, RCX);
+        e.u32(0xff);
+        emitExitIf(e, stub, CC_E, JIT_FAULT, ip);
+        e.rr(0x89, dst, RAX);
+        e.rr(0x31, RDX, RDX);
+        e.rr(0xf7, 6, RCX);
+        e.rr(0x89, RAX, dst);
+        break;
+    case SHLI:
+    case SHRI:
+        if (d->imm > 15) {
+            emitExit(e, stub, JIT_SLOW, ip);
+            return EMIT_EXITED;
+        }
+        e.rr(0xc1, d->op == SHLI ? 4 : 5, dst);
+        e.u8(d->imm);
+        e.zext(dst);
+        break;
+    case SHLR:
+    case SHRR:
+        e.rr(0x81, 7, src);
+        e.u32(15);
+        emitExitIf(e, stub, CC_A, JIT_SLOW, ip);
+        e.rr(0x89, src, RCX);
+        e.rr(0xd3, d->op == SHLR ? 4 : 5, dst);
+        e.zext(dst);
+        break;
+    case PUSH:
+        if (checks) {
+            if (emitBoundsCheck(e, RSI, stacksize)) {
+                emitExitIf(e, stub, CC_AE, JIT_FAULT, ip);
+            }
+        }
+        e.rm(0x89, dst, RDI, RSI, 0, OP16);
+        emitMark(e, RSI, CTX(stackTop));
+        e.rr(0x81, 0, RSI);
+        e.u32(sizeof(uint16_t));
+        e.zext(RSI);
+        break;
+    case POOP:
+        // execPOOP does not catch underflows, let it deal with them
+        if (checks) {
+            e.rr(0x81, 7, RSI);
+            e.u32(sizeof(uint16_t));
+            emitExitIf(e, stub, CC_B, JIT_SLOW, ip);
+        }
+        if (checks && stacksize < WIDE_SEGMENT) {
+            e.rr(0x81, 7, RSI);
+            e.u32(stacksize);
+            emitExitIf(e, stub, CC_A, JIT_SLOW, ip);
+        }
+        e.rr(0x81, 5, RSI);
+        e.u32(sizeof(uint16_t));
+        e.rm(0x0fb7, dst, RDI, RSI, 0);
+        break;
+    case CMPB:
+        e.rr(0x89, dst, RAX);
+        e.rr(0x81, 4, RAX);
+        e.u32(0xff);
+        e.rr(0x81, 7, RAX);
+        e.u32(d->src);
+        if (flags) {
+            emitSetFlags(e);
+        }
+        break;
+    case CMPW:
+        e.rr(0x81, 7, dst);
+        e.u32(d->imm);
+        if (flags) {
+            emitSetFlags(e);
+        }
+        break;
+    case CMPR:
+        e.rr(0x39, src, dst);
+        if (flags) {
+            emitSetFlags(e);
+        }
+        break;
+    case NOPE:
+        break;
+    case GRMN:
+        for (i = R0; i <= S3; i++) {
+            e.movImm(HOST(i), 0x4747);
+        }
+        break;
+    default:
+        return EMIT_NONE;
+    }
+    return EMIT_DONE;
+}
+
+// ENGINE_TRACE wants to know about the jumps going backwards
+#define EDGE(_target_) ((engine == ENGINE_TRACE && (uint32_t) (_target_) <= cur) ? JIT_BACKEDGE : JIT_CHAIN)
+
+/*
+ * Compiles the block at ip, the code cache must have JIT_BLOCKSIZE bytes
+ * left. Each record does exactly what its runFast body does: the checks
+ * which send runFast to slow or fault leave native code with JIT_SLOW or
+ * JIT_FAULT before touching anything.
+ */
+uint8_t *VM::compile(uint16_t ip) {
+    static const uint8_t TAKEN[] = {CC_A, CC_BE, CC_E, CC_NE};
+    std::vector<decoded_t> instrs;
+    uint32_t cur = ip, codesize = as.getCodesize(), stacksize = as.getStacksize(), datasize = as.getDatasize();
+    uint32_t i, count, total = 0, target;
+    uint8_t *entry, *not_taken, *not_above;
+    uint8_t dst, src, fused, emitted, *stub = jitExit;
+    bool ended = false;
+    decoded_t *d;
+    Emitter e(jitCache.getTop());
+
+    if (!jitCache.beginWrite()) {
+        return NULL;
+    }
+    decodeBlock(ip, instrs);
+    count = instrs.size() < JIT_MAXRECORDS ? instrs.size() : JIT_MAXRECORDS;
+    for (i = 0; i < count; i++) {
+        total += instructions(instrs[i].op);
+    }
+    entry = e.p;
+    emitBudget(e, stub, total, ip);
+    for (i = 0; i < count && !ended; i++) {
+        d = &instrs[i];
+        total -= instructions(d->op);
+        e.refund = total;
+        dst = HOST(d->dst);
+        src = HOST(d->src);
+        emitted = emitStraight(e, d, cur, true, true);
+        if (emitted == EMIT_EXITED) {
+            ended = true;
+        } else if (emitted == EMIT_NONE) {
+            switch (d->op) {
+            case JMPI:
+                emitChain(e, stub, d->imm, EDGE(d->imm));
+                break;
+            case JMPR:
+                e.rr(0x89, dst, RAX);
+                emitExitTo(e, stub, JIT_LOOKUP);
+                break;
+            /*
+             * As in the handlers, the register-based conditional jumps land
+             * on the register number, not on its content.
+             */
+            case JPAI:
+            case JPAR:
+                target = d->op == JPAI ? d->imm : d->dst;
+                e.rm(0x80, 7, RBX, NOREG, CTX(cf));
+                e.u8(0);
+                not_taken = e.jcc(CC_NE);
+                e.rm(0x80, 7, RBX, NOREG, CTX(zf));
+                e.u8(0);
+                not_above = e.jcc(CC_NE);
+                emitChain(e, stub, target, EDGE(target));
+                e.land(not_taken);
+                e.land(not_above);
+                emitChain(e, stub, cur + d->length, JIT_CHAIN);
+                break;
+            case JPBI:
+            case JPBR:
+            case JPEI:
+            case JPER:
+            case JPNI:
+            case JPNR:
+                target = (d->op == JPBI || d->op == JPEI || d->op == JPNI) ? d->imm : d->dst;
+                e.rm(0x80, 7, RBX, NOREG, (d->op == JPBI || d->op == JPBR) ? CTX(cf) : CTX(zf));
+                e.u8(0);
+                not_taken = e.jcc((d->op == JPNI || d->op == JPNR) ? CC_NE : CC_E);
+                emitChain(e, stub, target, EDGE(target));
+                e.land(not_taken);
+                emitChain(e, stub, cur + d->length, JIT_CHAIN);
+                break;
+            case CALL:
+                if (cur + CALL_SIZE >= codesize) {
+                    emitExit(e, stub, JIT_FAULT, cur);
+                    ended = true;
+                    break;
+                }
+                if (emitBoundsCheck(e, RSI, stacksize)) {
+                    emitExitIf(e, stub, CC_AE, JIT_FAULT, cur);
+                }
+                e.rm(0xc7, 0, RBX, NOREG, CTX(rp), OP16);
+                e.u16(cur + CALL_SIZE);
+                e.rm(0xc7, 0, RDI, RSI, 0, OP16);
+                e.u16(cur + CALL_SIZE);
+                emitMark(e, RSI, CTX(stackTop));
+                e.rr(0x81, 0, RSI);
+                e.u32(sizeof(uint16_t));
+                e.zext(RSI);
+                emitChain(e, stub, d->imm, EDGE(d->imm));
+                break;
+            case RETN:
+                e.rr(0x81, 5, RSI);
+                e.u32(sizeof(uint16_t));
+                e.zext(RSI);
+                e.rm(0x0fb7, RAX, RBX, NOREG, CTX(rp));
+                emitExitTo(e, stub, JIT_LOOKUP);
+                break;
+            case SHIT:
+                emitExit(e, stub, JIT_SHIT, cur);
+                break;
+            case DEC_CHAIN:
+                emitChain(e, stub, cur, JIT_CHAIN);
+                break;
+            case DEC_MOVI_ADDR:
+                emitCount(e, &fusionsFired[d->op - DEC_CMPR_JPAI]);
+                e.movImm(dst, d->imm);
+                e.rr(0x01, HOST(d->src2), HOST(d->dst2));
+                e.zext(HOST(d->dst2));
+                break;
+            case DEC_LODR_CMPB:
+                if (emitBoundsCheck(e, src, datasize)) {
+                    emitExitIf(e, stub, CC_AE, JIT_FAULT, cur);
+                }
+                emitCount(e, &fusionsFired[d->op - DEC_CMPR_JPAI]);
+                e.rm(0x0fb7, dst, RBP, src, 0);
+                e.rr(0x89, HOST(d->dst2), RAX);
+                e.rr(0x81, 4, RAX);
+                e.u32(0xff);
+                e.rr(0x81, 7, RAX);
+                e.u32(d->src2);
+                emitSetFlags(e);
+                break;
+            default:
+                if (d->op < DEC_CMPR_JPAI || d->op > DEC_CMPW_JPNI) {
+                    // DEC_SLOW
+                    emitExit(e, stub, JIT_SLOW, cur);
+                    break;
+                }
+                // CMPR, CMPB or CMPW followed by JPAI, JPBI, JPEI or JPNI
+                fused = d->op - DEC_CMPR_JPAI;
+                emitCount(e, &fusionsFired[fused]);
+                if (fused < DEC_CMPB_JPAI - DEC_CMPR_JPAI) {
+                    e.rr(0x39, src, dst);
+                } else if (fused < DEC_CMPW_JPAI - DEC_CMPR_JPAI) {
+                    e.rr(0x89, dst, RAX);
+                    e.rr(0x81, 4, RAX);
+                    e.u32(0xff);
+                    e.rr(0x81, 7, RAX);
+                    e.u32(d->src);
+                } else {
+                    e.rr(0x81, 7, dst);
+                    e.u32(d->imm);
+                }
+                emitSetFlags(e);
+                not_taken = e.jcc(TAKEN[fused % 4] ^ 1);
+                emitChain(e, stub, d->imm2, EDGE(d->imm2));
+                e.land(not_taken);
+                emitChain(e, stub, cur + d->length, JIT_CHAIN);
+                break;
+            }
+        }
+        cur += d->length;
+    }
+    if (!ended && count < instrs.size()) {
+        emitChain(e, stub, cur, JIT_CHAIN);
+    }
+    jitCache.setTop(e.p);
+    jitAt[ip] = entry;
+    return entry;
+}
+
+/*
+ * TRACES
+ * ENGINE_TRACE counts how many times every backward jump is taken. Once a
+ * loop header gets hot, one iteration runs through the exec* handlers while
+ * its path is recorded, and the path is compiled as a loop on its own:
+ * - control flow is straight, every jump becomes a guard leaving the trace
+ *   when it does not go where it went while recording;
+ * - ZF and CF are only written when something may read them;
+ * - the bounds of LODR, STRR, PUSH, POOP and CALL are checked once at the
+ *   top of the loop whenever their address is known there, that is an
+ *   induction variable or SP plus a constant. If any of those checks fails
+ *   the iteration runs through the block at the header instead, which
+ *   faults where the handlers would.
+ */
+
+// records of a trace at most
+#define TRACE_MAXSTEPS 256
+// upper bound of the native code of a trace
+#define JIT_TRACESIZE (TRACE_MAXSTEPS * 512)
+// backward jumps taken before the header is traced
+#define TRACE_HOT 16
+// jitHeat of a header which can't be traced
+#define TRACE_NEVER 0xffff
+
+enum records {
+    RECORD_DONE,
+    RECORD_ABORTED,
+    // the VM stopped while recording
+    RECORD_FINISHED,
+    // the budget ran out while recording, try again next time
+    RECORD_EXHAUSTED
+};
+
+/*
+ * Runs the iteration starting at IP through the handlers, until control
+ * gets back to IP, recording what runs. It gives up at whatever runFast
+ * would hand to the handlers, leaving the VM at that instruction.
+ */
+uint8_t VM::recordTrace(std::vector<trace_step_t> &trace) {
+    uint16_t head = regs[IP], ip = head;
+    const instruction_t *instr_p;
+    decoded_t d;
+
+    do {
+        if (trace.size() >= TRACE_MAXSTEPS) {
+            return RECORD_ABORTED;
+        }
+        decodeOne(ip, &d);
+        if (d.op >= NUM_OPS || d.op == SHIT || ((d.op == SHLI || d.op == SHRI) && d.imm > 15)) {
+            return RECORD_ABORTED;
+        }
+        if (budget == 0) {
+            return RECORD_EXHAUSTED;
+        }
+        budget--;
+        instr_p = &INSTR[d.op];
+        if (!(this->*(instr_p->exec))()) {
+            DBG_ERROR(("%s failed.\n", instr_p->name));
+            DBG_INFO(("Finished.\n"));
+            return RECORD_FINISHED;
+        }
+        if (!instr_p->isJump) {
+            regs[IP] += instr_p->length;
+        }
+        trace.push_back({d, ip, regs[IP]});
+        ip = regs[IP];
+        if (ip >= as.getCodesize()) {
+            return RECORD_ABORTED;
+        }
+    } while (ip != head);
+    return RECORD_DONE;
+}
+
+enum symbolic_kinds {
+    SYM_UNKNOWN,
+    SYM_CONST,
+    // base's value at the top of the iteration, plus offset
+    SYM_ENTRY
+};
+
+typedef struct symbolic {
+    uint8_t kind;
+    uint8_t base;
+    uint16_t offset;
+} symbolic_t;
+
+enum head_checks {
+    // base + offset, a data address
+    CHECK_DATA,
+    // SP + offset, a PUSH or a CALL
+    CHECK_PUSH,
+    // SP + offset, a POOP
+    CHECK_POOP
+};
+
+typedef struct head_check {
+    uint8_t kind;
+    uint8_t base;
+    uint16_t offset;
+} head_check_t;
+
+enum cold_exits {
+    // run the iteration through the block at the header
+    COLD_HEAD,
+    // a guard failed, go on from ip
+    COLD_CHAIN,
+    // a computed jump went elsewhere, the address is in eax
+    COLD_LOOKUP
+};
+
+typedef struct cold_exit {
+    uint8_t *rel;
+    uint8_t kind;
+    uint32_t ip;
+    // ZF and CF still have to be written from the host flags
+    bool flags;
+    // instructions of the iteration which did not run
+    uint32_t refund;
+} cold_exit_t;
+
+static bool isCondJump(uint8_t op) {
+    return op >= JPAI && op <= JPNR;
+}
+
+static bool isCmp(uint8_t op) {
+    return op == CMPB || op == CMPW || op == CMPR;
+}
+
+static void addCheck(std::vector<head_check_t> &checks, uint8_t kind, uint8_t base, uint16_t offset) {
+    for (head_check_t &check : checks) {
+        if (check.kind == kind && check.base == base && check.offset == offset) {
+            return;
+        }
+    }
+    checks.push_back({kind, base, offset});
+    return;
+}
+
+static uint8_t *emitCold(Emitter &e, std::vector<cold_exit_t> &cold, uint8_t cc, uint8_t kind, uint32_t ip,
+                         bool flags) {
+    cold.push_back({e.jcc(cc), kind, ip, flags, e.refund});
+    return cold.back().rel;
+}
+
+uint8_t *VM::compileTrace(uint16_t head, std::vector<trace_step_t> &trace) {
+    static const uint8_t TAKEN[] = {CC_A, CC_BE, CC_E, CC_NE};
+    uint32_t datasize = as.getDatasize(), stacksize = as.getStacksize();
+    uint32_t i, j, n = trace.size(), target, fallthrough;
+    std::vector<bool> hoisted(n, false), exits(n, false), flags(n, true);
+    std::vector<head_check_t> checks;
+    std::vector<cold_exit_t> cold;
+    symbolic_t sym[S3 + 1], *addr;
+    uint16_t sp = 0;
+    uint8_t *entry, *block, *stub = jitExit, kind, cc;
+    bool adjacent = false, taken;
+    decoded_t *d;
+    Emitter e(NULL);
+
+    block = jitAt[head] != NULL ? jitAt[head] : compile(head);
+    if (block == NULL || !jitCache.beginWrite()) {
+        return NULL;
+    }
+    e.p = jitCache.getTop();
+
+    /*
+     * Where every register stands relative to the top of the iteration,
+     * to hoist the bounds checks.
+     */
+    for (i = R0; i <= S3; i++) {
+        sym[i] = {SYM_ENTRY, (uint8_t) i, 0};
+    }
+    for (i = 0; i < n; i++) {
+        d = &trace[i].d;
+        addr = NULL;
+        switch (d->op) {
+        case LODR:
+            addr = &sym[d->src];
+            break;
+        case STRR:
+            addr = &sym[d->dst];
+            break;
+        case PUSH:
+        case CALL:
+            addCheck(checks, CHECK_PUSH, SP, sp);
+            hoisted[i] = true;
+            sp += sizeof(uint16_t);
+            break;
+        case POOP:
+            addCheck(checks, CHECK_POOP, SP, sp);
+            hoisted[i] = true;
+            sp -= sizeof(uint16_t);
+            break;
+        case RETN:
+            sp -= sizeof(uint16_t);
+            break;
+        }
+        if (addr != NULL && addr->kind != SYM_UNKNOWN) {
+            // a constant address was fine while recording, it always is
+            if (addr->kind == SYM_ENTRY) {
+                addCheck(checks, CHECK_DATA, addr->base, addr->offset);
+            }
+            hoisted[i] = true;
+        }
+        switch (d->op) {
+        case MOVI:
+            sym[d->dst] = {SYM_CONST, 0, d->imm};
+            break;
+        case MOVR:
+            sym[d->dst] = sym[d->src];
+            break;
+        case ADDI:
+        case SUBI:
+            if (sym[d->dst].kind != SYM_UNKNOWN) {
+                sym[d->dst].offset += d->op == ADDI ? d->imm : -d->imm;
+            }
+            break;
+        case ADDR:
+            if (sym[d->src].kind == SYM_CONST && sym[d->dst].kind != SYM_UNKNOWN) {
+                sym[d->dst].offset += sym[d->src].offset;
+            } else if (sym[d->dst].kind == SYM_CONST && sym[d->src].kind != SYM_UNKNOWN) {
+                sym[d->dst] = {sym[d->src].kind, sym[d->src].base, (uint16_t) (sym[d->dst].offset + sym[d->src].offset)};
+            } else {
+                sym[d->dst].kind = SYM_UNKNOWN;
+            }
+            break;
+        case SUBR:
+            if (sym[d->src].kind == SYM_CONST && sym[d->dst].kind != SYM_UNKNOWN) {
+                sym[d->dst].offset -= sym[d->src].offset;
+            } else {
+                sym[d->dst].kind = SYM_UNKNOWN;
+            }
+            break;
+        case GRMN:
+            for (j = R0; j <= S3; j++) {
+                sym[j] = {SYM_CONST, 0, 0x4747};
+            }
+            break;
+        case LODI:
+        case LODR:
+        case ANDB:
+        case ANDW:
+        case ANDR:
+        case YORB:
+        case YORW:
+        case YORR:
+        case XORB:
+        case XORW:
+        case XORR:
+        case NOTR:
+        case MULI:
+        case MULR:
+        case DIVI:
+        case DIVR:
+        case SHLI:
+        case SHLR:
+        case SHRI:
+        case SHRR:
+        case POOP:
+            sym[d->dst].kind = SYM_UNKNOWN;
+            break;
+        }
+    }
+
+    /*
+     * Which instructions may leave the trace, and which CMP* results may be
+     * seen by someone.
+     */
+    for (i = 0; i < n; i++) {
+        d = &trace[i].d;
+        if (isCondJump(d->op)) {
+            target = (d->op - JPAI) % 2 == 0 ? d->imm : d->dst;
+            exits[i] = target != (uint32_t) trace[i].ip + d->length;
+        } else if (d->op == JMPR || d->op == RETN || d->op == DIVR || d->op == SHLR || d->op == SHRR) {
+            exits[i] = true;
+        } else if ((d->op == LODR || d->op == STRR) && !hoisted[i]) {
+            exits[i] = true;
+        }
+    }
+    for (i = 0; i < n; i++) {
+        if (!isCmp(trace[i].d.op)) {
+            continue;
+        }
+        // a guard right after it reads the host flags, and writes them only when it fails
+        j = (i + 1 < n && isCondJump(trace[i + 1].d.op) && exits[i + 1]) ? i + 2 : i + 1;
+        flags[i] = true;
+        for (; j < n; j++) {
+            if (exits[j]) {
+                break;
+            }
+            if (isCmp(trace[j].d.op)) {
+                flags[i] = false;
+                break;
+            }
+        }
+    }
+
+    entry = e.p;
+    for (head_check_t &check : checks) {
+        if (check.kind != CHECK_POOP && (check.kind == CHECK_DATA ? datasize : stacksize) >= WIDE_SEGMENT) {
+            continue;
+        }
+        e.rr(0x89, check.kind == CHECK_DATA ? HOST(check.base) : RSI, RAX);
+        e.rr(0x81, 0, RAX);
+        e.u32(check.offset);
+        e.zext(RAX);
+        if (check.kind == CHECK_POOP) {
+            e.rr(0x81, 7, RAX);
+            e.u32(sizeof(uint16_t));
+            emitCold(e, cold, CC_B, COLD_HEAD, head, false);
+            if (stacksize < WIDE_SEGMENT) {
+                e.rr(0x81, 7, RAX);
+                e.u32(stacksize);
+                emitCold(e, cold, CC_A, COLD_HEAD, head, false);
+            }
+        } else if (emitBoundsCheck(e, RAX, check.kind == CHECK_DATA ? datasize : stacksize)) {
+            emitCold(e, cold, CC_AE, COLD_HEAD, head, false);
+        }
+    }
+    // without budget for a whole iteration, the block at the header pays for itself
+    e.rm(0x81, 7, RBX, NOREG, CTX(budget), REX_W);
+    e.u32(n);
+    emitCold(e, cold, CC_B, COLD_HEAD, head, false);
+    e.rm(0x81, 5, RBX, NOREG, CTX(budget), REX_W);
+    e.u32(n);
+    for (i = 0; i < n; i++) {
+        d = &trace[i].d;
+        e.refund = n - (i + 1);
+        fallthrough = (uint32_t) trace[i].ip + d->length;
+        if (isCondJump(d->op)) {
+            if (exits[i]) {
+                kind = (d->op - JPAI) / 2;
+                target = (d->op - JPAI) % 2 == 0 ? d->imm : d->dst;
+                taken = trace[i].next == target;
+                if (adjacent) {
+                    cc = TAKEN[kind];
+                } else if (kind == 0) {
+                    e.rm(0x0fb6, RAX, RBX, NOREG, CTX(zf));
+                    e.rm(0x0fb6, RCX, RBX, NOREG, CTX(cf));
+                    e.rr(0x09, RCX, RAX);
+                    cc = CC_E;
+                } else {
+                    e.rm(0x80, 7, RBX, NOREG, kind == 1 ? CTX(cf) : CTX(zf));
+                    e.u8(0);
+                    cc = kind == 3 ? CC_E : CC_NE;
+                }
+                emitCold(e, cold, taken ? cc ^ 1 : cc, COLD_CHAIN, taken ? fallthrough : target,
+                         adjacent && !flags[i - 1]);
+            }
+            adjacent = false;
+            continue;
+        }
+        adjacent = false;
+        switch (d->op) {
+        case JMPI:
+            break;
+        case JMPR:
+            e.rr(0x89, HOST(d->dst), RAX);
+            e.rr(0x81, 7, RAX);
+            e.u32(trace[i].next);
+            emitCold(e, cold, CC_NE, COLD_LOOKUP, 0, false);
+            break;
+        case CALL:
+            e.rm(0xc7, 0, RBX, NOREG, CTX(rp), OP16);
+            e.u16(fallthrough);
+            e.rm(0xc7, 0, RDI, RSI, 0, OP16);
+            e.u16(fallthrough);
+            emitMark(e, RSI, CTX(stackTop));
+            e.rr(0x81, 0, RSI);
+            e.u32(sizeof(uint16_t));
+            e.zext(RSI);
+            break;
+        case RETN:
+            e.rr(0x81, 5, RSI);
+            e.u32(sizeof(uint16_t));
+            e.zext(RSI);
+            e.rm(0x0fb7, RAX, RBX, NOREG, CTX(rp));
+            e.rr(0x81, 7, RAX);
+            e.u32(trace[i].next);
+            emitCold(e, cold, CC_NE, COLD_LOOKUP, 0, false);
+            break;
+        default:
+            emitStraight(e, d, trace[i].ip, !hoisted[i], flags[i]);
+            adjacent = isCmp(d->op) && i + 1 < n && isCondJump(trace[i + 1].d.op);
+            break;
+        }
+    }
+    Emitter::link(e.jmp(), entry);
+
+    for (cold_exit_t &exit : cold) {
+        e.land(exit.rel);
+        e.refund = exit.refund;
+        switch (exit.kind) {
+        case COLD_HEAD:
+            Emitter::link(e.jmp(), block);
+            break;
+        case COLD_CHAIN:
+            if (exit.flags) {
+                emitSetFlags(e);
+            }
+            emitChain(e, stub, exit.ip, JIT_CHAIN);
+            break;
+        default:
+            emitExitTo(e, stub, JIT_LOOKUP);
+            break;
+        }
+    }
+    jitCache.setTop(e.p);
+    traceAt[head] = entry;
+    tracesCompiled++;
+    return entry;
+}
+
+#define JIT_LOAD()                                                             \
+  do {                                                                         \
+    memcpy(ctx.r, regs, sizeof(ctx.r));                                        \
+    ctx.ip = regs[IP];                                                         \
+    ctx.rp = regs[RP];                                                         \
+    ctx.sp = regs[SP];                                                         \
+    ctx.zf = flags.ZF;                                                         \
+    ctx.cf = flags.CF;                                                         \
+    ctx.budget = budget;                                                       \
+    ctx.dataTop = 0;                                                           \
+    ctx.stackTop = 0;                                                          \
+  } while (0)
+#define JIT_STORE()                                                            \
+  do {                                                                         \
+    memcpy(regs, ctx.r, sizeof(ctx.r));                                        \
+    regs[IP] = ctx.ip;                                                         \
+    regs[RP] = ctx.rp;                                                         \
+    regs[SP] = ctx.sp;                                                         \
+    flags.ZF = ctx.zf;                                                         \
+    flags.CF = ctx.cf;                                                         \
+    budget = ctx.budget;                                                       \
+    as.markData(ctx.dataTop);                                                  \
+    as.markStack(ctx.stackTop);                                                \
+  } while (0)
+
+#endif
+
+uint32_t VM::traces(void) {
+    return tracesCompiled;
+}
+
+/*
+ * Where the JIT can't run, ENGINE_JIT and ENGINE_TRACE are ENGINE_BLOCKS.
+ * So is what's left of a run once the code cache can't be written to.
+ */
+statuses VM::runJIT(void) {
+#ifdef JIT_SUPPORTED
+    jit_context_t ctx;
+    uint32_t codesize = as.getCodesize();
+    uint8_t *entry, *patch = NULL;
+    const instruction_t *instr_p;
+    std::vector<trace_step_t> trace;
+    uint16_t head;
+
+    if (!jitCache.map()) {
+        return runFast<ENGINE_BLOCKS>();
+    }
+    if ((jitEnter == NULL || jitAt.size() != codesize || jitVersion != as.getCodeVersion()) && !flushJIT()) {
+        return runFast<ENGINE_BLOCKS>();
+    }
+    ctx.data = as.dataSection();
+    ctx.stack = as.stackSection();
+    JIT_LOAD();
+    while (true) {
+        if (ctx.ip >= codesize) {
+            JIT_STORE();
+            DBG_ERROR(("Out of bounds: IP is outside the code section.\n"));
+            DBG_INFO(("Finished.\n"));
+            return VM_FAULTED;
+        }
+        entry = !traceAt.empty() && traceAt[ctx.ip] != NULL ? traceAt[ctx.ip] : jitAt[ctx.ip];
+        if (entry == NULL) {
+            if (jitCache.getFree() < JIT_BLOCKSIZE) {
+                // the jump to link went away with the rest
+                if (!flushJIT()) {
+                    goto unwritable;
+                }
+                patch = NULL;
+            }
+            entry = compile(ctx.ip);
+            if (entry == NULL) {
+                goto unwritable;
+            }
+        }
+        if (patch != NULL) {
+            if (!jitCache.beginWrite()) {
+                goto unwritable;
+            }
+            Emitter::link(patch, entry);
+        }
+        jitCache.endWrite();
+        ((jit_entry_t) jitEnter)(&ctx, entry);
+        patch = NULL;
+        switch (ctx.exit) {
+        case JIT_CHAIN:
+            patch = ctx.patch;
+            break;
+        case JIT_BACKEDGE:
+            // not linked until the header is either traced or given up
+            if (traceAt[ctx.ip] != NULL || jitHeat[ctx.ip] == TRACE_NEVER) {
+                patch = ctx.patch;
+                break;
+            }
+            if (++jitHeat[ctx.ip] < TRACE_HOT) {
+                break;
+            }
+            if (jitCache.getFree() < JIT_BLOCKSIZE + JIT_TRACESIZE && !flushJIT()) {
+                goto unwritable;
+            }
+            head = ctx.ip;
+            JIT_STORE();
+            trace.clear();
+            switch (recordTrace(trace)) {
+            case RECORD_FINISHED:
+                return VM_FAULTED;
+            case RECORD_EXHAUSTED:
+                return VM_EXHAUSTED;
+            case RECORD_DONE:
+                if (compileTrace(head, trace) == NULL) {
+                    return runFast<ENGINE_BLOCKS>();
+                }
+                break;
+            default:
+                jitHeat[head] = TRACE_NEVER;
+                break;
+            }
+            JIT_LOAD();
+            break;
+        case JIT_LOOKUP:
+            break;
+        case JIT_SLOW:
+            JIT_STORE();
+            instr_p = DECODE[as.getCode()[ctx.ip]];
+            if (!(this->*(instr_p->exec))()) {
+                DBG_ERROR(("%s failed.\n", instr_p->name));
+                DBG_INFO(("Finished.\n"));
+                return VM_FAULTED;
+            }
+            if (!instr_p->isJump) {
+                regs[IP] += instr_p->length;
+            }
+            JIT_LOAD();
+            break;
+        case JIT_FAULT:
+            JIT_STORE();
+            DBG_ERROR(("%s failed.\n", DECODE[as.getCode()[ctx.ip]]->name));
+            DBG_INFO(("Finished.\n"));
+            return VM_FAULTED;
+        case JIT_BUDGET:
+            JIT_STORE();
+            return VM_EXHAUSTED;
+        default:
+            JIT_STORE();
+            DBG_INFO(("SHIT\n"));
+            DBG_INFO(("Finished.\n"));
+            return VM_HALTED;
+        }
+    }
+
+unwritable:
+    JIT_STORE();
+    return runFast<ENGINE_BLOCKS>();
+#else
+    return runFast<ENGINE_BLOCKS>();
+#endif
+}
@@ -0,0 +1,47 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include <stdint.h>
+
+#define JIT_CACHESIZE 0x100000
+
+/*
+ * Executable memory ENGINE_JIT emits native code into. It is mapped the
+ * first time it is needed and handed out linearly until flush(). It is
+ * never writable and executable at once: code is only written between
+ * beginWrite() and endWrite(), and only run after endWrite(). Where
+ * beginWrite() fails the cache stays executable and untouched.
+ */
+class CodeCache {
+private:
+    uint8_t *base, *top;
+    uint32_t size;
+    bool writing;
+
+public:
+    CodeCache(uint32_t size = JIT_CACHESIZE);
+
+    CodeCache(const CodeCache &) = delete;
+
+    CodeCache &operator=(const CodeCache &) = delete;
+
+    ~CodeCache();
+
+    bool map(void);
+
+    void flush(void);
+
+    // read-write, until endWrite(), false if it can't be
+    bool beginWrite(void);
+
+    // read-execute, until beginWrite()
+    void endWrite(void);
+
+    uint8_t *getTop();
+
+    void setTop(uint8_t *top);
+
+    uint32_t getFree();
+};
+
+#endif
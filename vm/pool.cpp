@@ -0,0 +1,151 @@
+#include "pool.h"
+#include <stdexcept>
+
+VMPool::VMPool(uint32_t threads, engines engine) : engine(engine), next(0), cached(0), queued(0), stopping(false) {
+    uint32_t i;
+
+    if (threads == 0) {
+        threads = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+    for (i = 0; i < threads; i++) {
+        workers.emplace_back(new worker_t);
+    }
+    for (i = 0; i < threads; i++) {
+        workers[i]->thread = std::thread(&VMPool::work, this, i);
+    }
+}
+
+VMPool::~VMPool() {
+    {
+        std::lock_guard<std::mutex> l(idleLock);
+        stopping = true;
+    }
+    idle.notify_all();
+    for (std::unique_ptr<worker_t> &w : workers) {
+        w->thread.join();
+    }
+}
+
+std::future<vm_result_t> VMPool::submit(uint8_t *key, uint8_t *code, uint32_t codesize, uint8_t *data,
+                                        uint32_t datasize, uint64_t budget) {
+    job_t *job;
+    std::future<vm_result_t> result;
+    worker_t &w = *workers[next++ % workers.size()];
+
+    if (codesize > DEFAULT_CODESIZE || datasize > DEFAULT_DATASIZE) {
+        throw std::invalid_argument("The job does not fit a VM");
+    }
+    job = new job_t{std::string((char *) key), std::vector<uint8_t>(code, code + codesize),
+                    std::vector<uint8_t>(data, data + datasize), budget, std::promise<vm_result_t>()};
+    result = job->result.get_future();
+    {
+        std::lock_guard<std::mutex> l(w.lock);
+        w.jobs.push_back(job);
+    }
+    {
+        std::lock_guard<std::mutex> l(idleLock);
+        queued++;
+    }
+    idle.notify_one();
+    return result;
+}
+
+/*
+ * The oldest job of self, or else the newest one of the first other
+ * worker which has any.
+ */
+VMPool::job_t *VMPool::take(uint32_t self) {
+    job_t *job = NULL;
+    uint32_t i;
+
+    for (i = 0; i < workers.size() && !job; i++) {
+        worker_t &w = *workers[(self + i) % workers.size()];
+        std::lock_guard<std::mutex> l(w.lock);
+
+        if (w.jobs.empty()) {
+            continue;
+        }
+        if (i == 0) {
+            job = w.jobs.front();
+            w.jobs.pop_front();
+        } else {
+            job = w.jobs.back();
+            w.jobs.pop_back();
+        }
+    }
+    if (job) {
+        std::lock_guard<std::mutex> l(idleLock);
+        queued--;
+    }
+    return job;
+}
+
+uint32_t VMPool::cachedVMs(void) {
+    return cached;
+}
+
+/*
+ * The VM w keeps for key, moved to the front of its list. A new one takes
+ * the place of the least recently used when the list is full.
+ */
+VM &VMPool::vmFor(worker_t &w, const std::string &key) {
+    std::list<std::pair<std::string, std::unique_ptr<VM>>>::iterator it;
+
+    for (it = w.vms.begin(); it != w.vms.end(); it++) {
+        if (it->first == key) {
+            w.vms.splice(w.vms.begin(), w.vms, it);
+            return *w.vms.front().second;
+        }
+    }
+    if (w.vms.size() >= POOL_VMS) {
+        w.vms.pop_back();
+        cached--;
+    }
+    w.vms.emplace_front(key, std::unique_ptr<VM>(new VM((uint8_t *) key.c_str(), engine)));
+    cached++;
+    return *w.vms.front().second;
+}
+
+/*
+ * Whatever the job throws ends up in its future: the worker goes on with
+ * the next one.
+ */
+void VMPool::execute(worker_t &w, job_t *job) {
+    vm_result_t result;
+    uint32_t i;
+
+    try {
+        VM &vm = vmFor(w, job->key);
+        VMAddrSpace *as = vm.addressSpace();
+
+        vm.reload(job->code.data(), job->code.size(), job->data.data(), job->data.size());
+        result.status = vm.run(job->budget);
+        for (i = R0; i < NUM_REGS; i++) {
+            result.regs[i] = vm.reg(i);
+        }
+        // reading the section leaves its high-water mark, and the next reset, as small as they are
+        result.data.assign(as->dataSection(), as->dataSection() + as->getDatasize());
+        job->result.set_value(std::move(result));
+    } catch (...) {
+        job->result.set_exception(std::current_exception());
+    }
+    delete job;
+    return;
+}
+
+void VMPool::work(uint32_t self) {
+    job_t *job;
+
+    while (true) {
+        job = take(self);
+        if (job) {
+            execute(*workers[self], job);
+            continue;
+        }
+        std::unique_lock<std::mutex> l(idleLock);
+        idle.wait(l, [this] { return queued > 0 || stopping; });
+        if (queued == 0) {
+            return;
+        }
+    }
+}
@@ -0,0 +1,87 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include "vm.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// VMs a worker keeps, one per key, the least recently used goes first
+#define POOL_VMS 8
+
+// what a VMPool job leaves behind
+typedef struct vm_result {
+    statuses status;
+    uint16_t regs[NUM_REGS];
+    std::vector<uint8_t> data;
+} vm_result_t;
+
+/*
+ * Runs independent programs on a set of worker threads. Jobs are handed
+ * to the workers in turn, each one running its own deque oldest first: a
+ * worker left without jobs steals the newest ones of the others, so short
+ * and long programs even out. Every worker keeps one VM for each of the
+ * last POOL_VMS keys it ran and loads the next job in it, instead of
+ * building a new one.
+ */
+class VMPool {
+private:
+    typedef struct job {
+        std::string key;
+        std::vector<uint8_t> code, data;
+        uint64_t budget;
+        std::promise<vm_result_t> result;
+    } job_t;
+    typedef struct worker {
+        std::mutex lock;
+        std::deque<job_t *> jobs;
+        // most recently used first
+        std::list<std::pair<std::string, std::unique_ptr<VM>>> vms;
+        std::thread thread;
+    } worker_t;
+
+    engines engine;
+    std::vector<std::unique_ptr<worker_t>> workers;
+    std::atomic<uint32_t> next;
+    // VMs kept by all workers
+    std::atomic<uint32_t> cached;
+    // jobs submitted and not taken yet
+    uint64_t queued;
+    bool stopping;
+    std::mutex idleLock;
+    std::condition_variable idle;
+
+    job_t *take(uint32_t self);
+
+    VM &vmFor(worker_t &w, const std::string &key);
+
+    void execute(worker_t &w, job_t *job);
+
+    void work(uint32_t self);
+
+public:
+    // threads = 0 means one per core
+    VMPool(uint32_t threads = 0, engines engine = ENGINE_PREDECODED);
+
+    // waits for every job submitted to end
+    ~VMPool();
+
+    /*
+     * key is NUL-terminated as in VM. The code and data sections have to
+     * fit the default ones. What running the job throws, get() throws.
+     */
+    std::future<vm_result_t> submit(uint8_t *key, uint8_t *code, uint32_t codesize, uint8_t *data,
+                                    uint32_t datasize, uint64_t budget = UINT64_MAX);
+
+    // VMs the workers keep between jobs, at most POOL_VMS each
+    uint32_t cachedVMs(void);
+};
+
+#endif
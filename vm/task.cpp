@@ -0,0 +1,92 @@
+#include "task.h"
+#include <stdexcept>
+
+VMTask::VMTask(VM &vm, uint64_t slice) : vm(vm), slice(slice), state(TASK_YIELDED) {
+    if (slice == 0) {
+        throw std::invalid_argument("Nothing would ever run");
+    }
+}
+
+void VMTask::waitAt(uint16_t ip) {
+    if (waitPoints.size() <= ip) {
+        waitPoints.resize(ip + 1, false);
+    }
+    waitPoints[ip] = true;
+    return;
+}
+
+task_states VMTask::resume(void) {
+    uint16_t ip;
+
+    switch (state) {
+    case TASK_HALTED:
+    case TASK_FAULTED:
+        return state;
+    case TASK_WAITING:
+        vm.regs[IP] += SHIT_SIZE;
+        break;
+    default:
+        break;
+    }
+    switch (vm.run(slice)) {
+    case VM_EXHAUSTED:
+        state = TASK_YIELDED;
+        break;
+    case VM_HALTED:
+        ip = vm.regs[IP];
+        state = ip < waitPoints.size() && waitPoints[ip] ? TASK_WAITING : TASK_HALTED;
+        break;
+    default:
+        state = TASK_FAULTED;
+        break;
+    }
+    return state;
+}
+
+task_states VMTask::getState(void) {
+    return state;
+}
+
+VM &VMTask::getVM(void) {
+    return vm;
+}
+
+TaskScheduler::TaskScheduler(std::function<void(VMTask *)> onWait) : waiting(0), onWait(onWait) {
+}
+
+void TaskScheduler::spawn(VMTask *task) {
+    ready.push_back(task);
+    return;
+}
+
+void TaskScheduler::wake(VMTask *task) {
+    if (task->getState() != TASK_WAITING || waiting == 0) {
+        throw std::invalid_argument("The task does not wait");
+    }
+    waiting--;
+    ready.push_back(task);
+    return;
+}
+
+uint64_t TaskScheduler::run(void) {
+    VMTask *task;
+
+    while (!ready.empty()) {
+        task = ready.front();
+        ready.pop_front();
+        switch (task->resume()) {
+        case TASK_YIELDED:
+            ready.push_back(task);
+            break;
+        case TASK_WAITING:
+            waiting++;
+            if (onWait) {
+                onWait(task);
+            }
+            break;
+        default:
+            break;
+        }
+    }
+    return waiting;
+}
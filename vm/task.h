@@ -0,0 +1,153 @@
+#ifndef TASK_H
+#define TASK_H
+
+#include "vm.h"
+#include <deque>
+#include <functional>
+#include <vector>
+#ifdef __cpp_impl_coroutine
+#include <coroutine>
+#include <exception>
+#endif
+
+// where a VMTask gave control back
+enum task_states {
+    // its slice ran out, resume() goes on
+    TASK_YIELDED,
+    // on SHIT at a wait point: resume() goes on past it
+    TASK_WAITING,
+    TASK_HALTED,
+    TASK_FAULTED
+};
+
+/*
+ * A VM as a resumable task: resume() runs it for a slice of instructions
+ * at most and tells why it came back, all of its state staying in the VM
+ * itself. Guest programs wait for the host by halting on SHIT at one of
+ * the addresses given to waitAt(): the host fills in what the program
+ * waits for and resumes it past the SHIT.
+ */
+class VMTask {
+private:
+    VM &vm;
+    uint64_t slice;
+    std::vector<bool> waitPoints;
+    task_states state;
+
+public:
+    VMTask(VM &vm, uint64_t slice = 1024);
+
+    void waitAt(uint16_t ip);
+
+    task_states resume(void);
+
+    task_states getState(void);
+
+    VM &getVM(void);
+};
+
+/*
+ * Resumes the tasks it is given round-robin, on the calling thread. A task
+ * which waits is put aside and handed to onWait: it goes back in the round
+ * once woken up, by onWait itself or later on.
+ */
+class TaskScheduler {
+private:
+    std::deque<VMTask *> ready;
+    uint64_t waiting;
+    std::function<void(VMTask *)> onWait;
+
+public:
+    TaskScheduler(std::function<void(VMTask *)> onWait = NULL);
+
+    void spawn(VMTask *task);
+
+    void wake(VMTask *task);
+
+    // runs until no task is ready, returns how many of them wait
+    uint64_t run(void);
+};
+
+#ifdef __cpp_impl_coroutine
+/*
+ * With -std=c++20, a VMTask as a coroutine: every resume() runs the task
+ * for a slice and co_yields where it stopped, TASK_WAITING included, so
+ * that the host can fill in what it waits for before resuming. It returns
+ * once the task halts or faults, resume() keeps telling which. Only the
+ * frame of the loop below is allocated: the state of the program stays in
+ * its VM.
+ */
+class VMCoroutine {
+public:
+    struct promise_type;
+
+private:
+    std::coroutine_handle<promise_type> handle;
+
+    explicit VMCoroutine(std::coroutine_handle<promise_type> handle) : handle(handle) {
+    }
+
+public:
+    struct promise_type {
+        task_states state = TASK_YIELDED;
+
+        VMCoroutine get_return_object() {
+            return VMCoroutine(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        std::suspend_always initial_suspend() noexcept {
+            return {};
+        }
+
+        std::suspend_always final_suspend() noexcept {
+            return {};
+        }
+
+        std::suspend_always yield_value(task_states state) noexcept {
+            this->state = state;
+            return {};
+        }
+
+        void return_void() {
+        }
+
+        void unhandled_exception() {
+            std::terminate();
+        }
+    };
+
+    VMCoroutine(VMCoroutine &&other) noexcept : handle(other.handle) {
+        other.handle = NULL;
+    }
+
+    VMCoroutine(const VMCoroutine &) = delete;
+
+    ~VMCoroutine() {
+        if (handle) {
+            handle.destroy();
+        }
+    }
+
+    static VMCoroutine of(VMTask &task) {
+        task_states state;
+
+        do {
+            state = task.resume();
+            co_yield state;
+        } while (state == TASK_YIELDED || state == TASK_WAITING);
+    }
+
+    task_states resume(void) {
+        if (!handle.done()) {
+            handle.resume();
+        }
+        return handle.promise().state;
+    }
+
+    bool done(void) {
+        return handle.done();
+    }
+};
+#endif
+
+#endif
@@ -0,0 +1,1108 @@
+#include "vm.h"
+#include <inttypes.h>
+#include <string.h>
+
+/*
+ * Direct-threaded cores. Every opcode body lives in runFast and jumps
+ * straight to the next one through a computed goto (GCC's &&label), while
+ * R0 -> S3, IP, RP, SP and the flags are kept in locals and written back to
+ * the VM only when the run stops.
+ *
+ * ENGINE_THREADED fetches and checks the operands from the code section each
+ * time an instruction runs. ENGINE_PREDECODED does it once per address, the
+ * first time it gets there, and keeps the result in VM::decoded.
+ * ENGINE_BLOCKS decodes a whole basic block at once into a block_t: within
+ * a block it just steps to the next record, and a jump goes straight to the
+ * block it went to last time through the block's next pointers.
+ *
+ * The fast path only deals with well-formed instructions: operands fully
+ * inside the code section and registers between R0 and S3. Anything else is
+ * handed to the reference exec* handler so that quirks and faults stay
+ * exactly the same as with ENGINE_HANDLERS.
+ *
+ * ENGINE_VERIFIED is ENGINE_THREADED for the programs VM::verify accepts:
+ * what it proved once is not checked again, only register-based addresses,
+ * SP, divisors and the targets of JMPR and RETN are. Landing anywhere it
+ * did not look at hands the run over to ENGINE_THREADED.
+ *
+ * ENGINE_BLOCKS pays for a whole block out of the instruction budget when
+ * it enters it, and gives back what the block did not get to run because
+ * one of its instructions went through its handler. The other cores have
+ * no blocks to pay for: without a budget they don't look at it at all,
+ * with one they pay at every dispatch.
+ */
+
+// operands come from decoded records
+#define PREDECODED (ENGINE == ENGINE_PREDECODED || ENGINE == ENGINE_BLOCKS)
+#define BLOCKS (ENGINE == ENGINE_BLOCKS)
+// static checks are left to VM::verify
+#define VERIFIED (ENGINE == ENGINE_VERIFIED)
+
+#define LOAD()                                                                 \
+  do {                                                                         \
+    memcpy(r, regs, sizeof(r));                                                \
+    ip = regs[IP];                                                             \
+    rp = regs[RP];                                                             \
+    sp = regs[SP];                                                             \
+    zf = flags.ZF;                                                             \
+    cf = flags.CF;                                                             \
+    left = budget;                                                             \
+  } while (0)
+#define STORE()                                                                \
+  do {                                                                         \
+    memcpy(regs, r, sizeof(r));                                                \
+    regs[IP] = ip;                                                             \
+    regs[RP] = rp;                                                             \
+    regs[SP] = sp;                                                             \
+    flags.ZF = zf;                                                             \
+    flags.CF = cf;                                                             \
+    budget = left;                                                             \
+    as.markData(dataTop);                                                      \
+    as.markStack(stackTop);                                                    \
+  } while (0)
+// raises the high-water mark _top_ to _end_, the byte past a store
+#define MARK(_top_, _end_)                                                     \
+  do {                                                                         \
+    if ((uint32_t) (_end_) > _top_) {                                          \
+      _top_ = (_end_);                                                         \
+    }                                                                          \
+  } while (0)
+#define DISPATCH()                                                             \
+  do {                                                                         \
+    if (!VERIFIED && ip >= codesize) {                                         \
+      goto out_of_code;                                                        \
+    }                                                                          \
+    if (BLOCKS) {                                                              \
+      goto chain;                                                              \
+    }                                                                          \
+    if (COUNTED) {                                                             \
+      if (left == 0) {                                                         \
+        goto exhausted;                                                        \
+      }                                                                        \
+      left--;                                                                  \
+    }                                                                          \
+    if (PREDECODED) {                                                          \
+      d = &decodedAt[ip];                                                      \
+      goto *LABELS[d->op];                                                     \
+    }                                                                          \
+    goto *dispatch[code[ip]];                                                  \
+  } while (0)
+// towards an address only known at run time
+#define DISPATCH_ANY()                                                         \
+  do {                                                                         \
+    if (VERIFIED && (ip >= codesize || !verified[ip])) {                       \
+      goto unverified;                                                         \
+    }                                                                          \
+    DISPATCH();                                                                \
+  } while (0)
+#define NEXT(_len_)                                                            \
+  do {                                                                         \
+    ip += _len_;                                                               \
+    if (BLOCKS) {                                                              \
+      d++;                                                                     \
+      goto *LABELS[d->op];                                                     \
+    }                                                                          \
+    DISPATCH();                                                                \
+  } while (0)
+#define FAST(_reg_) ((_reg_) <= S3)
+#define IMM(_off_) (*((uint16_t *) &code[ip + (_off_)]))
+
+/*
+ * OPERAND FETCHING
+ * The reference layout is described in VMAddrSpace::getArgs. Predecoded
+ * operands went through the same checks in VM::decode.
+ */
+#define OPERANDS(_len_)                                                        \
+  do {                                                                         \
+    if (!VERIFIED && (uint32_t) ip + (_len_) > codesize) {                     \
+      goto slow;                                                               \
+    }                                                                          \
+  } while (0)
+// OP DST|SRC
+#define ARGS_RR(_len_)                                                         \
+  do {                                                                         \
+    if (PREDECODED) {                                                          \
+      dst = d->dst;                                                            \
+      src = d->src;                                                            \
+    } else {                                                                   \
+      OPERANDS(_len_);                                                         \
+      dst = code[ip + 1] >> 4;                                                 \
+      src = code[ip + 1] & 0b00001111;                                         \
+      if (!VERIFIED && (!FAST(dst) || !FAST(src))) {                           \
+        goto slow;                                                             \
+      }                                                                        \
+    }                                                                          \
+  } while (0)
+// OP DST IMM16
+#define ARGS_RI(_len_)                                                         \
+  do {                                                                         \
+    if (PREDECODED) {                                                          \
+      dst = d->dst;                                                            \
+      imm = d->imm;                                                            \
+    } else {                                                                   \
+      OPERANDS(_len_);                                                         \
+      dst = code[ip + 1];                                                      \
+      imm = IMM(2);                                                            \
+      if (!VERIFIED && !FAST(dst)) {                                           \
+        goto slow;                                                             \
+      }                                                                        \
+    }                                                                          \
+  } while (0)
+// OP DST IMM8
+#define ARGS_RB(_len_)                                                         \
+  do {                                                                         \
+    if (PREDECODED) {                                                          \
+      dst = d->dst;                                                            \
+      src = d->src;                                                            \
+    } else {                                                                   \
+      OPERANDS(_len_);                                                         \
+      dst = code[ip + 1];                                                      \
+      src = code[ip + 2];                                                      \
+      if (!VERIFIED && !FAST(dst)) {                                           \
+        goto slow;                                                             \
+      }                                                                        \
+    }                                                                          \
+  } while (0)
+// OP IMM16 SRC
+#define ARGS_IR(_len_)                                                         \
+  do {                                                                         \
+    if (PREDECODED) {                                                          \
+      imm = d->imm;                                                            \
+      src = d->src;                                                            \
+    } else {                                                                   \
+      OPERANDS(_len_);                                                         \
+      imm = IMM(1);                                                            \
+      src = code[ip + 3];                                                      \
+      if (!VERIFIED && (!FAST((uint8_t) imm) || !FAST(src))) {                 \
+        goto slow;                                                             \
+      }                                                                        \
+    }                                                                          \
+  } while (0)
+// OP REG
+#define ARGS_R(_len_)                                                          \
+  do {                                                                         \
+    if (PREDECODED) {                                                          \
+      dst = d->dst;                                                            \
+    } else {                                                                   \
+      OPERANDS(_len_);                                                         \
+      dst = code[ip + 1];                                                      \
+      if (!VERIFIED && !FAST(dst)) {                                           \
+        goto slow;                                                             \
+      }                                                                        \
+    }                                                                          \
+  } while (0)
+// OP IMM16
+#define ARGS_I(_len_)                                                          \
+  do {                                                                         \
+    if (PREDECODED) {                                                          \
+      imm = d->imm;                                                            \
+    } else {                                                                   \
+      OPERANDS(_len_);                                                         \
+      imm = IMM(1);                                                            \
+    }                                                                          \
+  } while (0)
+
+/*
+ * SUPERINSTRUCTIONS
+ */
+#define FIRED() fusionsFired[d->op - DEC_CMPR_JPAI]++
+/*
+ * Dispatch paid for the first instruction only. Without budget for the
+ * second one, the first one runs alone through its handler.
+ */
+#define PAIR()                                                                 \
+  do {                                                                         \
+    if (COUNTED) {                                                             \
+      if (left == 0) {                                                         \
+        goto slow;                                                             \
+      }                                                                        \
+      left--;                                                                  \
+    }                                                                          \
+  } while (0)
+#define CMP_JUMP(_lhs_, _rhs_, _taken_)                                        \
+  do {                                                                         \
+    PAIR();                                                                    \
+    zf = (_lhs_) == (_rhs_);                                                   \
+    cf = (_lhs_) <= (_rhs_);                                                   \
+    FIRED();                                                                   \
+    ip = (_taken_) ? d->imm2 : ip + d->length;                                 \
+    DISPATCH();                                                                \
+  } while (0)
+#define TAKEN_JPAI (!cf && !zf)
+#define TAKEN_JPBI (cf)
+#define TAKEN_JPEI (zf)
+#define TAKEN_JPNI (!zf)
+
+#define LABEL(_op_) &&do_##_op_
+
+template<engines ENGINE, bool COUNTED, bool WIDE>
+statuses VM::runFast(void) {
+#ifdef __GNUC__
+    static void *const LABELS[NUM_DECODED_OPS] = {
+            LABEL(MOVI), LABEL(MOVR), LABEL(LODI), LABEL(LODR), LABEL(STRI),
+            LABEL(STRR), LABEL(ADDI), LABEL(ADDR), LABEL(SUBI), LABEL(SUBR),
+            LABEL(ANDB), LABEL(ANDW), LABEL(ANDR), LABEL(YORB), LABEL(YORW),
+            LABEL(YORR), LABEL(XORB), LABEL(XORW), LABEL(XORR), LABEL(NOTR),
+            LABEL(MULI), LABEL(MULR), LABEL(DIVI), LABEL(DIVR), LABEL(SHLI),
+            LABEL(SHLR), LABEL(SHRI), LABEL(SHRR), LABEL(PUSH), LABEL(POOP),
+            LABEL(CMPB), LABEL(CMPW), LABEL(CMPR), LABEL(JMPI), LABEL(JMPR),
+            LABEL(JPAI), LABEL(JPAR), LABEL(JPBI), LABEL(JPBR), LABEL(JPEI),
+            LABEL(JPER), LABEL(JPNI), LABEL(JPNR), LABEL(CALL), LABEL(RETN),
+            LABEL(SHIT), LABEL(NOPE), LABEL(GRMN),
+#ifdef DBG
+            LABEL(DEBG),
+#endif
+            &&slow, LABEL(DECODE), LABEL(CHAIN),
+            LABEL(CMPR_JPAI), LABEL(CMPR_JPBI), LABEL(CMPR_JPEI), LABEL(CMPR_JPNI),
+            LABEL(CMPB_JPAI), LABEL(CMPB_JPBI), LABEL(CMPB_JPEI), LABEL(CMPB_JPNI),
+            LABEL(CMPW_JPAI), LABEL(CMPW_JPBI), LABEL(CMPW_JPEI), LABEL(CMPW_JPNI),
+            LABEL(MOVI_ADDR), LABEL(LODR_CMPB)
+    };
+    void *const *dispatch;
+    uint16_t r[S3 + 1], ip, rp, sp, imm = 0;
+    uint8_t zf, cf, dst = 0, src = 0;
+    uint64_t left;
+    uint8_t *code = as.getCode(), *data = as.dataSection(), *stack = as.stackSection();
+    // the marks of what this run stored, handed to as by STORE
+    uint32_t dataTop = 0, stackTop = 0;
+    uint32_t codesize = as.getCodesize(), datasize = as.getDatasize(), stacksize = as.getStacksize();
+    decoded_t *d = NULL, *end;
+    block_t *blk = NULL, *next_blk;
+    const instruction_t *instr_p;
+    uint32_t i;
+
+    if (!WIDE && wide) {
+        return runFast<ENGINE, COUNTED, true>();
+    }
+    if (!BLOCKS && !COUNTED && budget != UINT64_MAX) {
+        return runFast<ENGINE, true, WIDE>();
+    }
+    if (BLOCKS) {
+        if (blockAt.size() != codesize || blocksVersion != as.getCodeVersion()) {
+            blocks.clear();
+            blockAt.assign(codesize, NULL);
+            blocksVersion = as.getCodeVersion();
+        }
+    } else if (PREDECODED) {
+        if (decodedAt == NULL || decodedVersion != as.getCodeVersion()) {
+            predecode();
+        }
+    } else if (dispatchFor != LABELS) {
+        this->dispatch = dispatchTable(LABELS);
+        dispatchFor = LABELS;
+    }
+    dispatch = this->dispatch;
+    if (VERIFIED && !verify()) {
+        return runFast<ENGINE_THREADED, false, WIDE>();
+    }
+    LOAD();
+    DISPATCH_ANY();
+
+    do_DECODE:
+    decode(ip, d);
+    goto *LABELS[d->op];
+
+    do_CHAIN:
+    DISPATCH();
+    chain:
+    /*
+     * Block boundary: follow the successors seen so far, and remember the
+     * new one if there is still room for it.
+     */
+    if (blk != NULL && blk->next[0] != NULL && blk->next[0]->start == ip) {
+        blk = blk->next[0];
+    } else if (blk != NULL && blk->next[1] != NULL && blk->next[1]->start == ip) {
+        blk = blk->next[1];
+    } else {
+        next_blk = blockAt[ip] != NULL ? blockAt[ip] : translate(ip);
+        if (blk != NULL && blk->next[0] == NULL) {
+            blk->next[0] = next_blk;
+        } else if (blk != NULL && blk->next[1] == NULL) {
+            blk->next[1] = next_blk;
+        }
+        blk = next_blk;
+    }
+    if (blk->count > left) {
+        goto exhausted;
+    }
+    left -= blk->count;
+    blk->runs++;
+    d = blk->instrs.data();
+    goto *LABELS[d->op];
+
+    do_MOVI:
+    ARGS_RI(MOVI_SIZE);
+    r[dst] = imm;
+    NEXT(MOVI_SIZE);
+    do_MOVR:
+    ARGS_RR(MOVR_SIZE);
+    r[dst] = r[src];
+    NEXT(MOVR_SIZE);
+    do_LODI:
+    ARGS_RI(LODI_SIZE);
+    if (!VERIFIED && !WIDE && imm + sizeof(uint16_t) >= datasize) {
+        goto fault;
+    }
+    r[dst] = *((uint16_t *) &data[imm]);
+    NEXT(LODI_SIZE);
+    do_LODR:
+    ARGS_RR(LODR_SIZE);
+    if (!WIDE && r[src] + sizeof(uint16_t) >= datasize) {
+        goto fault;
+    }
+    r[dst] = *((uint16_t *) &data[r[src]]);
+    NEXT(LODR_SIZE);
+    do_STRI:
+    ARGS_IR(STRI_SIZE);
+    if (!VERIFIED && !WIDE && imm + sizeof(uint16_t) >= datasize) {
+        goto fault;
+    }
+    *((uint16_t *) &data[imm]) = r[src];
+    MARK(dataTop, imm + sizeof(uint16_t));
+    NEXT(STRI_SIZE);
+    do_STRR:
+    ARGS_RR(STRR_SIZE);
+    if (!WIDE && r[dst] + sizeof(uint16_t) >= datasize) {
+        goto fault;
+    }
+    *((uint16_t *) &data[r[dst]]) = r[src];
+    MARK(dataTop, r[dst] + sizeof(uint16_t));
+    NEXT(STRR_SIZE);
+    do_ADDI:
+    ARGS_RI(ADDI_SIZE);
+    r[dst] += imm;
+    NEXT(ADDI_SIZE);
+    do_ADDR:
+    ARGS_RR(ADDR_SIZE);
+    r[dst] += r[src];
+    NEXT(ADDR_SIZE);
+    do_SUBI:
+    ARGS_RI(SUBI_SIZE);
+    r[dst] -= imm;
+    NEXT(SUBI_SIZE);
+    do_SUBR:
+    ARGS_RR(SUBR_SIZE);
+    r[dst] -= r[src];
+    NEXT(SUBR_SIZE);
+    do_ANDB:
+    ARGS_RB(ANDB_SIZE);
+    r[dst] &= src;
+    NEXT(ANDB_SIZE);
+    do_ANDW:
+    ARGS_RI(ANDW_SIZE);
+    r[dst] &= imm;
+    NEXT(ANDW_SIZE);
+    do_ANDR:
+    ARGS_RR(ANDR_SIZE);
+    r[dst] &= r[src];
+    NEXT(ANDR_SIZE);
+    do_YORB:
+    ARGS_RB(YORB_SIZE);
+    r[dst] |= src;
+    NEXT(YORB_SIZE);
+    do_YORW:
+    ARGS_RI(YORW_SIZE);
+    r[dst] |= imm;
+    NEXT(YORW_SIZE);
+    do_YORR:
+    ARGS_RR(YORR_SIZE);
+    r[dst] |= r[src];
+    NEXT(YORR_SIZE);
+    do_XORB:
+    ARGS_RB(XORB_SIZE);
+    r[dst] ^= src;
+    NEXT(XORB_SIZE);
+    do_XORW:
+    ARGS_RI(XORW_SIZE);
+    r[dst] ^= imm;
+    NEXT(XORW_SIZE);
+    do_XORR:
+    ARGS_RR(XORR_SIZE);
+    r[dst] ^= r[src];
+    NEXT(XORR_SIZE);
+    do_NOTR:
+    ARGS_RR(NOTR_SIZE);
+    r[dst] = ~r[src];
+    NEXT(NOTR_SIZE);
+    do_MULI:
+    ARGS_RI(MULI_SIZE);
+    r[dst] *= imm;
+    NEXT(MULI_SIZE);
+    do_MULR:
+    ARGS_RR(MULR_SIZE);
+    r[dst] *= r[src];
+    NEXT(MULR_SIZE);
+    do_DIVI:
+    ARGS_RI(DIVI_SIZE);
+    if (imm == 0) {
+        goto fault;
+    }
+    r[dst] /= imm;
+    NEXT(DIVI_SIZE);
+    do_DIVR:
+    ARGS_RR(DIVR_SIZE);
+    // execDIVR only looks at the lower byte of the divisor
+    if ((uint8_t) r[src] == 0) {
+        goto fault;
+    }
+    r[dst] /= r[src];
+    NEXT(DIVR_SIZE);
+    /*
+     * Shifting by 16 or more is left to the handlers: it is undefined
+     * behaviour there and it has to stay whatever they do.
+     */
+    do_SHLI:
+    ARGS_RI(SHLI_SIZE);
+    if (imm > 15) {
+        goto slow;
+    }
+    r[dst] = r[dst] << imm;
+    NEXT(SHLI_SIZE);
+    do_SHLR:
+    ARGS_RR(SHLR_SIZE);
+    if (r[src] > 15) {
+        goto slow;
+    }
+    r[dst] = r[dst] << r[src];
+    NEXT(SHLR_SIZE);
+    do_SHRI:
+    ARGS_RI(SHRI_SIZE);
+    if (imm > 15) {
+        goto slow;
+    }
+    r[dst] = r[dst] >> imm;
+    NEXT(SHRI_SIZE);
+    do_SHRR:
+    ARGS_RR(SHRR_SIZE);
+    if (r[src] > 15) {
+        goto slow;
+    }
+    r[dst] = r[dst] >> r[src];
+    NEXT(SHRR_SIZE);
+    do_PUSH:
+    ARGS_R(PUSH_SIZE);
+    if (!WIDE && sp + sizeof(uint16_t) >= stacksize) {
+        goto fault;
+    }
+    memcpy(&stack[sp], &r[dst], sizeof(uint16_t));
+    MARK(stackTop, sp + sizeof(uint16_t));
+    sp += sizeof(uint16_t);
+    NEXT(PUSH_SIZE);
+    do_POOP:
+    ARGS_R(POOP_SIZE);
+    // execPOOP does not catch underflows, let it deal with them
+    if (sp < sizeof(uint16_t) || (!WIDE && sp > stacksize)) {
+        goto slow;
+    }
+    sp -= sizeof(uint16_t);
+    memcpy(&r[dst], &stack[sp], sizeof(uint16_t));
+    NEXT(POOP_SIZE);
+    do_CMPB:
+    ARGS_RB(CMPB_SIZE);
+    zf = (uint8_t) r[dst] == src;
+    cf = (uint8_t) r[dst] <= src;
+    NEXT(CMPB_SIZE);
+    do_CMPW:
+    ARGS_RI(CMPW_SIZE);
+    zf = r[dst] == imm;
+    cf = r[dst] <= imm;
+    NEXT(CMPW_SIZE);
+    do_CMPR:
+    ARGS_RR(CMPR_SIZE);
+    zf = r[dst] == r[src];
+    cf = r[dst] <= r[src];
+    NEXT(CMPR_SIZE);
+    do_JMPI:
+    ARGS_I(JMPI_SIZE);
+    ip = imm;
+    DISPATCH();
+    do_JMPR:
+    ARGS_R(JMPR_SIZE);
+    ip = r[dst];
+    DISPATCH_ANY();
+    /*
+     * As in the handlers, the register-based conditional jumps land on the
+     * register number, not on its content.
+     */
+    do_JPAI:
+    ARGS_I(JPAI_SIZE);
+    ip = (!cf && !zf) ? imm : ip + JPAI_SIZE;
+    DISPATCH();
+    do_JPAR:
+    ARGS_R(JPAR_SIZE);
+    ip = (!cf && !zf) ? dst : ip + JPAR_SIZE;
+    DISPATCH();
+    do_JPBI:
+    ARGS_I(JPBI_SIZE);
+    ip = cf ? imm : ip + JPBI_SIZE;
+    DISPATCH();
+    do_JPBR:
+    ARGS_R(JPBR_SIZE);
+    ip = cf ? dst : ip + JPBR_SIZE;
+    DISPATCH();
+    do_JPEI:
+    ARGS_I(JPEI_SIZE);
+    ip = zf ? imm : ip + JPEI_SIZE;
+    DISPATCH();
+    do_JPER:
+    ARGS_R(JPER_SIZE);
+    ip = zf ? dst : ip + JPER_SIZE;
+    DISPATCH();
+    do_JPNI:
+    ARGS_I(JPNI_SIZE);
+    ip = !zf ? imm : ip + JPNI_SIZE;
+    DISPATCH();
+    do_JPNR:
+    ARGS_R(JPNR_SIZE);
+    ip = !zf ? dst : ip + JPNR_SIZE;
+    DISPATCH();
+    do_CALL:
+    ARGS_I(CALL_SIZE);
+    if ((!WIDE && sp + sizeof(uint16_t) >= stacksize) || (!VERIFIED && (uint32_t) ip + CALL_SIZE >= codesize)) {
+        goto fault;
+    }
+    rp = ip + CALL_SIZE;
+    *((uint16_t *) &stack[sp]) = rp;
+    MARK(stackTop, sp + sizeof(uint16_t));
+    sp += sizeof(uint16_t);
+    ip = imm;
+    DISPATCH();
+    do_RETN:
+    sp -= sizeof(uint16_t);
+    ip = rp;
+    DISPATCH_ANY();
+    do_GRMN:
+    for (i = R0; i <= S3; i++) {
+        r[i] = 0x4747;
+    }
+    NEXT(GRMN_SIZE);
+    do_NOPE:
+    NEXT(NOPE_SIZE);
+    do_SHIT:
+    STORE();
+    DBG_INFO(("SHIT\n"));
+    DBG_INFO(("Finished.\n"));
+    return VM_HALTED;
+#ifdef DBG
+    do_DEBG:
+    goto slow;
+#endif
+
+    do_CMPR_JPAI:
+    CMP_JUMP(r[d->dst], r[d->src], TAKEN_JPAI);
+    do_CMPR_JPBI:
+    CMP_JUMP(r[d->dst], r[d->src], TAKEN_JPBI);
+    do_CMPR_JPEI:
+    CMP_JUMP(r[d->dst], r[d->src], TAKEN_JPEI);
+    do_CMPR_JPNI:
+    CMP_JUMP(r[d->dst], r[d->src], TAKEN_JPNI);
+    do_CMPB_JPAI:
+    CMP_JUMP((uint8_t) r[d->dst], d->src, TAKEN_JPAI);
+    do_CMPB_JPBI:
+    CMP_JUMP((uint8_t) r[d->dst], d->src, TAKEN_JPBI);
+    do_CMPB_JPEI:
+    CMP_JUMP((uint8_t) r[d->dst], d->src, TAKEN_JPEI);
+    do_CMPB_JPNI:
+    CMP_JUMP((uint8_t) r[d->dst], d->src, TAKEN_JPNI);
+    do_CMPW_JPAI:
+    CMP_JUMP(r[d->dst], d->imm, TAKEN_JPAI);
+    do_CMPW_JPBI:
+    CMP_JUMP(r[d->dst], d->imm, TAKEN_JPBI);
+    do_CMPW_JPEI:
+    CMP_JUMP(r[d->dst], d->imm, TAKEN_JPEI);
+    do_CMPW_JPNI:
+    CMP_JUMP(r[d->dst], d->imm, TAKEN_JPNI);
+    do_MOVI_ADDR:
+    PAIR();
+    r[d->dst] = d->imm;
+    r[d->dst2] += r[d->src2];
+    FIRED();
+    NEXT(d->length);
+    do_LODR_CMPB:
+    PAIR();
+    if (!WIDE && r[d->src] + sizeof(uint16_t) >= datasize) {
+        goto fault;
+    }
+    r[d->dst] = *((uint16_t *) &data[r[d->src]]);
+    zf = (uint8_t) r[d->dst2] == d->src2;
+    cf = (uint8_t) r[d->dst2] <= d->src2;
+    FIRED();
+    NEXT(d->length);
+
+    slow:
+    /*
+     * Run a single instruction through its handler, then pick up from
+     * whatever state it left.
+     */
+    if (BLOCKS) {
+        for (end = blk->instrs.data() + blk->instrs.size(), d++; d < end; d++) {
+            left += instructions(d->op);
+        }
+    }
+    STORE();
+    instr_p = DECODE[code[ip]];
+    if (!(this->*(instr_p->exec))()) {
+        DBG_ERROR(("%s failed.\n", instr_p->name));
+        DBG_INFO(("Finished.\n"));
+        return VM_FAULTED;
+    }
+    if (!instr_p->isJump) {
+        regs[IP] += instr_p->length;
+    }
+    LOAD();
+    DISPATCH_ANY();
+
+    unverified:
+    STORE();
+    return runFast<ENGINE_THREADED, false, WIDE>();
+
+    exhausted:
+    STORE();
+    return VM_EXHAUSTED;
+
+    fault:
+    STORE();
+    DBG_ERROR(("%s failed.\n", DECODE[code[ip]]->name));
+    DBG_INFO(("Finished.\n"));
+    return VM_FAULTED;
+
+    out_of_code:
+    STORE();
+    DBG_ERROR(("Out of bounds: IP is outside the code section.\n"));
+    DBG_INFO(("Finished.\n"));
+    return VM_FAULTED;
+#else
+    return runHandlers();
+#endif
+}
+
+template statuses VM::runFast<ENGINE_THREADED>(void);
+
+template statuses VM::runFast<ENGINE_PREDECODED>(void);
+
+template statuses VM::runFast<ENGINE_BLOCKS>(void);
+
+template statuses VM::runFast<ENGINE_VERIFIED>(void);
+
+enum formats {
+    // OP DST|SRC
+    FMT_RR,
+    // OP DST IMM16
+    FMT_RI,
+    // OP DST IMM8
+    FMT_RB,
+    // OP IMM16 SRC
+    FMT_IR,
+    // OP REG
+    FMT_R,
+    // OP IMM16
+    FMT_I,
+    // OP
+    FMT_NONE,
+    // always left to the handler
+    FMT_SLOW
+};
+
+static const uint8_t FORMATS[NUM_OPS] = {
+        FMT_RI, FMT_RR, FMT_RI, FMT_RR, FMT_IR, FMT_RR, FMT_RI, FMT_RR, // MOVI -> ADDR
+        FMT_RI, FMT_RR, FMT_RB, FMT_RI, FMT_RR, FMT_RB, FMT_RI, FMT_RR, // SUBI -> YORR
+        FMT_RB, FMT_RI, FMT_RR, FMT_RR, FMT_RI, FMT_RR, FMT_RI, FMT_RR, // XORB -> DIVR
+        FMT_RI, FMT_RR, FMT_RI, FMT_RR, FMT_R, FMT_R, FMT_RB, FMT_RI,   // SHLI -> CMPW
+        FMT_RR, FMT_I, FMT_R, FMT_I, FMT_R, FMT_I, FMT_R, FMT_I,        // CMPR -> JPEI
+        FMT_R, FMT_I, FMT_R, FMT_I, FMT_NONE, FMT_NONE, FMT_NONE,       // JPER -> NOPE
+        FMT_NONE,                                                       // GRMN
+#ifdef DBG
+        FMT_SLOW                                                        // DEBG
+#endif
+};
+
+/*
+ * Fills d with the instruction at ip, fused with the following one when the
+ * pair has a superinstruction.
+ */
+/*
+ * Points decodedAt to the records of the current code: the VM's own, filled
+ * lazily, or for a CodeImage the image's, decoded all at once by the first
+ * VM to run it with this instruction set and shared by all of them.
+ */
+void VM::predecode(void) {
+    const CodeImage *image = as.getCodeImage();
+    uint32_t codesize = as.getCodesize(), i;
+    std::shared_ptr<std::vector<decoded_t>> table;
+
+    decodedVersion = as.getCodeVersion();
+    sharedDecoded.reset();
+    if (image == NULL) {
+        decoded.assign(codesize, {DEC_UNDECODED, 0, 0, 0, 0, 0, 0, 0});
+        decodedAt = decoded.data();
+        return;
+    }
+    decoded.clear();
+    std::lock_guard<std::mutex> locked(image->lock);
+    for (auto &derived : image->derived) {
+        if (derived.first == iset) {
+            sharedDecoded = std::static_pointer_cast<const std::vector<decoded_t>>(derived.second);
+            break;
+        }
+    }
+    if (!sharedDecoded) {
+        table = std::make_shared<std::vector<decoded_t>>(codesize);
+        for (i = 0; i < codesize; i++) {
+            decode(i, &(*table)[i]);
+        }
+        image->derived.emplace_back(iset, table);
+        sharedDecoded = table;
+    }
+    // every record is decoded already, so runFast never writes to them
+    decodedAt = const_cast<decoded_t *>(sharedDecoded->data());
+    return;
+}
+
+void VM::decode(uint16_t ip, decoded_t *d) {
+    decodeOne(ip, d);
+    fuse(ip, d);
+    return;
+}
+
+/*
+ * Fills d with the instruction at ip alone. It is marked as DEC_SLOW
+ * whenever runFast could not run it on its own, see ARGS_* above.
+ */
+void VM::decodeOne(uint16_t ip, decoded_t *d) {
+    uint8_t *code = as.getCode();
+    const instruction_t *instr_p = DECODE[code[ip]];
+    uint8_t op = instr_p - INSTR;
+
+    d->op = DEC_SLOW;
+    d->length = instr_p->length;
+    d->dst = 0;
+    d->src = 0;
+    d->imm = 0;
+    d->dst2 = 0;
+    d->src2 = 0;
+    d->imm2 = 0;
+    if (instr_p == WAT || (uint32_t) ip + instr_p->length > as.getCodesize()) {
+        return;
+    }
+    switch (FORMATS[op]) {
+    case FMT_RR:
+        d->dst = code[ip + 1] >> 4;
+        d->src = code[ip + 1] & 0b00001111;
+        if (!FAST(d->dst) || !FAST(d->src)) {
+            return;
+        }
+        break;
+    case FMT_RI:
+        d->dst = code[ip + 1];
+        d->imm = *((uint16_t *) &code[ip + 2]);
+        if (!FAST(d->dst)) {
+            return;
+        }
+        break;
+    case FMT_RB:
+        d->dst = code[ip + 1];
+        d->src = code[ip + 2];
+        if (!FAST(d->dst)) {
+            return;
+        }
+        break;
+    case FMT_IR:
+        d->imm = *((uint16_t *) &code[ip + 1]);
+        d->src = code[ip + 3];
+        if (!FAST((uint8_t) d->imm) || !FAST(d->src)) {
+            return;
+        }
+        break;
+    case FMT_R:
+        d->dst = code[ip + 1];
+        if (!FAST(d->dst)) {
+            return;
+        }
+        break;
+    case FMT_I:
+        d->imm = *((uint16_t *) &code[ip + 1]);
+        break;
+    case FMT_NONE:
+        break;
+    default:
+        return;
+    }
+    d->op = op;
+    return;
+}
+
+/*
+ * The instruction following d keeps its own record, decoded when it is
+ * reached, so jumping right in the middle of a superinstruction still works.
+ */
+void VM::fuse(uint16_t ip, decoded_t *d) {
+    uint32_t next_ip = (uint32_t) ip + d->length;
+    decoded_t next_instr, *next = &next_instr;
+    uint8_t op = DEC_SLOW;
+
+    if (d->op != CMPR && d->op != CMPB && d->op != CMPW && d->op != MOVI && d->op != LODR) {
+        return;
+    }
+    if (next_ip >= as.getCodesize()) {
+        return;
+    }
+    decodeOne(next_ip, next);
+
+    switch (next->op) {
+    case JPAI:
+    case JPBI:
+    case JPEI:
+    case JPNI:
+        if (d->op == CMPR) {
+            op = DEC_CMPR_JPAI;
+        } else if (d->op == CMPB) {
+            op = DEC_CMPB_JPAI;
+        } else if (d->op == CMPW) {
+            op = DEC_CMPW_JPAI;
+        } else {
+            return;
+        }
+        // same order as the jumps in INSTR_ENUM: JPAI, JPBI, JPEI, JPNI
+        op += (next->op - JPAI) / 2;
+        d->imm2 = next->imm;
+        break;
+    case ADDR:
+        if (d->op != MOVI) {
+            return;
+        }
+        op = DEC_MOVI_ADDR;
+        d->dst2 = next->dst;
+        d->src2 = next->src;
+        break;
+    case CMPB:
+        if (d->op != LODR) {
+            return;
+        }
+        op = DEC_LODR_CMPB;
+        d->dst2 = next->dst;
+        d->src2 = next->src;
+        break;
+    default:
+        return;
+    }
+    d->op = op;
+    d->length += next->length;
+    return;
+}
+
+uint64_t VM::fusions(void) {
+    uint64_t total = 0;
+    uint32_t i;
+
+    for (i = 0; i < NUM_DECODED_OPS - DEC_CMPR_JPAI; i++) {
+        total += fusionsFired[i];
+    }
+    return total;
+}
+
+/*
+ * Prints how many times every superinstruction ran.
+ */
+void VM::fusionReport(void) {
+    static const char *names[NUM_DECODED_OPS - DEC_CMPR_JPAI] = {
+            "CMPR+JPAI", "CMPR+JPBI", "CMPR+JPEI", "CMPR+JPNI",
+            "CMPB+JPAI", "CMPB+JPBI", "CMPB+JPEI", "CMPB+JPNI",
+            "CMPW+JPAI", "CMPW+JPBI", "CMPW+JPEI", "CMPW+JPNI",
+            "MOVI+ADDR", "LODR+CMPB"
+    };
+    uint32_t i;
+
+    printf("Superinstructions:\n");
+    for (i = 0; i < NUM_DECODED_OPS - DEC_CMPR_JPAI; i++) {
+        if (fusionsFired[i]) {
+            printf("\t%s: %" PRIu64 "\n", names[i], fusionsFired[i]);
+        }
+    }
+    printf("\tTotal: %" PRIu64 "\n", fusions());
+    return;
+}
+
+/*
+ * Jumps, SHIT and whatever goes through the handlers end a block: control
+ * may go anywhere after them.
+ */
+bool VM::endsBlock(uint8_t op) {
+    if (op < NUM_OPS) {
+        return INSTR[op].isJump || op == SHIT;
+    }
+    return op == DEC_SLOW || (op >= DEC_CMPR_JPAI && op <= DEC_CMPW_JPNI);
+}
+
+// how many instructions a record runs
+uint8_t VM::instructions(uint8_t op) {
+    if (op == DEC_CHAIN) {
+        return 0;
+    }
+    return op >= DEC_CMPR_JPAI ? 2 : 1;
+}
+
+/*
+ * Decodes the basic block starting at ip into instrs. A block running into
+ * the end of the code section gets a DEC_CHAIN record so that its user
+ * notices it.
+ */
+void VM::decodeBlock(uint16_t ip, std::vector<decoded_t> &instrs) {
+    uint32_t cur = ip;
+    decoded_t d;
+
+    while (true) {
+        decode(cur, &d);
+        instrs.push_back(d);
+        if (endsBlock(d.op)) {
+            break;
+        }
+        cur += d.length;
+        if (cur >= as.getCodesize()) {
+            instrs.push_back({DEC_CHAIN, 0, 0, 0, 0, 0, 0, 0});
+            break;
+        }
+    }
+    return;
+}
+
+VM::block_t *VM::translate(uint16_t ip) {
+    block_t *blk;
+
+    blocks.emplace_back(new block_t());
+    blk = blocks.back().get();
+    blk->start = ip;
+    blk->next[0] = NULL;
+    blk->next[1] = NULL;
+    blk->runs = 0;
+    decodeBlock(ip, blk->instrs);
+    blk->count = 0;
+    for (decoded_t &d : blk->instrs) {
+        blk->count += instructions(d.op);
+    }
+    blockAt[ip] = blk;
+    return blk;
+}
+
+/*
+ * Prints every block ENGINE_BLOCKS translated and how many times it ran.
+ */
+void VM::blockReport(void) {
+    uint32_t i;
+
+    printf("Blocks:\n");
+    for (i = 0; i < blockAt.size(); i++) {
+        if (blockAt[i] != NULL) {
+            printf("\t0x%04x: %zu records, %" PRIu64 " runs\n", i, blockAt[i]->instrs.size(), blockAt[i]->runs);
+        }
+    }
+    return;
+}
+
+/*
+ * Checks the instruction at ip as much as runFast<ENGINE_VERIFIED> trusts
+ * it, and adds to next wherever it can send control without looking at a
+ * register. JMPR and RETN are checked when they run.
+ */
+bool VM::verifyOne(uint16_t ip, std::vector<uint16_t> &next) {
+    uint8_t *code = as.getCode();
+    uint32_t codesize = as.getCodesize(), datasize = as.getDatasize();
+    const instruction_t *instr_p = DECODE[code[ip]];
+    uint8_t op = instr_p - INSTR;
+    uint32_t end = (uint32_t) ip + instr_p->length, target;
+
+    if (instr_p == WAT || end > codesize) {
+        return false;
+    }
+    switch (FORMATS[op]) {
+    case FMT_RR:
+        if (!FAST(code[ip + 1] >> 4) || !FAST(code[ip + 1] & 0b00001111)) {
+            return false;
+        }
+        break;
+    case FMT_RI:
+    case FMT_RB:
+    case FMT_R:
+        if (!FAST(code[ip + 1])) {
+            return false;
+        }
+        break;
+    case FMT_IR:
+        // execSTRI wants the lower byte of the address to be a register
+        if (!FAST(code[ip + 1]) || !FAST(code[ip + 3])) {
+            return false;
+        }
+        break;
+    default:
+        break;
+    }
+
+    switch (op) {
+    case LODI:
+        if (*((uint16_t *) &code[ip + 2]) + sizeof(uint16_t) >= datasize) {
+            return false;
+        }
+        break;
+    case STRI:
+        if (*((uint16_t *) &code[ip + 1]) + sizeof(uint16_t) >= datasize) {
+            return false;
+        }
+        break;
+    case SHIT:
+    case JMPR:
+    case RETN:
+        return true;
+    default:
+        break;
+    }
+
+    if (INSTR[op].isJump) {
+        // the register-based conditional jumps land on the register number
+        target = FORMATS[op] == FMT_R ? code[ip + 1] : *((uint16_t *) &code[ip + 1]);
+        if (target >= codesize) {
+            return false;
+        }
+        next.push_back(target);
+        if (op == JMPI) {
+            return true;
+        }
+    }
+    // CALL pushes end as the return address, execCALL wants it in code
+    if (end >= codesize) {
+        return false;
+    }
+    next.push_back(end);
+    return true;
+}
+
+/*
+ * Walks every instruction reachable from address 0 without going through
+ * JMPR or RETN, once per code version. A program passes when all of them
+ * decode to a known instruction with operands inside the code section,
+ * name registers between R0 and S3, read and write data at immediate
+ * addresses inside the data section and never send control outside the
+ * code section. Tells whether the loaded program passes.
+ */
+bool VM::verify(void) {
+    std::vector<uint16_t> todo;
+    uint32_t codesize = as.getCodesize();
+    uint16_t ip;
+
+    if (verified.size() == codesize && verifiedVersion == as.getCodeVersion()) {
+        return verifiedOk;
+    }
+    verified.assign(codesize, false);
+    verifiedVersion = as.getCodeVersion();
+    verifiedOk = codesize > 0;
+    if (verifiedOk) {
+        todo.push_back(0);
+    }
+    while (verifiedOk && !todo.empty()) {
+        ip = todo.back();
+        todo.pop_back();
+        if (!verified[ip]) {
+            verified[ip] = true;
+            verifiedOk = verifyOne(ip, todo);
+        }
+    }
+    return verifiedOk;
+}
@@ -1,12 +1,162 @@
 #include "vm.h"
 #include <string.h>
+#include <map>
+#include <mutex>
+#include <string>
 #include <stdexcept>
 
-void VM::encryptOpcodes(uint8_t *key) {
+#if defined(__unix__) || defined(__APPLE__)
+#define CHECKPOINT_SUPPORTED
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// "PSTCCKPT", which a host with the other byte order reads backwards
+#define CHECKPOINT_MAGIC 0x54504b4343545350ULL
+
+/*
+ * The start of a checkpoint file, in host byte order. The sections follow
+ * it, see VMAddrSpace::snapshot(int, uint64_t).
+ */
+typedef struct checkpoint_header {
+    uint64_t magic;
+    uint32_t version;
+    uint8_t engine;
+    uint8_t options;
+    uint16_t flagsWord;
+    uint64_t fingerprint;
+    uint16_t regs[NUM_REGS];
+    uint32_t codesize, datasize, stacksize, dataDirty, stackDirty;
+    uint64_t codeAt, dataAt, stackAt;
+} checkpoint_header_t;
+
+#ifdef DBG
+const VM::instruction_t VM::INSTRUCTIONS[NUM_OPS] = {
+        {"MOVI", 0, MOVI_SIZE, &VM::execMOVI, false},
+        {"MOVR", 0, MOVR_SIZE, &VM::execMOVR, false},
+        {"LODI", 0, LODI_SIZE, &VM::execLODI, false},
+        {"LODR", 0, LODR_SIZE, &VM::execLODR, false},
+        {"STRI", 0, STRI_SIZE, &VM::execSTRI, false},
+        {"STRR", 0, STRR_SIZE, &VM::execSTRR, false},
+        {"ADDI", 0, ADDI_SIZE, &VM::execADDI, false},
+        {"ADDR", 0, ADDR_SIZE, &VM::execADDR, false},
+        {"SUBI", 0, SUBI_SIZE, &VM::execSUBI, false},
+        {"SUBR", 0, SUBR_SIZE, &VM::execSUBR, false},
+        {"ANDB", 0, ANDB_SIZE, &VM::execANDB, false},
+        {"ANDW", 0, ANDW_SIZE, &VM::execANDW, false},
+        {"ANDR", 0, ANDR_SIZE, &VM::execANDR, false},
+        {"YORB", 0, YORB_SIZE, &VM::execYORB, false},
+        {"YORW", 0, YORW_SIZE, &VM::execYORW, false},
+        {"YORR", 0, YORR_SIZE, &VM::execYORR, false},
+        {"XORB", 0, XORB_SIZE, &VM::execXORB, false},
+        {"XORW", 0, XORW_SIZE, &VM::execXORW, false},
+        {"XORR", 0, XORR_SIZE, &VM::execXORR, false},
+        {"NOTR", 0, NOTR_SIZE, &VM::execNOTR, false},
+        {"MULI", 0, MULI_SIZE, &VM::execMULI, false},
+        {"MULR", 0, MULR_SIZE, &VM::execMULR, false},
+        {"DIVI", 0, DIVI_SIZE, &VM::execDIVI, false},
+        {"DIVR", 0, DIVR_SIZE, &VM::execDIVR, false},
+        {"SHLI", 0, SHLI_SIZE, &VM::execSHLI, false},
+        {"SHLR", 0, SHLR_SIZE, &VM::execSHLR, false},
+        {"SHRI", 0, SHRI_SIZE, &VM::execSHRI, false},
+        {"SHRR", 0, SHRR_SIZE, &VM::execSHRR, false},
+        {"PUSH", 0, PUSH_SIZE, &VM::execPUSH, false},
+        {"POOP", 0, POOP_SIZE, &VM::execPOOP, false},
+        {"CMPB", 0, CMPB_SIZE, &VM::execCMPB, false},
+        {"CMPW", 0, CMPW_SIZE, &VM::execCMPW, false},
+        {"CMPR", 0, CMPR_SIZE, &VM::execCMPR, false},
+        {"JMPI", 0, JMPI_SIZE, &VM::execJMPI, true},
+        {"JMPR", 0, JMPR_SIZE, &VM::execJMPR, true},
+        {"JPAI", 0, JPAI_SIZE, &VM::execJPAI, true},
+        {"JPAR", 0, JPAR_SIZE, &VM::execJPAR, true},
+        {"JPBI", 0, JPBI_SIZE, &VM::execJPBI, true},
+        {"JPBR", 0, JPBR_SIZE, &VM::execJPBR, true},
+        {"JPEI", 0, JPEI_SIZE, &VM::execJPEI, true},
+        {"JPER", 0, JPER_SIZE, &VM::execJPER, true},
+        {"JPNI", 0, JPNI_SIZE, &VM::execJPNI, true},
+        {"JPNR", 0, JPNR_SIZE, &VM::execJPNR, true},
+        {"CALL", 0, CALL_SIZE, &VM::execCALL, true},
+        {"RETN", 0, RETN_SIZE, &VM::execRETN, true},
+        {"SHIT", 0, SHIT_SIZE, &VM::execSHIT, false},
+        {"NOPE", 0, NOPE_SIZE, &VM::execNOPE, false},
+        {"GRMN", 0, GRMN_SIZE, &VM::execGRMN, false},
+        {"DEBG", 0, DEBG_SIZE, &VM::execDEBG, false}
+};
+#else
+const VM::instruction_t VM::INSTRUCTIONS[NUM_OPS] = {
+        {"MOVI", 0, MOVI_SIZE, &VM::execMOVI, false},
+        {"MOVR", 0, MOVR_SIZE, &VM::execMOVR, false},
+        {"LODI", 0, LODI_SIZE, &VM::execLODI, false},
+        {"LODR", 0, LODR_SIZE, &VM::execLODR, false},
+        {"STRI", 0, STRI_SIZE, &VM::execSTRI, false},
+        {"STRR", 0, STRR_SIZE, &VM::execSTRR, false},
+        {"ADDI", 0, ADDI_SIZE, &VM::execADDI, false},
+        {"ADDR", 0, ADDR_SIZE, &VM::execADDR, false},
+        {"SUBI", 0, SUBI_SIZE, &VM::execSUBI, false},
+        {"SUBR", 0, SUBR_SIZE, &VM::execSUBR, false},
+        {"ANDB", 0, ANDB_SIZE, &VM::execANDB, false},
+        {"ANDW", 0, ANDW_SIZE, &VM::execANDW, false},
+        {"ANDR", 0, ANDR_SIZE, &VM::execANDR, false},
+        {"YORB", 0, YORB_SIZE, &VM::execYORB, false},
+        {"YORW", 0, YORW_SIZE, &VM::execYORW, false},
+        {"YORR", 0, YORR_SIZE, &VM::execYORR, false},
+        {"XORB", 0, XORB_SIZE, &VM::execXORB, false},
+        {"XORW", 0, XORW_SIZE, &VM::execXORW, false},
+        {"XORR", 0, XORR_SIZE, &VM::execXORR, false},
+        {"NOTR", 0, NOTR_SIZE, &VM::execNOTR, false},
+        {"MULI", 0, MULI_SIZE, &VM::execMULI, false},
+        {"MULR", 0, MULR_SIZE, &VM::execMULR, false},
+        {"DIVI", 0, DIVI_SIZE, &VM::execDIVI, false},
+        {"DIVR", 0, DIVR_SIZE, &VM::execDIVR, false},
+        {"SHLI", 0, SHLI_SIZE, &VM::execSHLI, false},
+        {"SHLR", 0, SHLR_SIZE, &VM::execSHLR, false},
+        {"SHRI", 0, SHRI_SIZE, &VM::execSHRI, false},
+        {"SHRR", 0, SHRR_SIZE, &VM::execSHRR, false},
+        {"PUSH", 0, PUSH_SIZE, &VM::execPUSH, false},
+        {"POOP", 0, POOP_SIZE, &VM::execPOOP, false},
+        {"CMPB", 0, CMPB_SIZE, &VM::execCMPB, false},
+        {"CMPW", 0, CMPW_SIZE, &VM::execCMPW, false},
+        {"CMPR", 0, CMPR_SIZE, &VM::execCMPR, false},
+        {"JMPI", 0, JMPI_SIZE, &VM::execJMPI, true},
+        {"JMPR", 0, JMPR_SIZE, &VM::execJMPR, true},
+        {"JPAI", 0, JPAI_SIZE, &VM::execJPAI, true},
+        {"JPAR", 0, JPAR_SIZE, &VM::execJPAR, true},
+        {"JPBI", 0, JPBI_SIZE, &VM::execJPBI, true},
+        {"JPBR", 0, JPBR_SIZE, &VM::execJPBR, true},
+        {"JPEI", 0, JPEI_SIZE, &VM::execJPEI, true},
+        {"JPER", 0, JPER_SIZE, &VM::execJPER, true},
+        {"JPNI", 0, JPNI_SIZE, &VM::execJPNI, true},
+        {"JPNR", 0, JPNR_SIZE, &VM::execJPNR, true},
+        {"CALL", 0, CALL_SIZE, &VM::execCALL, true},
+        {"RETN", 0, RETN_SIZE, &VM::execRETN, true},
+        {"SHIT", 0, SHIT_SIZE, &VM::execSHIT, false},
+        {"NOPE", 0, NOPE_SIZE, &VM::execNOPE, false},
+        {"GRMN", 0, GRMN_SIZE, &VM::execGRMN, false},
+};
+#endif
+
+/*
+ * Sets built so far, by key. A set lives as long as some VM holds it, or
+ * while it is the last one asked for, so that building one VM after the
+ * other with the same key does not build it every time.
+ */
+std::shared_ptr<const VM::instruction_set_t> VM::instructionSet(uint8_t *key) {
+    static std::mutex lock;
+    static std::map<std::string, std::weak_ptr<const instruction_set_t>> sets;
+    static std::shared_ptr<const instruction_set_t> last;
+    std::lock_guard<std::mutex> locked(lock);
+    std::weak_ptr<const instruction_set_t> &cached = sets[std::string((char *) key)];
+    std::shared_ptr<const instruction_set_t> found = cached.lock();
+    std::shared_ptr<instruction_set_t> built;
+    instruction_set_t *set;
     uint8_t arr[256];
     uint32_t i, j, tmp, keysize;
-    keysize = strlen((char *) key);
 
+    if (found) {
+        last = found;
+        return found;
+    }
+    keysize = strlen((char *) key);
     DBG_INFO(("Encrypting instructions using key: %s\n", key));
     /*
     RC4 KSA! :-D
@@ -21,16 +171,52 @@ void VM::encryptOpcodes(uint8_t *key) {
         arr[i] = arr[j];
         arr[j] = tmp;
     }
+    built = std::make_shared<instruction_set_t>();
+    set = built.get();
+    set->WAT = {"WAT", 0, SINGLE, &VM::execWAT, false};
+    for (i = 0; i < 256; i++) {
+        set->DECODE[i] = &set->WAT;
+    }
     for (i = 0; i < NUM_OPS; i++) {
-        INSTR[i].value = arr[i];
+        set->INSTR[i] = INSTRUCTIONS[i];
+        set->INSTR[i].value = arr[i];
+        set->DECODE[set->INSTR[i].value] = &set->INSTR[i];
     }
 #ifdef DBG
     DBG_INFO(("~~~~~~~~~~\nOPCODES:\n"));
     for (i = 0; i < NUM_OPS; i++) {
-        DBG_INFO(("%s: 0x%x\n", INSTR[i].name, INSTR[i].value));
+        DBG_INFO(("%s: 0x%x\n", set->INSTR[i].name, set->INSTR[i].value));
     }
     DBG_INFO(("~~~~~~~~~~\n"));
 #endif
+    cached = built;
+    last = built;
+    return built;
+}
+
+void *const *VM::dispatchTable(void *const *labels) {
+    std::lock_guard<std::mutex> locked(iset->lock);
+    std::unique_ptr<void *[]> table;
+    uint32_t i;
+
+    for (auto &built : iset->dispatch) {
+        if (built.first == labels) {
+            return built.second.get();
+        }
+    }
+    table.reset(new void *[256]);
+    for (i = 0; i < 256; i++) {
+        table[i] = labels[DECODE[i] == WAT ? DEC_SLOW : DECODE[i] - INSTR];
+    }
+    iset->dispatch.emplace_back(labels, std::move(table));
+    return iset->dispatch.back().second.get();
+}
+
+void VM::encryptOpcodes(uint8_t *key) {
+    iset = instructionSet(key);
+    INSTR = iset->INSTR;
+    WAT = &iset->WAT;
+    DECODE = iset->DECODE;
     return;
 }
 
@@ -87,25 +273,74 @@ void VM::status(void) {
 /*
 CONSTRUCTORS
 */
-VM::VM(uint8_t *key) {
+VM::VM(uint8_t *key, engines engine, uint8_t options, std::pmr::memory_resource *resource)
+        : engine(engine), as(DEFAULT_STACKSIZE, DEFAULT_CODESIZE, DEFAULT_DATASIZE, options, resource) {
     DBG_SUCC(("Creating VM without code.\n"));
     initVariables();
     encryptOpcodes(key);
 }
 
-VM::VM(uint8_t *key, uint8_t *code, uint32_t codesize) {
+VM::VM(uint8_t *key, uint8_t *code, uint32_t codesize, engines engine, uint8_t options,
+       std::pmr::memory_resource *resource)
+        : engine(engine), as(DEFAULT_STACKSIZE, DEFAULT_CODESIZE, DEFAULT_DATASIZE, options, resource) {
     DBG_SUCC(("Creating VM with code.\n"));
     as.insCode(code, codesize);
     initVariables();
     encryptOpcodes(key);
 }
 
+VM::VM(uint8_t *key, std::shared_ptr<const CodeImage> image, engines engine, uint8_t options,
+       std::pmr::memory_resource *resource)
+        : engine(engine), as(DEFAULT_STACKSIZE, 0, DEFAULT_DATASIZE, options, resource) {
+    DBG_SUCC(("Creating VM with a shared image.\n"));
+    if (!as.shareCode(image)) {
+        throw std::invalid_argument("Couldn't share the code image.");
+    }
+    initVariables();
+    encryptOpcodes(key);
+}
+
+// the snapshot a VM is made from, before any member is built out of it
+static const VMSnapshot &snapshotOf(const std::shared_ptr<const VMSnapshot> &snapshot) {
+    if (!snapshot) {
+        throw std::invalid_argument("No snapshot to create the VM from.");
+    }
+    return *snapshot;
+}
+
+VM::VM(std::shared_ptr<const VMSnapshot> snapshot, std::pmr::memory_resource *resource)
+        : engine(snapshotOf(snapshot).engine), as(snapshot->space, resource) {
+    DBG_SUCC(("Creating VM from a snapshot.\n"));
+    initVariables();
+    memcpy(regs, snapshot->regs, sizeof(snapshot->regs));
+    memcpy(&flags, &snapshot->flagsWord, sizeof(snapshot->flagsWord));
+    iset = snapshot->iset;
+    INSTR = iset->INSTR;
+    WAT = &iset->WAT;
+    DECODE = iset->DECODE;
+}
+
 void VM::initVariables(void) {
     uint8_t i;
 
     for (i = R0; i < NUM_REGS; i++) {
         this->regs[i] = 0;
     }
+    memset(&flags, 0, sizeof(uint16_t));
+    decodedVersion = 0;
+    decodedAt = NULL;
+    blocksVersion = 0;
+    jitVersion = 0;
+    jitEnter = NULL;
+    jitExit = NULL;
+    budget = 0;
+    tracesCompiled = 0;
+    verifiedVersion = 0;
+    verifiedOk = false;
+    wide = as.getOptions() & AS_WIDE;
+    dispatch = NULL;
+    dispatchFor = NULL;
+    memset(fusionsFired, 0, sizeof(fusionsFired));
     return;
 }
 
@@ -175,11 +410,11 @@ bool VM::execLODI(void) {
     if (!isRegValid(dst)) {
         return false;
     }
-    if (src < 0 || src + sizeof(uint16_t) >= as.getDatasize()) {
+    if (!wide && src + sizeof(uint16_t) >= as.getDatasize()) {
         DBG_ERROR(("Out of bounds: trying to access to invalid data address.\n"));
         return false;
     }
-    regs[dst] = *((uint16_t *) &as.getData()[src]);
+    regs[dst] = *((uint16_t *) &as.dataSection()[src]);
     return true;
 }
 
@@ -196,11 +431,11 @@ bool VM::execLODR(void) {
     if (!isRegValid(src) || !isRegValid(dst)) {
         return false;
     }
-    if (regs[src] < 0 || regs[src] + sizeof(uint16_t) >= as.getDatasize()) {
+    if (!wide && regs[src] + sizeof(uint16_t) >= as.getDatasize()) {
         DBG_ERROR(("Out of bounds: trying to access to invalid data address.\n"));
         return false;
     }
-    regs[dst] = *((uint16_t *) &as.getData()[regs[src]]);
+    regs[dst] = *((uint16_t *) &as.dataSection()[regs[src]]);
     return true;
 }
 
@@ -217,11 +452,12 @@ bool VM::execSTRI(void) {
     if (!isRegValid(dst)) {
         return false;
     }
-    if (dst < 0 || dst + sizeof(uint16_t) >= as.getDatasize()) {
+    if (!wide && dst + sizeof(uint16_t) >= as.getDatasize()) {
         DBG_ERROR(("Out of bounds: trying to access to invalid data address.\n"));
         return false;
     }
-    *((uint16_t *) &as.getData()[dst]) = regs[src];
+    *((uint16_t *) &as.dataSection()[dst]) = regs[src];
+    as.markData(dst + sizeof(uint16_t));
     return true;
 }
 
@@ -238,11 +474,12 @@ bool VM::execSTRR(void) {
     if (!isRegValid(src) || !isRegValid(dst)) {
         return false;
     }
-    if (regs[dst] < 0 || regs[dst] + sizeof(uint16_t) >= as.getDatasize()) {
+    if (!wide && regs[dst] + sizeof(uint16_t) >= as.getDatasize()) {
         DBG_ERROR(("Out of bounds: trying to access to invalid data address.\n"));
         return false;
     }
-    *((uint16_t *) &as.getData()[regs[dst]]) = regs[src];
+    *((uint16_t *) &as.dataSection()[regs[dst]]) = regs[src];
+    as.markData(regs[dst] + sizeof(uint16_t));
     return true;
 }
 
@@ -640,11 +877,12 @@ bool VM::execPUSH(void) {
     if (!isRegValid(reg)) {
         return false;
     }
-    if (regs[SP] + sizeof(uint16_t) >= as.getStacksize()) {
+    if (!wide && regs[SP] + sizeof(uint16_t) >= as.getStacksize()) {
         DBG_ERROR(("Out of bounds: stack is going over the stack size!\n"));
         return false;
     }
-    memcpy(&as.getStack()[regs[SP]], &regs[reg], sizeof(uint16_t));
+    memcpy(&as.stackSection()[regs[SP]], &regs[reg], sizeof(uint16_t));
+    as.markStack(regs[SP] + sizeof(uint16_t));
     regs[SP] += sizeof(uint16_t);
     return true;
 }
@@ -664,7 +902,7 @@ bool VM::execPOOP(void) {
         return false;
     }
     regs[SP] -= sizeof(uint16_t);
-    memcpy(&regs[reg], &as.getStack()[regs[SP]], sizeof(uint16_t));
+    memcpy(&regs[reg], &as.stackSection()[regs[SP]], sizeof(uint16_t));
     return true;
 }
 
@@ -945,7 +1183,7 @@ bool VM::execCALL(void) {
         return false;
     }
     DBG_INFO(("CALL 0x%x\n", dst));
-    if (regs[SP] + sizeof(uint16_t) >= as.getStacksize()) {
+    if (!wide && regs[SP] + sizeof(uint16_t) >= as.getStacksize()) {
         DBG_ERROR(("Out of bounds: stack is going over the stack size!\n"));
         return false;
     }
@@ -954,7 +1192,8 @@ bool VM::execCALL(void) {
         return false;
     }
     regs[RP] = regs[IP] + 1 + sizeof(dst);
-    *((uint16_t *) &as.getStack()[regs[SP]]) = regs[RP];
+    *((uint16_t *) &as.stackSection()[regs[SP]]) = regs[RP];
+    as.markStack(regs[SP] + sizeof(uint16_t));
     regs[SP] += sizeof(uint16_t);
     regs[IP] = dst;
     return true;
@@ -998,42 +1237,258 @@ bool VM::execDEBG(void) {
     return true;
 }
 
-void VM::run(void) {
-    uint8_t next_instr, i;
-    instruction_t *instr_p = NULL;
-    bool success;
+bool VM::execWAT(void) {
+    DBG_ERROR(("WAT: 0x%x\n", as.getCode()[regs[IP]]));
+    return false;
+}
+
+statuses VM::run(uint64_t max_instructions) {
+    statuses status;
+
+    budget = max_instructions;
+    switch (engine) {
+    case ENGINE_THREADED:
+        status = runFast<ENGINE_THREADED>();
+        break;
+    case ENGINE_PREDECODED:
+        status = runFast<ENGINE_PREDECODED>();
+        break;
+    case ENGINE_BLOCKS:
+        status = runFast<ENGINE_BLOCKS>();
+        break;
+    case ENGINE_VERIFIED:
+        status = runFast<ENGINE_VERIFIED>();
+        break;
+    case ENGINE_JIT:
+    case ENGINE_TRACE:
+        status = runJIT();
+        break;
+    default:
+        status = runHandlers();
+        break;
+    }
+    /*
+     * The block engines pay for a whole block when they enter it, and stop
+     * before the first one the budget can't cover: the handlers run what is
+     * left of it.
+     */
+    if (status == VM_EXHAUSTED && budget > 0) {
+        status = runHandlers();
+    }
+    return status;
+}
+
+statuses VM::step(void) {
+    budget = 1;
+    return runHandlers();
+}
+
+void VM::reset(void) {
+    uint8_t i;
+
+    for (i = R0; i < NUM_REGS; i++) {
+        regs[i] = 0;
+    }
+    memset(&flags, 0, sizeof(uint16_t));
+    as.clear();
+    return;
+}
+
+bool VM::reload(uint8_t *code, uint32_t codesize, uint8_t *data, uint32_t datasize) {
+    uint8_t *section = as.getCode();
+    uint32_t size = as.getCodesize();
+    bool same;
+
+    if (codesize > size || datasize > as.getDatasize()) {
+        DBG_ERROR(("The reloaded program does not fit.\n"));
+        return false;
+    }
+    reset();
+    /*
+     * The same program again keeps whatever the engine built from it. The
+     * rest of the section is all zeroes when each byte equals the next one
+     * and the first is zero.
+     */
+    same = memcmp(section, code, codesize) == 0;
+    if (same && codesize < size) {
+        same = section[codesize] == 0 && memcmp(section + codesize, section + codesize + 1, size - codesize - 1) == 0;
+    }
+    if (!same) {
+        // insCode first: an adopted section becomes our own before we write it
+        as.insCode(code, codesize);
+        memset(as.getCode() + codesize, 0, size - codesize);
+    }
+    if (datasize) {
+        as.insData(data, datasize);
+    }
+    return true;
+}
+
+statuses VM::runHandlers(void) {
+    const instruction_t *instr_p;
+    statuses status = VM_EXHAUSTED;
     bool finished = false;
     while (!finished) {
-        next_instr = (uint8_t) as.getCode()[regs[IP]];
-
-        // getting pointer to correct instruction_t
-        for (i = 0; i < NUM_OPS; i++) {
-            if (next_instr == INSTR[i].value) {
-                instr_p = &INSTR[i];
-            }
+        if (regs[IP] >= as.getCodesize()) {
+            DBG_ERROR(("Out of bounds: IP is outside the code section.\n"));
+            status = VM_FAULTED;
+            break;
         }
-
-        if (instr_p == NULL) {
-            DBG_ERROR(("WAT: 0x%x", next_instr));
+        if (budget == 0) {
+            return VM_EXHAUSTED;
+        }
+        budget--;
+        instr_p = DECODE[as.getCode()[regs[IP]]];
+
+        /*
+         * Eye bleeding ahead
+         */
+        if (!(this->*(instr_p->exec))()) {
+            DBG_ERROR(("%s failed.\n", instr_p->name));
+            status = instr_p == &INSTR[SHIT] ? VM_HALTED : VM_FAULTED;
             finished = true;
         } else {
-            /*
-             * Eye bleeding ahead
-             */
-            success = (this->*(instr_p->exec))();
-
-            if (!success) {
-                DBG_ERROR(("%s failed.\n", instr_p->name));
-                finished = true;
-            } else {
-                if (!instr_p->isJump) {
-                    regs[IP] += instr_p->length;
-                }
+            if (!instr_p->isJump) {
+                regs[IP] += instr_p->length;
             }
         }
     }
     DBG_INFO(("Finished.\n"));
-    return;
+    return status;
+}
+
+std::shared_ptr<const VMSnapshot> VM::snapshot(void) {
+    std::shared_ptr<VMSnapshot> snapshot = std::make_shared<VMSnapshot>();
+
+    snapshot->space = as.snapshot();
+    if (!snapshot->space) {
+        return NULL;
+    }
+    memcpy(snapshot->regs, regs, sizeof(snapshot->regs));
+    memcpy(&snapshot->flagsWord, &flags, sizeof(snapshot->flagsWord));
+    snapshot->engine = engine;
+    snapshot->iset = iset;
+    return snapshot;
+}
+
+std::unique_ptr<VM> VM::fork(void) {
+    std::shared_ptr<const VMSnapshot> frozen = snapshot();
+
+    if (!frozen) {
+        return NULL;
+    }
+    return std::unique_ptr<VM>(new VM(frozen));
+}
+
+// FNV-1a
+uint64_t VM::fingerprint(const instruction_set_t *set) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    uint32_t i;
+
+    for (i = 0; i < NUM_OPS; i++) {
+        hash = (hash ^ set->INSTR[i].value) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/*
+ * The header goes in last, so that a file cut short by a crash is never
+ * taken for a checkpoint.
+ */
+bool VM::checkpoint(int fd) {
+#ifdef CHECKPOINT_SUPPORTED
+    checkpoint_header_t header;
+    std::shared_ptr<const SpaceImage> space;
+
+    memset(&header, 0, sizeof(header));
+    if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+        DBG_ERROR(("Couldn't write the checkpoint.\n"));
+        return false;
+    }
+    space = as.snapshot(fd, sizeof(header));
+    if (!space) {
+        return false;
+    }
+    header.magic = CHECKPOINT_MAGIC;
+    header.version = CHECKPOINT_VERSION;
+    header.engine = engine;
+    header.options = space->options;
+    memcpy(&header.flagsWord, &flags, sizeof(header.flagsWord));
+    header.fingerprint = fingerprint(iset.get());
+    memcpy(header.regs, regs, sizeof(header.regs));
+    header.codesize = space->codesize;
+    header.datasize = space->datasize;
+    header.stacksize = space->stacksize;
+    header.dataDirty = space->dataDirty;
+    header.stackDirty = space->stackDirty;
+    header.codeAt = space->codeAt;
+    header.dataAt = space->dataAt;
+    header.stackAt = space->stackAt;
+    return pwrite(fd, &header, sizeof(header), 0) == sizeof(header);
+#else
+    return false;
+#endif
+}
+
+std::shared_ptr<const VMSnapshot> VM::restore(uint8_t *key, int fd) {
+#ifdef CHECKPOINT_SUPPORTED
+    checkpoint_header_t header;
+    std::shared_ptr<VMSnapshot> snapshot = std::make_shared<VMSnapshot>();
+    std::shared_ptr<SpaceImage> space;
+    std::vector<uint8_t> code;
+    struct stat st;
+    uint64_t size;
+
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header) || header.magic != CHECKPOINT_MAGIC ||
+        header.version != CHECKPOINT_VERSION) {
+        DBG_ERROR(("Not a checkpoint of this version.\n"));
+        return NULL;
+    }
+    snapshot->iset = instructionSet(key);
+    if (fingerprint(snapshot->iset.get()) != header.fingerprint) {
+        DBG_ERROR(("The checkpoint was taken with another key.\n"));
+        return NULL;
+    }
+    // anything mapped or read has to be in the file
+    size = fstat(fd, &st) == 0 ? st.st_size : 0;
+    if (header.engine > ENGINE_VERIFIED || (header.options & ~(AS_GUARDED | AS_WIDE)) ||
+        header.codesize > MAX_CODESIZE || header.dataDirty > header.datasize ||
+        header.stackDirty > header.stacksize ||
+        (header.options & AS_WIDE ? header.datasize != WIDE_SEGMENT || header.stacksize != WIDE_SEGMENT
+                                  : header.datasize > MAX_DATASIZE) ||
+        header.codeAt + header.codesize > size || header.dataAt + header.dataDirty > size ||
+        header.stackAt + header.stackDirty > size) {
+        DBG_ERROR(("The checkpoint is damaged.\n"));
+        return NULL;
+    }
+    code.resize(header.codesize);
+    if (pread(fd, code.data(), code.size(), header.codeAt) != (ssize_t) code.size()) {
+        DBG_ERROR(("Couldn't read the code section.\n"));
+        return NULL;
+    }
+    space.reset(new SpaceImage());
+    space->fd = dup(fd);
+    if (space->fd < 0) {
+        return NULL;
+    }
+    space->options = header.options;
+    space->codesize = header.codesize;
+    space->datasize = header.datasize;
+    space->stacksize = header.stacksize;
+    space->dataDirty = header.dataDirty;
+    space->stackDirty = header.stackDirty;
+    space->codeAt = header.codeAt;
+    space->dataAt = header.dataAt;
+    space->stackAt = header.stackAt;
+    space->code = std::make_shared<CodeImage>(code.data(), code.size());
+    memcpy(snapshot->regs, header.regs, sizeof(snapshot->regs));
+    snapshot->flagsWord = header.flagsWord;
+    snapshot->engine = (engines) header.engine;
+    snapshot->space = space;
+    return snapshot;
+#else
+    return NULL;
+#endif
 }
 
 VMAddrSpace *VM::addressSpace() {
@@ -1046,3 +1501,10 @@ uint16_t VM::reg(uint8_t reg) {
     }
     return regs[reg];
 }
+
+uint16_t VM::flagsWord(void) {
+    uint16_t word;
+
+    memcpy(&word, &flags, sizeof(word));
+    return word;
+}
@@ -2,10 +2,21 @@
 #define VM_H
 
 #include "vmas.h"
+#include "jit.h"
 #include <stdint.h>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
 #include "instruction.h"
 
 
+class Emitter;
+class VMSnapshot;
+
+// bumped every time the layout of VM::checkpoint files changes
+#define CHECKPOINT_VERSION 1
+
 enum regs {
     R0, R1, R2, R3, S0, S1, S2, S3, IP, RP, SP, NUM_REGS
 };
@@ -14,135 +25,220 @@ typedef struct flags {
     uint8_t CF : 1;
 } flags_t;
 
+/*
+ * Interpreter cores run() can use. ENGINE_HANDLERS is the reference one:
+ * every other engine has to leave the VM in the very same state.
+ */
+enum engines {
+    ENGINE_HANDLERS, ENGINE_THREADED, ENGINE_PREDECODED, ENGINE_BLOCKS, ENGINE_JIT, ENGINE_TRACE,
+    ENGINE_VERIFIED
+};
+
+// why VM::run() returned
+enum statuses {
+    // on SHIT, IP still points to it
+    VM_HALTED,
+    // an instruction failed or IP left the code section
+    VM_FAULTED,
+    // the instruction budget ran out, run() again to go on
+    VM_EXHAUSTED
+};
+
 class VM {
 private:
+    friend class Recompiler;
+    friend class BatchVM;
+    friend class VMTask;
+    friend class VMSnapshot;
+
     typedef bool (VM::*FuncPointer)(void);
 
     typedef struct instruction {
         const char *name;
         uint8_t value;
-        const uint8_t length;
+        uint8_t length;
         VM::FuncPointer exec;
         bool isJump;
     } instruction_t;
 
+    /*
+     * An instruction as ENGINE_PREDECODED sees it: operands already pulled
+     * out of the code section and checked. op is the INSTR index, or one of
+     * the values below.
+     */
+    enum decoded_ops {
+        // has to go through its exec* handler
+        DEC_SLOW = NUM_OPS,
+        // not decoded yet
+        DEC_UNDECODED,
+        // end of a block which does not end with a jump
+        DEC_CHAIN,
+        /*
+         * Superinstructions: two instructions run by a single dispatch.
+         * The second one's operands are in dst2, src2 and imm2.
+         */
+        DEC_CMPR_JPAI,
+        DEC_CMPR_JPBI,
+        DEC_CMPR_JPEI,
+        DEC_CMPR_JPNI,
+        DEC_CMPB_JPAI,
+        DEC_CMPB_JPBI,
+        DEC_CMPB_JPEI,
+        DEC_CMPB_JPNI,
+        DEC_CMPW_JPAI,
+        DEC_CMPW_JPBI,
+        DEC_CMPW_JPEI,
+        DEC_CMPW_JPNI,
+        DEC_MOVI_ADDR,
+        DEC_LODR_CMPB,
+        NUM_DECODED_OPS
+    };
+    typedef struct decoded {
+        uint8_t op;
+        uint8_t length;
+        uint8_t dst;
+        uint8_t src;
+        uint16_t imm;
+        uint8_t dst2;
+        uint8_t src2;
+        uint16_t imm2;
+    } decoded_t;
+    /*
+     * A straight run of decoded instructions, as ENGINE_BLOCKS sees it. It
+     * ends with a jump, SHIT or an instruction left to its handler. next
+     * remembers the first two blocks control went to from here.
+     */
+    typedef struct block {
+        uint16_t start;
+        std::vector<decoded_t> instrs;
+        struct block *next[2];
+        uint64_t runs;
+        // instructions in instrs, superinstructions count twice
+        uint32_t count;
+    } block_t;
+    // an instruction ENGINE_TRACE saw running, and where it went next
+    typedef struct trace_step {
+        decoded_t d;
+        uint16_t ip;
+        uint16_t next;
+    } trace_step_t;
+
+    /*
+     * What a key makes of the opcodes, built once per key by
+     * instructionSet and shared, read-only, by every VM using that key.
+     * Bytes which do not map to any instruction decode to WAT.
+     */
+    typedef struct instruction_set {
+        instruction_t INSTR[NUM_OPS];
+        instruction_t WAT;
+        const instruction_t *DECODE[256];
+        // opcode byte -> label, by the runFast LABELS they point into
+        mutable std::mutex lock;
+        mutable std::vector<std::pair<void *const *, std::unique_ptr<void *[]>>> dispatch;
+    } instruction_set_t;
+
+    // what every instruction touches first, in one cache line
     uint16_t regs[0xb];
     flags_t flags;
+    engines engine;
+    // AS_WIDE: no 16 bit address falls outside data or stack
+    bool wide;
+    // instructions run() may still execute
+    uint64_t budget;
+    // iset's tables, where the engines look them up
+    const instruction_t *const *DECODE;
+    const instruction_t *INSTR, *WAT;
     VMAddrSpace as;
-#ifdef DBG
-    instruction_t INSTR[NUM_OPS]{
-            {"MOVI", 0, MOVI_SIZE, &VM::execMOVI, false},
-            {"MOVR", 0, MOVR_SIZE, &VM::execMOVR, false},
-            {"LODI", 0, LODI_SIZE, &VM::execLODI, false},
-            {"LODR", 0, LODR_SIZE, &VM::execLODR, false},
-            {"STRI", 0, STRI_SIZE, &VM::execSTRI, false},
-            {"STRR", 0, STRR_SIZE, &VM::execSTRR, false},
-            {"ADDI", 0, ADDI_SIZE, &VM::execADDI, false},
-            {"ADDR", 0, ADDR_SIZE, &VM::execADDR, false},
-            {"SUBI", 0, SUBI_SIZE, &VM::execSUBI, false},
-            {"SUBR", 0, SUBR_SIZE, &VM::execSUBR, false},
-            {"ANDB", 0, ANDB_SIZE, &VM::execANDB, false},
-            {"ANDW", 0, ANDW_SIZE, &VM::execANDW, false},
-            {"ANDR", 0, ANDR_SIZE, &VM::execANDR, false},
-            {"YORB", 0, YORB_SIZE, &VM::execYORB, false},
-            {"YORW", 0, YORW_SIZE, &VM::execYORW, false},
-            {"YORR", 0, YORR_SIZE, &VM::execYORR, false},
-            {"XORB", 0, XORB_SIZE, &VM::execXORB, false},
-            {"XORW", 0, XORW_SIZE, &VM::execXORW, false},
-            {"XORR", 0, XORR_SIZE, &VM::execXORR, false},
-            {"NOTR", 0, NOTR_SIZE, &VM::execNOTR, false},
-            {"MULI", 0, MULI_SIZE, &VM::execMULI, false},
-            {"MULR", 0, MULR_SIZE, &VM::execMULR, false},
-            {"DIVI", 0, DIVI_SIZE, &VM::execDIVI, false},
-            {"DIVR", 0, DIVR_SIZE, &VM::execDIVR, false},
-            {"SHLI", 0, SHLI_SIZE, &VM::execSHLI, false},
-            {"SHLR", 0, SHLR_SIZE, &VM::execSHLR, false},
-            {"SHRI", 0, SHRI_SIZE, &VM::execSHRI, false},
-            {"SHRR", 0, SHRR_SIZE, &VM::execSHRR, false},
-            {"PUSH", 0, PUSH_SIZE, &VM::execPUSH, false},
-            {"POOP", 0, POOP_SIZE, &VM::execPOOP, false},
-            {"CMPB", 0, CMPB_SIZE, &VM::execCMPB, false},
-            {"CMPW", 0, CMPW_SIZE, &VM::execCMPW, false},
-            {"CMPR", 0, CMPR_SIZE, &VM::execCMPR, false},
-            {"JMPI", 0, JMPI_SIZE, &VM::execJMPI, true},
-            {"JMPR", 0, JMPR_SIZE, &VM::execJMPR, true},
-            {"JPAI", 0, JPAI_SIZE, &VM::execJPAI, true},
-            {"JPAR", 0, JPAR_SIZE, &VM::execJPAR, true},
-            {"JPBI", 0, JPBI_SIZE, &VM::execJPBI, true},
-            {"JPBR", 0, JPBR_SIZE, &VM::execJPBR, true},
-            {"JPEI", 0, JPEI_SIZE, &VM::execJPEI, true},
-            {"JPER", 0, JPER_SIZE, &VM::execJPER, true},
-            {"JPNI", 0, JPNI_SIZE, &VM::execJPNI, true},
-            {"JPNR", 0, JPNR_SIZE, &VM::execJPNR, true},
-            {"CALL", 0, CALL_SIZE, &VM::execCALL, true},
-            {"RETN", 0, RETN_SIZE, &VM::execRETN, true},
-            {"SHIT", 0, SHIT_SIZE, &VM::execSHIT, false},
-            {"NOPE", 0, NOPE_SIZE, &VM::execNOPE, false},
-            {"GRMN", 0, GRMN_SIZE, &VM::execGRMN, false},
-            {"DEBG", 0, DEBG_SIZE, &VM::execDEBG, false}
-    };
-#else
-    instruction_t INSTR[NUM_OPS]{
-            {"MOVI", 0, MOVI_SIZE, &VM::execMOVI, false},
-            {"MOVR", 0, MOVR_SIZE, &VM::execMOVR, false},
-            {"LODI", 0, LODI_SIZE, &VM::execLODI, false},
-            {"LODR", 0, LODR_SIZE, &VM::execLODR, false},
-            {"STRI", 0, STRI_SIZE, &VM::execSTRI, false},
-            {"STRR", 0, STRR_SIZE, &VM::execSTRR, false},
-            {"ADDI", 0, ADDI_SIZE, &VM::execADDI, false},
-            {"ADDR", 0, ADDR_SIZE, &VM::execADDR, false},
-            {"SUBI", 0, SUBI_SIZE, &VM::execSUBI, false},
-            {"SUBR", 0, SUBR_SIZE, &VM::execSUBR, false},
-            {"ANDB", 0, ANDB_SIZE, &VM::execANDB, false},
-            {"ANDW", 0, ANDW_SIZE, &VM::execANDW, false},
-            {"ANDR", 0, ANDR_SIZE, &VM::execANDR, false},
-            {"YORB", 0, YORB_SIZE, &VM::execYORB, false},
-            {"YORW", 0, YORW_SIZE, &VM::execYORW, false},
-            {"YORR", 0, YORR_SIZE, &VM::execYORR, false},
-            {"XORB", 0, XORB_SIZE, &VM::execXORB, false},
-            {"XORW", 0, XORW_SIZE, &VM::execXORW, false},
-            {"XORR", 0, XORR_SIZE, &VM::execXORR, false},
-            {"NOTR", 0, NOTR_SIZE, &VM::execNOTR, false},
-            {"MULI", 0, MULI_SIZE, &VM::execMULI, false},
-            {"MULR", 0, MULR_SIZE, &VM::execMULR, false},
-            {"DIVI", 0, DIVI_SIZE, &VM::execDIVI, false},
-            {"DIVR", 0, DIVR_SIZE, &VM::execDIVR, false},
-            {"SHLI", 0, SHLI_SIZE, &VM::execSHLI, false},
-            {"SHLR", 0, SHLR_SIZE, &VM::execSHLR, false},
-            {"SHRI", 0, SHRI_SIZE, &VM::execSHRI, false},
-            {"SHRR", 0, SHRR_SIZE, &VM::execSHRR, false},
-            {"PUSH", 0, PUSH_SIZE, &VM::execPUSH, false},
-            {"POOP", 0, POOP_SIZE, &VM::execPOOP, false},
-            {"CMPB", 0, CMPB_SIZE, &VM::execCMPB, false},
-            {"CMPW", 0, CMPW_SIZE, &VM::execCMPW, false},
-            {"CMPR", 0, CMPR_SIZE, &VM::execCMPR, false},
-            {"JMPI", 0, JMPI_SIZE, &VM::execJMPI, true},
-            {"JMPR", 0, JMPR_SIZE, &VM::execJMPR, true},
-            {"JPAI", 0, JPAI_SIZE, &VM::execJPAI, true},
-            {"JPAR", 0, JPAR_SIZE, &VM::execJPAR, true},
-            {"JPBI", 0, JPBI_SIZE, &VM::execJPBI, true},
-            {"JPBR", 0, JPBR_SIZE, &VM::execJPBR, true},
-            {"JPEI", 0, JPEI_SIZE, &VM::execJPEI, true},
-            {"JPER", 0, JPER_SIZE, &VM::execJPER, true},
-            {"JPNI", 0, JPNI_SIZE, &VM::execJPNI, true},
-            {"JPNR", 0, JPNR_SIZE, &VM::execJPNR, true},
-            {"CALL", 0, CALL_SIZE, &VM::execCALL, true},
-            {"RETN", 0, RETN_SIZE, &VM::execRETN, true},
-            {"SHIT", 0, SHIT_SIZE, &VM::execSHIT, false},
-            {"NOPE", 0, NOPE_SIZE, &VM::execNOPE, false},
-            {"GRMN", 0, GRMN_SIZE, &VM::execGRMN, false},
-    };
-#endif
+    std::shared_ptr<const instruction_set_t> iset;
+    // one entry per code address, filled lazily
+    std::vector<decoded_t> decoded;
+    uint32_t decodedVersion;
+    // decoded, or sharedDecoded for a CodeImage
+    decoded_t *decodedAt;
+    std::shared_ptr<const std::vector<decoded_t>> sharedDecoded;
+    // blocks never move once translated, blockAt indexes them by address
+    std::vector<std::unique_ptr<block_t>> blocks;
+    std::vector<block_t *> blockAt;
+    uint32_t blocksVersion;
+    // native code of every compiled block, by address
+    CodeCache jitCache;
+    std::vector<uint8_t *> jitAt;
+    uint32_t jitVersion;
+    uint8_t *jitEnter, *jitExit;
+    // back-edge counters and compiled loops, by loop header
+    std::vector<uint16_t> jitHeat;
+    std::vector<uint8_t *> traceAt;
+    uint32_t tracesCompiled;
+    uint64_t fusionsFired[NUM_DECODED_OPS - DEC_CMPR_JPAI];
+    // instructions VM::verify reached, and whether all of them passed
+    std::vector<bool> verified;
+    uint32_t verifiedVersion;
+    bool verifiedOk;
+    /*
+     * Opcode byte -> label of the runFast instance whose LABELS is
+     * dispatchFor, kept in iset so that VMs with the same key build it once.
+     */
+    void *const *dispatch;
+    void *const *dispatchFor;
 
     ////////////////////////
     // FUNCTIONS
     ///////////////////////
     void initVariables(void);
 
+    // the instructions in INSTR order, with no opcode values yet
+    static const instruction_t INSTRUCTIONS[NUM_OPS];
+
+    static std::shared_ptr<const instruction_set_t> instructionSet(uint8_t *key);
+
+    void *const *dispatchTable(void *const *labels);
+
+    // a hash of the opcodes set gives every instruction, which depend on the key only
+    static uint64_t fingerprint(const instruction_set_t *set);
+
     void encryptOpcodes(uint8_t *key);
 
     bool isRegValid(uint8_t reg);
 
+    statuses runHandlers(void);
+
+    /*
+     * COUNTED: every dispatch pays for its instruction out of the budget.
+     * WIDE: data and stack are AS_WIDE, no bounds to check on them.
+     */
+    template<engines ENGINE, bool COUNTED = false, bool WIDE = false>
+    statuses runFast(void);
+
+    void predecode(void);
+
+    void decode(uint16_t ip, decoded_t *d);
+
+    void decodeOne(uint16_t ip, decoded_t *d);
+
+    void fuse(uint16_t ip, decoded_t *d);
+
+    bool verifyOne(uint16_t ip, std::vector<uint16_t> &next);
+
+    bool endsBlock(uint8_t op);
+
+    uint8_t instructions(uint8_t op);
+
+    void decodeBlock(uint16_t ip, std::vector<decoded_t> &instrs);
+
+    block_t *translate(uint16_t ip);
+
+    statuses runJIT(void);
+
+    bool flushJIT(void);
+
+    uint8_t *compile(uint16_t ip);
+
+    uint8_t emitStraight(Emitter &e, decoded_t *d, uint32_t ip, bool checks, bool flags);
+
+    uint8_t recordTrace(std::vector<trace_step_t> &trace);
+
+    uint8_t *compileTrace(uint16_t head, std::vector<trace_step_t> &trace);
+
     template<typename T>
     bool isDivArgValid(T arg) {
         if (arg == 0) {
@@ -257,18 +353,104 @@ private:
 
     bool execDEBG(void);
 
+    bool execWAT(void);
+
 public:
-    VM(uint8_t *key);
+    // options and resource: see VMAddrSpace
+    VM(uint8_t *key, engines engine = ENGINE_HANDLERS, uint8_t options = 0,
+       std::pmr::memory_resource *resource = NULL);
+
+    VM(uint8_t *key, uint8_t *code, uint32_t codesize, engines engine = ENGINE_HANDLERS, uint8_t options = 0,
+       std::pmr::memory_resource *resource = NULL);
+
+    // runs image, see VMAddrSpace::shareCode
+    VM(uint8_t *key, std::shared_ptr<const CodeImage> image, engines engine = ENGINE_HANDLERS, uint8_t options = 0,
+       std::pmr::memory_resource *resource = NULL);
 
-    VM(uint8_t *key, uint8_t *code, uint32_t codesize);
+    /*
+     * Goes on from where the VM snapshot was taken from stopped, sharing its
+     * code and opcodes, see VMAddrSpace(std::shared_ptr<const SpaceImage>).
+     */
+    VM(std::shared_ptr<const VMSnapshot> snapshot, std::pmr::memory_resource *resource = NULL);
 
     void status(void);
 
-    void run();
+    /*
+     * Runs at most max_instructions instructions, a superinstruction
+     * counting as the two it fuses, and leaves the VM ready to go on from
+     * where it stopped.
+     */
+    statuses run(uint64_t max_instructions = UINT64_MAX);
+
+    // runs a single instruction through its handler
+    statuses step(void);
+
+    /*
+     * Back to the state the VM was built in, without building it again:
+     * registers, flags, data and stack are zeroed, the code section, the
+     * opcode table and anything the engine built from the code are kept.
+     */
+    void reset(void);
+
+    /*
+     * reset() with a new program and data section. Loading the same
+     * program again keeps what the engine built from it. False if they
+     * don't fit, leaving the VM as it was.
+     */
+    bool reload(uint8_t *code, uint32_t codesize, uint8_t *data = NULL, uint32_t datasize = 0);
+
+    /*
+     * Freezes registers, flags and the address space as they are now, for
+     * VMs to go on from there. NULL without mmap.
+     */
+    std::shared_ptr<const VMSnapshot> snapshot(void);
+
+    // a VM going on from where this one is, through snapshot(); NULL without mmap
+    std::unique_ptr<VM> fork(void);
+
+    /*
+     * Writes a snapshot() into fd, from its start: registers, flags, engine,
+     * a fingerprint of the opcodes and the sections, in a file restore()
+     * maps back. False if it couldn't write it, or without mmap.
+     */
+    bool checkpoint(int fd);
+
+    /*
+     * The snapshot checkpoint wrote into fd, with data and stack mapped from
+     * the file copy-on-write. NULL if fd isn't a checkpoint of this
+     * CHECKPOINT_VERSION, or key doesn't give the opcodes it was taken with.
+     */
+    static std::shared_ptr<const VMSnapshot> restore(uint8_t *key, int fd);
 
     VMAddrSpace *addressSpace();
 
     uint16_t reg(uint8_t);
+
+    // ZF and CF, with the byte after them they make register 11, see isRegValid
+    uint16_t flagsWord(void);
+
+    uint64_t fusions(void);
+
+    void fusionReport(void);
+
+    void blockReport(void);
+
+    uint32_t traces(void);
+
+    bool verify(void);
+};
+
+// a VM frozen by VM::snapshot(), read-only and shared by the VMs built from it
+class VMSnapshot {
+private:
+    friend class VM;
+
+    uint16_t regs[NUM_REGS];
+    // the flags and the byte after them, register 11, see VM::isRegValid
+    uint16_t flagsWord;
+    engines engine;
+    std::shared_ptr<const VM::instruction_set_t> iset;
+    std::shared_ptr<const SpaceImage> space;
 };
 
 
@@ -1,88 +1,234 @@
 #include "vmas.h"
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <algorithm>
 #include <new>
 #include <stdexcept>
 
+#if defined(__unix__) || defined(__APPLE__)
+#define MMAP_SUPPORTED
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static size_t roundToPages(size_t size, size_t page) {
+    return (size + page - 1) / page * page;
+}
+
 VMAddrSpace::VMAddrSpace() {
     stack = NULL;
     code = NULL;
     data = NULL;
+    codeVersion = 0;
+    options = 0;
+    dataDirty = 0;
+    stackDirty = 0;
+    arena = NULL;
+    arenaSize = 0;
+    arenaMapped = false;
+    resource = std::pmr::get_default_resource();
+    codeOwner = OWNER_SPACE;
+    dataOwner = OWNER_SPACE;
+    stackOwner = OWNER_SPACE;
     stacksize = DEFAULT_STACKSIZE;
     codesize = DEFAULT_CODESIZE;
     datasize = DEFAULT_DATASIZE;
-    allocate();
+    allocate(0);
     return;
 }
 
-VMAddrSpace::VMAddrSpace(uint32_t ss, uint16_t cs, uint16_t ds) {
+VMAddrSpace::VMAddrSpace(uint32_t ss, uint16_t cs, uint16_t ds, uint8_t options,
+                         std::pmr::memory_resource *resource) {
     stack = NULL;
     code = NULL;
     data = NULL;
+    codeVersion = 0;
+    dataDirty = 0;
+    stackDirty = 0;
+    arena = NULL;
+    arenaSize = 0;
+    arenaMapped = false;
+    this->options = options;
+    this->resource = resource ? resource : std::pmr::get_default_resource();
+    codeOwner = OWNER_SPACE;
+    dataOwner = OWNER_SPACE;
+    stackOwner = OWNER_SPACE;
     if (cs > MAX_CODESIZE) {
         throw std::invalid_argument("Trying to initialize the address space with a bigger codesize.");
     }
     if (ds > MAX_DATASIZE) {
         throw std::invalid_argument("Trying to initialize the address space with a bigger datasize.");
     }
-    stacksize = ss;
+    stacksize = options & AS_WIDE ? WIDE_SEGMENT : ss;
     codesize = cs;
-    datasize = ds;
-    allocate();
+    datasize = options & AS_WIDE ? WIDE_SEGMENT : ds;
+    allocate(options);
     return;
 }
 
-VMAddrSpace::~VMAddrSpace() {
-    if (stack) {
-        delete[] stack;
+VMAddrSpace::VMAddrSpace(std::shared_ptr<const SpaceImage> image, std::pmr::memory_resource *resource) {
+    stack = NULL;
+    code = NULL;
+    data = NULL;
+    codeVersion = 0;
+    arena = NULL;
+    arenaSize = 0;
+    arenaMapped = false;
+    this->resource = resource ? resource : std::pmr::get_default_resource();
+    codeOwner = OWNER_SPACE;
+    dataOwner = OWNER_MAPPING;
+    stackOwner = OWNER_MAPPING;
+    if (!image) {
+        throw std::invalid_argument("Trying to initialize the address space from no image.");
     }
-    if (code) {
-        delete[] code;
+    options = image->options;
+    stacksize = image->stacksize;
+    codesize = 0;
+    datasize = image->datasize;
+    dataDirty = image->dataDirty;
+    stackDirty = image->stackDirty;
+    data = mapSection(datasize, image->fd, image->dataAt, dataDirty);
+    stack = mapSection(stacksize, image->fd, image->stackAt, stackDirty);
+    if (data == NULL || stack == NULL || !shareCode(image->code)) {
+        release(data, datasize, dataOwner);
+        release(stack, stacksize, stackOwner);
+        throw std::bad_alloc();
     }
-    if (data) {
-        delete[] data;
+    return;
+}
+
+VMAddrSpace::~VMAddrSpace() {
+    release(stack, stacksize, stackOwner);
+    release(code, codesize, codeOwner);
+    release(data, datasize, dataOwner);
+#ifdef MMAP_SUPPORTED
+    if (arena && arenaMapped) {
+        munmap(arena, arenaSize);
+        return;
+    }
+#endif
+    if (arena) {
+        resource->deallocate(arena, arenaSize, 1);
     }
     return;
 }
 
-bool VMAddrSpace::allocate(void) {
-    DBG_INFO(("Allocating sections...\n"));
+bool VMAddrSpace::inArena(uint8_t *section) {
+    return arena && section >= arena && section < arena + arenaSize;
+}
 
-    DBG_INFO(("\tcode...\n"));
-    code = new uint8_t[codesize];
-    DBG_INFO(("\tdata...\n"));
-    data = new uint8_t[datasize];
-    DBG_INFO(("\tstack...\n"));
-    stack = new uint8_t[stacksize];
+// frees whatever of section belongs to the address space, outside the arena
+void VMAddrSpace::release(uint8_t *section, uint32_t size, owners owner) {
+    if (section == NULL || owner == OWNER_CALLER || owner == OWNER_IMAGE || inArena(section)) {
+        return;
+    }
+#ifdef MMAP_SUPPORTED
+    if (owner == OWNER_MAPPING) {
+        size_t page = sysconf(_SC_PAGESIZE), lead = (uintptr_t) section % page;
 
-    if (code == NULL) {
-        DBG_ERROR(("Couldn't allocate code section.\n"));
-        throw std::bad_alloc();
+        munmap(section - lead, roundToPages(lead + size, page) + (options & AS_GUARDED ? page : 0));
+        return;
     }
-    if (data == NULL) {
-        DBG_ERROR(("Couldn't allocate data section.\n"));
-        throw std::bad_alloc();
+#endif
+    resource->deallocate(section, size, 1);
+    return;
+}
+
+bool VMAddrSpace::allocate(uint8_t options) {
+    bool sparse = codesize >= SPARSE_SECTION || datasize >= SPARSE_SECTION || stacksize >= SPARSE_SECTION;
+
+    if ((options || sparse) && allocateMapped(options & AS_GUARDED)) {
+        DBG_SUCC(("Done!\n"));
+        return true;
     }
-    if (stack == NULL) {
-        DBG_ERROR(("Couldn't allocate stack section.\n"));
+    /*
+     * code | data | stack, from a single allocation: one block per VM
+     * instead of three, sized by whatever size class the resource has.
+     */
+    DBG_INFO(("Allocating sections...\n"));
+    arenaSize = (size_t) codesize + datasize + stacksize;
+    arena = (uint8_t *) resource->allocate(arenaSize, 1);
+    if (arena == NULL) {
+        DBG_ERROR(("Couldn't allocate the sections.\n"));
         throw std::bad_alloc();
     }
-
-    memset(code, 0x0, codesize);
-    memset(stack, 0x0, stacksize);
-    memset(data, 0x0, datasize);
+    code = arena;
+    data = code + codesize;
+    stack = data + datasize;
+    memset(arena, 0x0, arenaSize);
     DBG_SUCC(("Done!\n"));
     return true;
 }
 
+/*
+ * guard | code | guard | data | guard | stack | guard
+ * Every section ends where the guard page after it starts, so that going
+ * past its end faults right away. Without guards the sections just follow
+ * each other. The mapping comes zeroed, and its pages only take memory
+ * once touched.
+ */
+bool VMAddrSpace::allocateMapped(bool guards) {
+#ifdef MMAP_SUPPORTED
+    size_t page = sysconf(_SC_PAGESIZE), guard = guards ? page : 0, at = guard, len;
+    uint32_t sizes[] = {codesize, datasize, stacksize};
+    uint8_t **sections[] = {&code, &data, &stack};
+    uint8_t *base;
+    void *mem;
+    uint32_t i;
+
+    DBG_INFO(("Mapping sections...\n"));
+    arenaSize = guard;
+    for (i = 0; i < 3; i++) {
+        arenaSize += roundToPages(sizes[i], page) + guard;
+    }
+    mem = mmap(NULL, arenaSize, guards ? PROT_NONE : PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem == MAP_FAILED) {
+        DBG_ERROR(("Couldn't map the sections.\n"));
+        return false;
+    }
+    base = (uint8_t *) mem;
+    for (i = 0; i < 3; i++) {
+        len = roundToPages(sizes[i], page);
+        if (guards && len && mprotect(base + at, len, PROT_READ | PROT_WRITE) != 0) {
+            DBG_ERROR(("Couldn't unprotect a section.\n"));
+            munmap(mem, arenaSize);
+            code = data = stack = NULL;
+            return false;
+        }
+        at += len;
+        *sections[i] = base + at - sizes[i];
+        at += guard;
+    }
+    arena = base;
+    arenaMapped = true;
+    return true;
+#else
+    return false;
+#endif
+}
+
 bool VMAddrSpace::insCode(uint8_t *buf, uint32_t size) {
+    uint8_t *own;
+
     if (code) {
         if (size > codesize) {
             DBG_ERROR(("The injected code size is too big!\n"));
             return false;
         }
+        if (codeOwner == OWNER_CALLER || codeOwner == OWNER_IMAGE) {
+            DBG_INFO(("Copying the adopted code into a section of our own.\n"));
+            own = (uint8_t *) resource->allocate(codesize, 1);
+            memcpy(own, code, codesize);
+            code = own;
+            codeOwner = OWNER_SPACE;
+            image.reset();
+        }
         DBG_INFO(("Copying buffer into code section.\n"));
         memcpy(code, buf, size);
+        codeVersion++;
     } else {
         DBG_ERROR(("Couldn't write into code section.\n"));
         return false;
@@ -98,6 +244,7 @@ bool VMAddrSpace::insStack(uint8_t *buf, uint32_t size) {
         }
         DBG_INFO(("Copying buffer into stack section.\n"));
         memcpy(stack, buf, size);
+        stackDirty = std::max(stackDirty, size);
     } else {
         DBG_ERROR(("Couldn't write into stack section.\n"));
         return false;
@@ -106,13 +253,18 @@ bool VMAddrSpace::insStack(uint8_t *buf, uint32_t size) {
 }
 
 bool VMAddrSpace::insData(uint8_t *buf, uint32_t size) {
+    return insData(0, buf, size);
+}
+
+bool VMAddrSpace::insData(uint32_t offset, uint8_t *buf, uint32_t size) {
     if (data) {
-        if (size > datasize) {
+        if (offset > datasize || size > datasize - offset) {
             DBG_ERROR(("The injected data size is too big!\n"));
             return false;
         }
         DBG_INFO(("Copying buffer into data section.\n"));
-        memcpy(data, buf, size);
+        memcpy(data + offset, buf, size);
+        dataDirty = std::max(dataDirty, offset + size);
     } else {
         DBG_ERROR(("Couldn't write into data section.\n"));
         return false;
@@ -120,6 +272,179 @@ bool VMAddrSpace::insData(uint8_t *buf, uint32_t size) {
     return true;
 }
 
+bool VMAddrSpace::adoptCode(const uint8_t *buf, uint32_t size) {
+    if (buf == NULL || size > MAX_CODESIZE) {
+        DBG_ERROR(("Couldn't adopt the code buffer.\n"));
+        return false;
+    }
+    release(code, codesize, codeOwner);
+    code = (uint8_t *) buf;
+    codesize = size;
+    codeOwner = OWNER_CALLER;
+    codeVersion++;
+    image.reset();
+    return true;
+}
+
+bool VMAddrSpace::shareCode(std::shared_ptr<const CodeImage> image) {
+    if (!image || !adoptCode(image->getCode(), image->getCodesize())) {
+        return false;
+    }
+    codeOwner = OWNER_IMAGE;
+    this->image = image;
+    return true;
+}
+
+const CodeImage *VMAddrSpace::getCodeImage() {
+    return image.get();
+}
+
+/*
+ * An anonymous mapping as big as the section, with size bytes of the file
+ * at offset mapped over its first pages, followed by an inaccessible page
+ * when guarded. mmap wants a page-aligned offset, so the section starts
+ * lead bytes into the mapping. NULL if it can't be mapped.
+ */
+uint8_t *VMAddrSpace::mapSection(uint32_t sectionSize, int fd, uint64_t offset, uint32_t size) {
+#ifdef MMAP_SUPPORTED
+    size_t page = sysconf(_SC_PAGESIZE), lead = offset % page, mapped = roundToPages(lead + size, page);
+    size_t len = roundToPages(lead + sectionSize, page), guard = options & AS_GUARDED ? page : 0;
+    uint8_t *base;
+    void *mem;
+
+    mem = mmap(NULL, len + guard, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem == MAP_FAILED) {
+        DBG_ERROR(("Couldn't map the section.\n"));
+        return NULL;
+    }
+    base = (uint8_t *) mem;
+    if ((guard && mprotect(base + len, guard, PROT_NONE) != 0) ||
+        (size && mmap(base, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, offset - lead) == MAP_FAILED)) {
+        DBG_ERROR(("Couldn't map the file.\n"));
+        munmap(mem, len + guard);
+        return NULL;
+    }
+    // whatever else the file has in its last page is not part of the section
+    memset(base + lead + size, 0x0, std::min<size_t>(mapped - lead - size, sectionSize - size));
+    return base + lead;
+#else
+    return NULL;
+#endif
+}
+
+bool VMAddrSpace::mapData(int fd, uint64_t offset, uint32_t size) {
+#ifdef MMAP_SUPPORTED
+    struct stat st;
+    uint8_t *mapped;
+
+    if (size > datasize || fstat(fd, &st) != 0 || offset + size > (uint64_t) st.st_size) {
+        DBG_ERROR(("The mapped data does not fit.\n"));
+        return false;
+    }
+    mapped = mapSection(datasize, fd, offset, size);
+    if (mapped == NULL) {
+        return false;
+    }
+    release(data, datasize, dataOwner);
+    data = mapped;
+    dataOwner = OWNER_MAPPING;
+    dataDirty = size;
+    return true;
+#else
+    return false;
+#endif
+}
+
+std::shared_ptr<const SpaceImage> VMAddrSpace::snapshot(void) {
+#ifdef MMAP_SUPPORTED
+    std::shared_ptr<const SpaceImage> image;
+    int fd;
+
+#ifdef MFD_CLOEXEC
+    fd = memfd_create("pasticciotto", MFD_CLOEXEC);
+#else
+    FILE *f = tmpfile();
+
+    fd = f ? dup(fileno(f)) : -1;
+    if (f) {
+        fclose(f);
+    }
+#endif
+    if (fd < 0) {
+        DBG_ERROR(("Couldn't create the snapshot file.\n"));
+        return NULL;
+    }
+    image = snapshot(fd, 0);
+    close(fd);
+    return image;
+#else
+    return NULL;
+#endif
+}
+
+/*
+ * code | data | stack, data and stack each ending at a page boundary of the
+ * file, so that mapped back they end right before the guard page, if any.
+ */
+std::shared_ptr<const SpaceImage> VMAddrSpace::snapshot(int fd, uint64_t at) {
+#ifdef MMAP_SUPPORTED
+    size_t page = sysconf(_SC_PAGESIZE);
+    std::shared_ptr<SpaceImage> image(new SpaceImage());
+    uint64_t sections = roundToPages(at + codesize, page);
+
+    image->options = options;
+    image->codesize = codesize;
+    image->datasize = datasize;
+    image->stacksize = stacksize;
+    image->dataDirty = dataDirty;
+    image->stackDirty = stackDirty;
+    image->codeAt = at;
+    image->dataAt = sections + roundToPages(datasize, page) - datasize;
+    image->stackAt = sections + roundToPages(datasize, page) + roundToPages(stacksize, page) - stacksize;
+    image->fd = dup(fd);
+    if (image->fd < 0 || pwrite(fd, code, codesize, image->codeAt) != (ssize_t) codesize ||
+        pwrite(fd, data, dataDirty, image->dataAt) != (ssize_t) dataDirty ||
+        pwrite(fd, stack, stackDirty, image->stackAt) != (ssize_t) stackDirty) {
+        DBG_ERROR(("Couldn't write the snapshot.\n"));
+        return NULL;
+    }
+    // the code is copied only if it isn't an image already
+    image->code = this->image ? this->image : std::make_shared<CodeImage>(code, codesize);
+    return image;
+#else
+    return NULL;
+#endif
+}
+
+/*
+ * The pages of a big section in the mapped arena go back to the system
+ * instead: only those which were touched cost anything, and they come back
+ * zeroed when touched again. No other section shares them, see
+ * allocateMapped, and past size the section is all zeroes already. The
+ * pages of a file mapping would come back as the file.
+ */
+void VMAddrSpace::zero(uint8_t *section, uint32_t size) {
+#ifdef MMAP_SUPPORTED
+    uintptr_t page = sysconf(_SC_PAGESIZE), first = (uintptr_t) section / page * page;
+    uintptr_t last = ((uintptr_t) section + size + page - 1) / page * page;
+
+    if (arenaMapped && inArena(section) && size >= SPARSE_SECTION) {
+        madvise((void *) first, last - first, MADV_DONTNEED);
+        return;
+    }
+#endif
+    memset(section, 0x0, size);
+    return;
+}
+
+void VMAddrSpace::clear(void) {
+    zero(data, dataDirty);
+    zero(stack, stackDirty);
+    dataDirty = 0;
+    stackDirty = 0;
+    return;
+}
+
 uint32_t VMAddrSpace::getStacksize() {
     return stacksize;
 }
@@ -132,7 +457,36 @@ uint32_t VMAddrSpace::getDatasize() {
     return datasize;
 }
 
+/*
+ * Bumped every time the code section is rewritten through insCode, so that
+ * anything cached from it knows it is stale.
+ */
+uint32_t VMAddrSpace::getCodeVersion() {
+    return codeVersion;
+}
+
+bool VMAddrSpace::isMapped() {
+    return arenaMapped;
+}
+
+owners VMAddrSpace::getCodeOwner() {
+    return codeOwner;
+}
+
+owners VMAddrSpace::getDataOwner() {
+    return dataOwner;
+}
+
+uint8_t VMAddrSpace::getOptions() {
+    return options;
+}
+
+owners VMAddrSpace::getStackOwner() {
+    return stackOwner;
+}
+
 uint8_t *VMAddrSpace::getStack() {
+    stackDirty = stacksize;
     return stack;
 }
 
@@ -141,5 +495,36 @@ uint8_t *VMAddrSpace::getCode() {
 }
 
 uint8_t *VMAddrSpace::getData() {
+    dataDirty = datasize;
     return data;
 }
+
+CodeImage::CodeImage(const uint8_t *code, uint32_t size) {
+    if (size > MAX_CODESIZE) {
+        throw std::invalid_argument("Trying to build an image bigger than the codesize.");
+    }
+    this->code.assign(code, code + size);
+    return;
+}
+
+SpaceImage::SpaceImage() {
+    fd = -1;
+    return;
+}
+
+SpaceImage::~SpaceImage() {
+#ifdef MMAP_SUPPORTED
+    if (fd >= 0) {
+        close(fd);
+    }
+#endif
+    return;
+}
+
+const uint8_t *CodeImage::getCode() const {
+    return code.data();
+}
+
+uint32_t CodeImage::getCodesize() const {
+    return code.size();
+}
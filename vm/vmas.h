@@ -1,26 +1,153 @@
 #ifndef VMAS_H
 #define VMAS_H
 
+#include <stddef.h>
 #include <stdint.h>
 #include "debug.h"
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <utility>
+#include <vector>
 
 #define DEFAULT_STACKSIZE 0x100
 #define DEFAULT_CODESIZE 0x300
 #define DEFAULT_DATASIZE 0x100
 #define MAX_CODESIZE 0xFFFF
 #define MAX_DATASIZE 0xFFFF
+// every uint16_t address, and the word at it, fits a section this big
+#define WIDE_SEGMENT (0x10000 + sizeof(uint16_t))
+/*
+ * Where mmap is, an address space with a section at least this big is
+ * mapped even without options, so that it only takes the pages it uses,
+ * and sections this big are cleared by handing their pages back.
+ */
+#define SPARSE_SECTION 0x4000
+
+/*
+ * VMAddrSpace options. AS_GUARDED carves all sections out of a single
+ * mapping, each of them ending right before an inaccessible page. AS_WIDE
+ * makes data and stack WIDE_SEGMENT bytes, so that no access to them can
+ * ever be out of bounds, mapped only as they are touched. Both need mmap,
+ * elsewhere AS_GUARDED is ignored and AS_WIDE sections are allocated whole.
+ */
+#define AS_GUARDED 0x1
+#define AS_WIDE 0x2
+
+/*
+ * Who a section belongs to. OWNER_SPACE ones are allocated and freed by the
+ * address space. OWNER_CALLER ones are a buffer lent by the caller, which
+ * the address space never writes to or frees: the caller keeps it alive and
+ * unchanged while it is in use. OWNER_MAPPING ones are a private mapping of
+ * a file, written copy-on-write and unmapped with the address space.
+ * OWNER_IMAGE ones are the bytes of a CodeImage, which the address space
+ * keeps alive.
+ */
+enum owners {
+    OWNER_SPACE,
+    OWNER_CALLER,
+    OWNER_MAPPING,
+    OWNER_IMAGE
+};
+
+/*
+ * A program many address spaces run at once, never written: its bytes and
+ * whatever the VMs running it derived from them once for all of them.
+ * Shared through std::shared_ptr, it lives as long as the last one using it.
+ */
+class CodeImage {
+private:
+    friend class VM;
+
+    std::vector<uint8_t> code;
+    // what VMs built from the code, by the instruction set it was built for
+    mutable std::mutex lock;
+    mutable std::vector<std::pair<std::shared_ptr<const void>, std::shared_ptr<const void>>> derived;
+
+public:
+    CodeImage(const uint8_t *code, uint32_t size);
+
+    const uint8_t *getCode() const;
+
+    uint32_t getCodesize() const;
+};
+
+/*
+ * An address space frozen by VMAddrSpace::snapshot: its code as a
+ * CodeImage, data and stack in a file every address space built from it
+ * maps privately. They all share its pages, each copying only those it
+ * writes to. Only the bytes below the high-water marks are in the file,
+ * the rest read as zeroes.
+ */
+class SpaceImage {
+private:
+    friend class VMAddrSpace;
+    // VM::checkpoint and VM::restore keep the fields in their header
+    friend class VM;
+
+    int fd;
+    uint8_t options;
+    uint32_t codesize, datasize, stacksize, dataDirty, stackDirty;
+    // where the sections start in the file, data and stack ending at a page boundary
+    uint64_t codeAt, dataAt, stackAt;
+    std::shared_ptr<const CodeImage> code;
+
+    SpaceImage();
+
+public:
+    ~SpaceImage();
+};
 
 class VMAddrSpace {
 private:
     uint32_t stacksize, codesize, datasize;
     uint8_t *stack, *code, *data;
+    uint32_t codeVersion;
+    uint8_t options;
+    /*
+     * High-water marks of the data and stack bytes which may not be zero.
+     * getData and getStack mark all of their section, the engines raise
+     * the marks past each store instead.
+     */
+    uint32_t dataDirty, stackDirty;
+    // the single block holding all sections, mapped or from resource
+    uint8_t *arena;
+    size_t arenaSize;
+    bool arenaMapped;
+    std::pmr::memory_resource *resource;
+    owners codeOwner, dataOwner, stackOwner;
+    // the image the code section belongs to, when codeOwner is OWNER_IMAGE
+    std::shared_ptr<const CodeImage> image;
 
-    bool allocate(void);
+    bool allocate(uint8_t options);
+
+    bool allocateMapped(bool guards);
+
+    void zero(uint8_t *section, uint32_t size);
+
+    bool inArena(uint8_t *section);
+
+    void release(uint8_t *section, uint32_t size, owners owner);
+
+    uint8_t *mapSection(uint32_t sectionSize, int fd, uint64_t offset, uint32_t size);
 
 public:
     VMAddrSpace();
 
-    VMAddrSpace(uint32_t ss, uint16_t cs, uint16_t ds);
+    /*
+     * options: AS_* above, with AS_WIDE ss and ds are ignored. Sections not
+     * mapped are allocated from resource, std::pmr::get_default_resource()
+     * when NULL, which must outlive the address space.
+     */
+    VMAddrSpace(uint32_t ss, uint16_t cs, uint16_t ds, uint8_t options = 0,
+                std::pmr::memory_resource *resource = NULL);
+
+    /*
+     * A copy of the address space image was taken from, sharing its code
+     * and mapping its data and stack copy-on-write: building it costs a few
+     * system calls, then every page it touches costs one copy.
+     */
+    VMAddrSpace(std::shared_ptr<const SpaceImage> image, std::pmr::memory_resource *resource = NULL);
 
     ~VMAddrSpace();
 
@@ -36,12 +163,89 @@ public:
 
     uint32_t getDatasize();
 
+    uint32_t getCodeVersion();
+
+    // whether the sections come from a single mapping
+    bool isMapped();
+
     bool insStack(uint8_t *buf, uint32_t size);
 
     bool insCode(uint8_t *buf, uint32_t size);
 
     bool insData(uint8_t *buf, uint32_t size);
 
+    // copies buf at offset into the data section, leaving the rest as it is
+    bool insData(uint32_t offset, uint8_t *buf, uint32_t size);
+
+    /*
+     * The code section becomes buf itself, codesize becomes size. The next
+     * insCode copies it into a section of the address space first.
+     */
+    bool adoptCode(const uint8_t *buf, uint32_t size);
+
+    /*
+     * The data section becomes a private mapping of size bytes of the file
+     * at offset, followed by zeroes up to datasize. Pages are only read
+     * once touched and only copied once written. Needs mmap.
+     */
+    bool mapData(int fd, uint64_t offset, uint32_t size);
+
+    // as adoptCode, with the code of image, which is kept alive until replaced
+    bool shareCode(std::shared_ptr<const CodeImage> image);
+
+    // the image the code section belongs to, NULL if none
+    const CodeImage *getCodeImage();
+
+    owners getCodeOwner();
+
+    owners getDataOwner();
+
+    owners getStackOwner();
+
+    // the AS_* options the address space was built with
+    uint8_t getOptions();
+
+    /*
+     * Freezes the address space as it is now, copying the data and stack
+     * bytes below their high-water marks once. It goes on as before, later
+     * writes don't show in the image. NULL without mmap.
+     */
+    std::shared_ptr<const SpaceImage> snapshot(void);
+
+    /*
+     * As snapshot(), into fd from at on, the code section included, for
+     * files which outlive the process. The image maps a duplicate of fd.
+     */
+    std::shared_ptr<const SpaceImage> snapshot(int fd, uint64_t at);
+
+    // zeroes data and stack up to their high-water marks
+    void clear(void);
+
+    /*
+     * For the engines: the sections as getData and getStack, without
+     * marking them. Whatever is written through them has to raise the
+     * marks past it with markData and markStack.
+     */
+    uint8_t *dataSection() {
+        return data;
+    }
+
+    uint8_t *stackSection() {
+        return stack;
+    }
+
+    void markData(uint32_t top) {
+        if (top > dataDirty) {
+            dataDirty = top;
+        }
+    }
+
+    void markStack(uint32_t top) {
+        if (top > stackDirty) {
+            stackDirty = top;
+        }
+    }
+
     template<typename src_t, typename dst_t>
     bool getArgs(uint32_t idx, src_t *src, dst_t *dst, uint8_t flag_byte_op = 0) {
         if (sizeof(*src) == sizeof(*dst)) {